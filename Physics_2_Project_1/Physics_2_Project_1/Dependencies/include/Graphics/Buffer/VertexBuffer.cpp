@@ -6,6 +6,8 @@ VertexBuffer::VertexBuffer()
 
 VertexBuffer::VertexBuffer(unsigned int size, const void* data)
 {
+	allocatedSize = size;
+
 	GLCALL(glGenBuffers(1, &rendererID));
 	GLCALL(glBindBuffer(GL_ARRAY_BUFFER, rendererID));
 	GLCALL(glBufferData(GL_ARRAY_BUFFER, size, data, GL_STATIC_DRAW));
@@ -28,6 +30,8 @@ void VertexBuffer::UnBind() const
 
 void VertexBuffer::Setup(unsigned int size, const void* data)
 {
+	allocatedSize = size;
+
 	GLCALL(glGenBuffers(1, &rendererID));
 	GLCALL(glBindBuffer(GL_ARRAY_BUFFER, rendererID));
 	GLCALL(glBufferData(GL_ARRAY_BUFFER, size, data, GL_STATIC_DRAW));
@@ -36,6 +40,15 @@ void VertexBuffer::Setup(unsigned int size, const void* data)
 void VertexBuffer::UpdateVertexData(unsigned int size, const void* data)
 {
 	Bind();
+
+	//Vertices were added (e.g. a torn soft body), the store has to be recreated
+	if (size > allocatedSize)
+	{
+		allocatedSize = size;
+		GLCALL(glBufferData(GL_ARRAY_BUFFER, size, data, GL_DYNAMIC_DRAW));
+		return;
+	}
+
 	GLCALL(glBufferSubData(GL_ARRAY_BUFFER, 0, size, data));
 }
 
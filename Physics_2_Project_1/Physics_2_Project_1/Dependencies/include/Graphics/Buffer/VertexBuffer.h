@@ -5,6 +5,7 @@ class VertexBuffer
 {
 private:
 	unsigned int rendererID;
+	unsigned int allocatedSize = 0;		//Bytes the buffer store was last created with
 	
 public:
 	VertexBuffer();
@@ -0,0 +1,180 @@
+#include "Broadphase.h"
+
+#include <algorithm>
+
+static glm::vec3 GetCenter(const Aabb& aabb)
+{
+	return (aabb.min + aabb.max) * 0.5f;
+}
+
+BroadphaseSnapshot::BroadphaseSnapshot(std::vector<BroadphaseEntry>&& entries)
+{
+	this->entries = std::move(entries);
+
+	if (this->entries.empty()) return;
+
+	entryIndices.resize(this->entries.size());
+
+	for (unsigned int i = 0; i < (unsigned int)entryIndices.size(); i++)
+	{
+		entryIndices[i] = i;
+	}
+
+	nodes.reserve(this->entries.size() * 2);
+
+	BuildNode(0, (unsigned int)entryIndices.size());
+}
+
+unsigned int BroadphaseSnapshot::BuildNode(unsigned int begin, unsigned int end)
+{
+	// Median split on the widest axis of the centers, same depth first layout as the mesh bvh
+
+	unsigned int nodeIndex = (unsigned int)nodes.size();
+	nodes.push_back(BvhNode());
+
+	Aabb bounds = entries[entryIndices[begin]].sweptAabb;
+	Aabb centerBounds = Aabb(GetCenter(bounds), GetCenter(bounds));
+
+	for (unsigned int i = begin + 1; i < end; i++)
+	{
+		const Aabb& entryAabb = entries[entryIndices[i]].sweptAabb;
+
+		bounds.min = glm::min(bounds.min, entryAabb.min);
+		bounds.max = glm::max(bounds.max, entryAabb.max);
+		centerBounds.min = glm::min(centerBounds.min, GetCenter(entryAabb));
+		centerBounds.max = glm::max(centerBounds.max, GetCenter(entryAabb));
+	}
+
+	nodes[nodeIndex].min = bounds.min;
+	nodes[nodeIndex].max = bounds.max;
+
+	if (end - begin <= BROADPHASE_MAX_LEAF_OBJECTS)
+	{
+		nodes[nodeIndex].offset = begin;
+		nodes[nodeIndex].count = end - begin;
+		return nodeIndex;
+	}
+
+	int axis = centerBounds.GetMaxExtentAxis();
+	unsigned int mid = (begin + end) / 2;
+
+	std::nth_element(entryIndices.begin() + begin, entryIndices.begin() + mid, entryIndices.begin() + end,
+		[this, axis](unsigned int a, unsigned int b)
+		{
+			return GetCenter(entries[a].sweptAabb)[axis] < GetCenter(entries[b].sweptAabb)[axis];
+		});
+
+	BuildNode(begin, mid);
+	nodes[nodeIndex].offset = BuildNode(mid, end);
+
+	return nodeIndex;
+}
+
+const std::vector<BroadphaseEntry>& BroadphaseSnapshot::GetEntries() const
+{
+	return entries;
+}
+
+void BroadphaseSnapshot::QueryAABB(const Aabb& aabb, unsigned int layerMask, std::vector<unsigned int>& results) const
+{
+	if (nodes.empty()) return;
+
+	unsigned int stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+
+	unsigned int nodeIndex = 0;
+
+	while (true)
+	{
+		const BvhNode& node = nodes[nodeIndex];
+
+		if (CollisionAABBvsAABB(aabb, Aabb(node.min, node.max)))
+		{
+			if (!node.IsLeaf())
+			{
+				stack[stackSize++] = node.offset;
+				nodeIndex++;
+				continue;
+			}
+
+			for (unsigned int i = node.offset; i < node.offset + node.count; i++)
+			{
+				const BroadphaseEntry& entry = entries[entryIndices[i]];
+
+				if ((entry.layerBit & layerMask) == 0) continue;
+
+				if (CollisionAABBvsAABB(aabb, entry.sweptAabb))
+				{
+					results.push_back(entryIndices[i]);
+				}
+			}
+		}
+
+		if (stackSize == 0) break;
+
+		nodeIndex = stack[--stackSize];
+	}
+}
+
+static bool RayEntersAabb(const glm::vec3& min, const glm::vec3& max, const glm::vec3& rayOrigin,
+	const glm::vec3& invDirection, float maxDistance, float& entryDistance)
+{
+	glm::vec3 t1 = (min - rayOrigin) * invDirection;
+	glm::vec3 t2 = (max - rayOrigin) * invDirection;
+
+	glm::vec3 tMin = glm::min(t1, t2);
+	glm::vec3 tMax = glm::max(t1, t2);
+
+	float tNear = glm::max(glm::max(tMin.x, tMin.y), glm::max(tMin.z, 0.0f));
+	float tFar = glm::min(glm::min(tMax.x, tMax.y), tMax.z);
+
+	if (tNear > tFar || tNear > maxDistance) return false;
+
+	entryDistance = tNear;
+	return true;
+}
+
+void BroadphaseSnapshot::QueryRay(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, float maxDistance,
+	unsigned int layerMask, std::vector<std::pair<float, unsigned int>>& results) const
+{
+	if (nodes.empty()) return;
+
+	glm::vec3 invDirection = 1.0f / rayDirection;
+
+	unsigned int stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+
+	unsigned int nodeIndex = 0;
+	float entryDistance;
+
+	while (true)
+	{
+		const BvhNode& node = nodes[nodeIndex];
+
+		if (RayEntersAabb(node.min, node.max, rayOrigin, invDirection, maxDistance, entryDistance))
+		{
+			if (!node.IsLeaf())
+			{
+				stack[stackSize++] = node.offset;
+				nodeIndex++;
+				continue;
+			}
+
+			for (unsigned int i = node.offset; i < node.offset + node.count; i++)
+			{
+				const BroadphaseEntry& entry = entries[entryIndices[i]];
+
+				if ((entry.layerBit & layerMask) == 0) continue;
+
+				if (RayEntersAabb(entry.sweptAabb.min, entry.sweptAabb.max, rayOrigin, invDirection, maxDistance, entryDistance))
+				{
+					results.push_back({ entryDistance, entryIndices[i] });
+				}
+			}
+		}
+
+		if (stackSize == 0) break;
+
+		nodeIndex = stack[--stackSize];
+	}
+}
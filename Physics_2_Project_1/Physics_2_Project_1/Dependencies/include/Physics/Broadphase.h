@@ -0,0 +1,55 @@
+#pragma once
+
+#include "HierarchicalAABB.h"
+
+class PhysicsObject;
+
+static const unsigned int ALL_PHYSICS_LAYERS = 0xFFFFFFFFu;
+static const unsigned int BROADPHASE_MAX_LEAF_OBJECTS = 4;
+
+// Everything a query needs from one object, copied when the snapshot is built so queries
+// never call back into the live PhysicsObject
+struct BroadphaseEntry
+{
+	PhysicsObject* phyObj = nullptr;
+	PhysicsShape shape = SPHERE;
+	unsigned int layerBit = 1;
+
+	Aabb aabb;						//World bounds at snapshot time
+	Aabb sweptAabb;					//Also covers the move of the coming physics step, what the tree is built on
+	Sphere sphere;					//World sphere for SPHERE shapes
+	Plane plane;					//World plane for PLANE shapes
+	Capsule capsule;				//World capsule for CAPSULE shapes
+
+	glm::mat4 transformMatrix = glm::mat4(1.0f);
+	glm::mat4 inverseMatrix = glm::mat4(1.0f);
+	//Mesh data published at snapshot time, later refits publish new copies instead of changing these
+	std::shared_ptr<const HierarchicalAABB> bvh;
+	std::shared_ptr<const std::vector<Triangle>> triangles;
+};
+
+// Bvh over object bounds for one physics step. It is never changed after construction, the
+// engine shares it through a shared_ptr so queries on other threads can keep an old one alive.
+class BroadphaseSnapshot
+{
+private:
+
+	std::vector<BroadphaseEntry> entries;
+	std::vector<BvhNode> nodes;
+	std::vector<unsigned int> entryIndices;
+
+	unsigned int BuildNode(unsigned int begin, unsigned int end);
+
+public:
+
+	BroadphaseSnapshot(std::vector<BroadphaseEntry>&& entries);
+
+	const std::vector<BroadphaseEntry>& GetEntries() const;
+
+	//Entries whose swept bounds overlap aabb, in no particular order
+	void QueryAABB(const Aabb& aabb, unsigned int layerMask, std::vector<unsigned int>& results) const;
+
+	//Entries whose swept bounds the ray enters before maxDistance, paired with the entry distance
+	void QueryRay(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, float maxDistance,
+		unsigned int layerMask, std::vector<std::pair<float, unsigned int>>& results) const;
+};
@@ -1,15 +1,852 @@
 #include "HierarchicalAABB.h"
 #include "PhysicsObject.h"
 
-HierarchicalAABB::HierarchicalAABB(PhysicsObject* phyObj, int maxDepth)
+#include <Graphics/Debugger.h>
+
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <limits>
+#include <sstream>
+
+static const int SAH_NUM_OF_BINS = 12;
+static const int SAH_MIN_LEAF_TRIANGLES = 3;		//Never split below this, same as the midpoint tree
+static const int SAH_MAX_LEAF_TRIANGLES = 8;		//Always split above this while depth allows
+static const float SAH_TRAVERSAL_COST = 1.0f;
+static const float SAH_INTERSECTION_COST = 1.0f;
+
+static const unsigned int BVH_CACHE_VERSION = 1;		//Bump whenever BvhNode or the builders change
+
+struct BvhCacheHeader
+{
+	char magic[4];
+	unsigned int version;
+	unsigned long long key;
+	unsigned int numOfNodes;
+	unsigned int numOfTriangleIndices;
+	unsigned int reserved[2];
+};
+
+std::string HierarchicalAABB::cacheDirectory = "BvhCache/";
+
+//Children are always stored after their parent, one backward pass sees both children before the parent
+static void RefitNodes(BvhNode* nodes, unsigned int numOfNodes, const unsigned int* triangleIndices,
+	const std::vector<Triangle>& triangles)
+{
+	for (int i = (int)numOfNodes - 1; i >= 0; i--)
+	{
+		BvhNode& node = nodes[i];
+
+		if (node.IsLeaf())
+		{
+			node.min = glm::vec3(std::numeric_limits<float>::max());
+			node.max = glm::vec3(-std::numeric_limits<float>::max());
+
+			for (unsigned int j = node.offset; j < node.offset + node.count; j++)
+			{
+				const Triangle& triangle = triangles[triangleIndices[j]];
+
+				node.min = glm::min(node.min, glm::min(triangle.v1, glm::min(triangle.v2, triangle.v3)));
+				node.max = glm::max(node.max, glm::max(triangle.v1, glm::max(triangle.v2, triangle.v3)));
+			}
+		}
+		else
+		{
+			const BvhNode& leftNode = nodes[i + 1];
+			const BvhNode& rightNode = nodes[node.offset];
+
+			node.min = glm::min(leftNode.min, rightNode.min);
+			node.max = glm::max(leftNode.max, rightNode.max);
+		}
+	}
+}
+
+static void HashBytes(unsigned long long& hash, const void* data, size_t size)
+{
+	//FNV-1a
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+}
+
+static Aabb GetEmptyAabb()
+{
+	return Aabb(glm::vec3(std::numeric_limits<float>::max()), glm::vec3(-std::numeric_limits<float>::max()));
+}
+
+static void GrowAabb(Aabb& aabb, const Aabb& other)
+{
+	aabb.min = glm::min(aabb.min, other.min);
+	aabb.max = glm::max(aabb.max, other.max);
+}
+
+static float GetSurfaceArea(const Aabb& aabb)
+{
+	glm::vec3 extents = aabb.max - aabb.min;
+
+	if (extents.x < 0 || extents.y < 0 || extents.z < 0) return 0;
+
+	return 2.0f * (extents.x * extents.y + extents.y * extents.z + extents.z * extents.x);
+}
+
+HierarchicalAABB::HierarchicalAABB(PhysicsObject* phyObj, int maxDepth, BvhBuildMode buildMode, bool useCache)
 {
 	this->phyObj = phyObj;
-	this->maxDepth = maxDepth;
-	Construct();
+	this->maxDepth = std::min(maxDepth, BVH_MAX_DEPTH);
+	this->buildMode = buildMode;
+
+	if (useCache)
+	{
+		std::chrono::high_resolution_clock::time_point startTime = std::chrono::high_resolution_clock::now();
+
+		unsigned long long key = GetCacheKey();
+
+		if (LoadFromCache(key))
+		{
+			CalculateStats();
+
+			stats.buildTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+			stats.loadedFromCache = true;
+
+			builtSahCost = stats.sahCost;
+			numOfBuiltTriangles = phyObj->GetTriangleList().size();
+
+			Debugger::Print("BVH cache load ms : " + phyObj->name, stats.buildTime);
+			return;
+		}
+
+		Construct();
+		SaveToCache(key);
+	}
+	else
+	{
+		Construct();
+	}
+
+	Debugger::Print("BVH build ms : " + phyObj->name, stats.buildTime);
+}
+
+HierarchicalAABB::~HierarchicalAABB()
+{
+	ReleaseCache();
+}
+
+std::shared_ptr<HierarchicalAABB> HierarchicalAABB::Clone() const
+{
+	std::shared_ptr<HierarchicalAABB> clone(new HierarchicalAABB(*this));
+
+	//A mapped cache file is shared, copied vectors need the data pointers moved onto them
+	if (clone->cacheView == nullptr)
+	{
+		clone->UseOwnedStorage();
+	}
+
+	return clone;
+}
+
+void HierarchicalAABB::CopyFrom(const HierarchicalAABB& other)
+{
+	if (this == &other) return;
+
+	*this = other;
+
+	if (cacheView == nullptr)
+	{
+		UseOwnedStorage();
+	}
 }
 
 void HierarchicalAABB::Construct()
 {
-	rootNode = new HierarchicalAABBNode(phyObj->GetAABB(), phyObj->GetTriangleList(), {}, 0, nullptr,
-		phyObj, maxDepth);
+	std::chrono::high_resolution_clock::time_point startTime = std::chrono::high_resolution_clock::now();
+
+	ReleaseCache();
+	ClearWorldSpace();
+
+	bool wasQuantized = isQuantized;
+
+	isQuantized = false;
+	quantizedNodes.clear();
+	quantizedNodes.shrink_to_fit();
+
+	HierarchicalAABBNode* rootNode = nullptr;
+
+	if (buildMode == MIDPOINT_SPLIT)
+	{
+		rootNode = new HierarchicalAABBNode(phyObj->GetAABB(), phyObj->GetTriangleList(), {}, 0, nullptr,
+			phyObj, maxDepth);
+	}
+	else
+	{
+		const std::vector<Triangle>& triangles = phyObj->GetTriangleList();
+
+		triangleBounds.resize(triangles.size());
+		triangleCentroids.resize(triangles.size());
+		buildIndices.resize(triangles.size());
+
+		for (int i = 0; i < (int)triangles.size(); i++)
+		{
+			const Triangle& triangle = triangles[i];
+
+			triangleBounds[i].min = glm::min(triangle.v1, glm::min(triangle.v2, triangle.v3));
+			triangleBounds[i].max = glm::max(triangle.v1, glm::max(triangle.v2, triangle.v3));
+			triangleCentroids[i] = (triangle.v1 + triangle.v2 + triangle.v3) / 3.0f;
+			buildIndices[i] = i;
+		}
+
+		rootNode = BuildSAH(0, (int)triangles.size(), 0, nullptr);
+
+		triangleBounds.clear();
+		triangleBounds.shrink_to_fit();
+		triangleCentroids.clear();
+		triangleCentroids.shrink_to_fit();
+		buildIndices.clear();
+		buildIndices.shrink_to_fit();
+	}
+
+	//The pointer tree is only a build step, queries walk the flat arrays
+	nodes.clear();
+	triangleIndices.clear();
+
+	Flatten(rootNode);
+
+	nodes.shrink_to_fit();
+	triangleIndices.shrink_to_fit();
+
+	UseOwnedStorage();
+
+	delete rootNode;
+
+	if (!wasQuantized || !Quantize())
+	{
+		CalculateStats();
+	}
+
+	stats.buildTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+	stats.loadedFromCache = false;
+
+	builtSahCost = stats.sahCost;
+	numOfBuiltTriangles = phyObj->GetTriangleList().size();
+}
+
+void HierarchicalAABB::Refit()
+{
+	const std::vector<Triangle>& triangles = phyObj->GetTriangleList();
+
+	//A mapped cache file is read only, take a copy before writing bounds
+	if (cacheView != nullptr)
+	{
+		nodes.assign(nodeData, nodeData + numOfNodes);
+		triangleIndices.assign(triangleIndexData, triangleIndexData + numOfTriangleIndices);
+
+		ReleaseCache();
+		UseOwnedStorage();
+	}
+
+	bool wasQuantized = isQuantized;
+
+	if (wasQuantized)
+	{
+		Dequantize();
+	}
+
+	RefitNodes(nodes.data(), (unsigned int)nodes.size(), triangleIndices.data(), triangles);
+
+	ClearWorldSpace();
+
+	if (!wasQuantized || !Quantize())
+	{
+		CalculateStats();
+	}
+}
+
+bool HierarchicalAABB::RefitOrRebuild()
+{
+	if (phyObj->GetTriangleList().size() != numOfBuiltTriangles)
+	{
+		Construct();
+		return true;
+	}
+
+	Refit();
+
+	// Refitting keeps the topology from the build pose, so nodes overlap more and more as
+	// the mesh deforms. The SAH cost tracks that, rebuild once it has degraded enough.
+	if (stats.sahCost > builtSahCost * rebuildThreshold)
+	{
+		Construct();
+		return true;
+	}
+
+	return false;
+}
+
+static bool HasTriangles(HierarchicalAABBNode* node)
+{
+	if (node->leftNode == nullptr) return !node->triangleIndices.empty();
+
+	return HasTriangles(node->leftNode) || HasTriangles(node->rightNode);
+}
+
+int HierarchicalAABB::Flatten(HierarchicalAABBNode* node)
+{
+	// Depth first, left child right after its parent. Empty leaves of the midpoint tree are
+	// dropped and a parent left with one child is replaced by that child.
+
+	if (!HasTriangles(node)) return -1;
+
+	if (node->leftNode != nullptr)
+	{
+		if (!HasTriangles(node->leftNode)) return Flatten(node->rightNode);
+		if (!HasTriangles(node->rightNode)) return Flatten(node->leftNode);
+	}
+
+	int index = (int)nodes.size();
+
+	BvhNode flatNode;
+	flatNode.min = node->GetAABB().min;
+	flatNode.max = node->GetAABB().max;
+
+	if (node->leftNode == nullptr)
+	{
+		flatNode.offset = (unsigned int)triangleIndices.size();
+		flatNode.count = (unsigned int)node->triangleIndices.size();
+
+		triangleIndices.insert(triangleIndices.end(), node->triangleIndices.begin(), node->triangleIndices.end());
+		nodes.push_back(flatNode);
+
+		return index;
+	}
+
+	nodes.push_back(flatNode);
+
+	Flatten(node->leftNode);
+	nodes[index].offset = (unsigned int)Flatten(node->rightNode);
+
+	return index;
+}
+
+HierarchicalAABBNode* HierarchicalAABB::BuildSAH(int begin, int end, int depth, HierarchicalAABBNode* parentNode)
+{
+	// Binned SAH, each triangle goes to exactly one side by its centroid so nothing is duplicated
+
+	int count = end - begin;
+
+	Aabb bounds = GetEmptyAabb();
+	Aabb centroidBounds = GetEmptyAabb();
+
+	for (int i = begin; i < end; i++)
+	{
+		GrowAabb(bounds, triangleBounds[buildIndices[i]]);
+		GrowAabb(centroidBounds, Aabb(triangleCentroids[buildIndices[i]], triangleCentroids[buildIndices[i]]));
+	}
+
+	if (count == 0)
+	{
+		bounds = phyObj->GetAABB();
+	}
+
+	HierarchicalAABBNode* node = new HierarchicalAABBNode(bounds, depth, parentNode, phyObj);
+
+	if (count <= SAH_MIN_LEAF_TRIANGLES || depth >= maxDepth)
+	{
+		node->triangleIndices.assign(buildIndices.begin() + begin, buildIndices.begin() + end);
+		return node;
+	}
+
+	int axis = centroidBounds.GetMaxExtentAxis();
+	float axisMin = centroidBounds.min[axis];
+	float axisExtent = centroidBounds.max[axis] - axisMin;
+
+	int mid = begin + count / 2;
+
+	if (axisExtent > 0)
+	{
+		Aabb binBounds[SAH_NUM_OF_BINS];
+		int binCounts[SAH_NUM_OF_BINS] = { 0 };
+
+		for (int i = 0; i < SAH_NUM_OF_BINS; i++)
+		{
+			binBounds[i] = GetEmptyAabb();
+		}
+
+		float binScale = SAH_NUM_OF_BINS / axisExtent;
+
+		for (int i = begin; i < end; i++)
+		{
+			int bin = std::min(SAH_NUM_OF_BINS - 1, (int)((triangleCentroids[buildIndices[i]][axis] - axisMin) * binScale));
+
+			binCounts[bin]++;
+			GrowAabb(binBounds[bin], triangleBounds[buildIndices[i]]);
+		}
+
+		//Sweep from the right to get the cost of everything above each split plane
+		float rightAreas[SAH_NUM_OF_BINS];
+		int rightCounts[SAH_NUM_OF_BINS];
+
+		Aabb rightBounds = GetEmptyAabb();
+		int rightCount = 0;
+
+		for (int i = SAH_NUM_OF_BINS - 1; i > 0; i--)
+		{
+			GrowAabb(rightBounds, binBounds[i]);
+			rightCount += binCounts[i];
+
+			rightAreas[i] = GetSurfaceArea(rightBounds);
+			rightCounts[i] = rightCount;
+		}
+
+		Aabb leftBounds = GetEmptyAabb();
+		int leftCount = 0;
+
+		float bestCost = std::numeric_limits<float>::max();
+		int bestSplit = -1;
+
+		for (int i = 0; i < SAH_NUM_OF_BINS - 1; i++)
+		{
+			GrowAabb(leftBounds, binBounds[i]);
+			leftCount += binCounts[i];
+
+			if (leftCount == 0 || rightCounts[i + 1] == 0) continue;
+
+			float cost = GetSurfaceArea(leftBounds) * leftCount + rightAreas[i + 1] * rightCounts[i + 1];
+
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestSplit = i;
+			}
+		}
+
+		float area = GetSurfaceArea(bounds);
+		float splitCost = SAH_TRAVERSAL_COST + (area > 0 ? bestCost / area : 0) * SAH_INTERSECTION_COST;
+		float leafCost = count * SAH_INTERSECTION_COST;
+
+		if (bestSplit >= 0 && (splitCost < leafCost || count > SAH_MAX_LEAF_TRIANGLES))
+		{
+			int* middle = std::partition(buildIndices.data() + begin, buildIndices.data() + end,
+				[&](int triangleIndex)
+				{
+					int bin = std::min(SAH_NUM_OF_BINS - 1, (int)((triangleCentroids[triangleIndex][axis] - axisMin) * binScale));
+					return bin <= bestSplit;
+				});
+
+			mid = (int)(middle - buildIndices.data());
+		}
+		else if (count <= SAH_MAX_LEAF_TRIANGLES)
+		{
+			node->triangleIndices.assign(buildIndices.begin() + begin, buildIndices.begin() + end);
+			return node;
+		}
+	}
+	else if (count <= SAH_MAX_LEAF_TRIANGLES)
+	{
+		node->triangleIndices.assign(buildIndices.begin() + begin, buildIndices.begin() + end);
+		return node;
+	}
+
+	//Centroids that could not be separated fall back to an even split by count
+
+	// The two halves touch disjoint ranges of buildIndices, so they can be built at the same time.
+	// The tree does not depend on which finishes first, and Flatten runs afterwards in a fixed order.
+	if (count >= BVH_PARALLEL_BUILD_TRIANGLES && depth < BVH_PARALLEL_BUILD_DEPTH)
+	{
+		std::future<HierarchicalAABBNode*> leftTask = std::async(std::launch::async,
+			&HierarchicalAABB::BuildSAH, this, begin, mid, depth + 1, node);
+
+		node->rightNode = BuildSAH(mid, end, depth + 1, node);
+		node->leftNode = leftTask.get();
+	}
+	else
+	{
+		node->leftNode = BuildSAH(begin, mid, depth + 1, node);
+		node->rightNode = BuildSAH(mid, end, depth + 1, node);
+	}
+
+	return node;
+}
+
+void HierarchicalAABB::CalculateStats()
+{
+	float buildTime = stats.buildTime;
+	bool loadedFromCache = stats.loadedFromCache;
+
+	stats = BvhStats();
+	stats.buildTime = buildTime;
+	stats.loadedFromCache = loadedFromCache;
+
+	if (numOfNodes == 0) return;
+
+	stats.minLeafSize = std::numeric_limits<int>::max();
+
+	BvhNode rootNode = GetNode(0);
+	float rootArea = GetSurfaceArea(Aabb(rootNode.min, rootNode.max));
+
+	//Nodes are depth first, so depth can be tracked with the same stack a query would use
+	int depths[BVH_STACK_SIZE];
+	unsigned int stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+
+	unsigned int nodeIndex = 0;
+	int depth = 0;
+
+	while (true)
+	{
+		BvhNode node = GetNode(nodeIndex);
+
+		float relativeArea = rootArea > 0 ? GetSurfaceArea(Aabb(node.min, node.max)) / rootArea : 1.0f;
+
+		stats.numOfNodes++;
+		stats.maxDepth = std::max(stats.maxDepth, depth);
+
+		if (!node.IsLeaf())
+		{
+			stats.sahCost += SAH_TRAVERSAL_COST * relativeArea;
+
+			depths[stackSize] = depth + 1;
+			stack[stackSize++] = node.offset;
+
+			nodeIndex++;
+			depth++;
+			continue;
+		}
+
+		int leafSize = (int)node.count;
+
+		stats.numOfLeaves++;
+		stats.numOfTriangleReferences += leafSize;
+		stats.minLeafSize = std::min(stats.minLeafSize, leafSize);
+		stats.maxLeafSize = std::max(stats.maxLeafSize, leafSize);
+		stats.averageLeafDepth += depth;
+		stats.sahCost += SAH_INTERSECTION_COST * leafSize * relativeArea;
+
+		if (stackSize == 0) break;
+
+		stackSize--;
+		nodeIndex = stack[stackSize];
+		depth = depths[stackSize];
+	}
+
+	stats.averageLeafSize = (float)stats.numOfTriangleReferences / stats.numOfLeaves;
+	stats.averageLeafDepth /= stats.numOfLeaves;
+}
+
+bool HierarchicalAABB::Quantize()
+{
+	if (isQuantized) return true;
+	if (numOfNodes == 0) return false;
+
+	for (unsigned int i = 0; i < numOfNodes; i++)
+	{
+		const BvhNode& node = nodeData[i];
+
+		if (node.IsLeaf())
+		{
+			if (node.count > QUANTIZED_MAX_LEAF_TRIANGLES || node.offset > QUANTIZED_MAX_LEAF_OFFSET) return false;
+		}
+		else if (node.offset >= QUANTIZED_LEAF_FLAG)
+		{
+			return false;
+		}
+	}
+
+	glm::vec3 rootMin = nodeData[0].min;
+	glm::vec3 rootExtent = glm::max(nodeData[0].max - rootMin, glm::vec3(std::numeric_limits<float>::epsilon()));
+
+	quantizedOrigin = rootMin;
+	quantizedStep = rootExtent / 65535.0f;
+
+	quantizedNodes.resize(numOfNodes);
+
+	for (unsigned int i = 0; i < numOfNodes; i++)
+	{
+		const BvhNode& node = nodeData[i];
+		QuantizedBvhNode& quantized = quantizedNodes[i];
+
+		//One extra step each way covers float rounding when decoding
+		glm::vec3 low = glm::clamp(glm::floor((node.min - rootMin) / quantizedStep) - 1.0f, 0.0f, 65535.0f);
+		glm::vec3 high = glm::clamp(glm::ceil((node.max - rootMin) / quantizedStep) + 1.0f, 0.0f, 65535.0f);
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			quantized.min[axis] = (unsigned short)low[axis];
+			quantized.max[axis] = (unsigned short)high[axis];
+		}
+
+		quantized.data = node.IsLeaf() ? (QUANTIZED_LEAF_FLAG | (node.count << 24) | node.offset) : node.offset;
+	}
+
+	//A mapped cache file holds the triangle indices too, keep a copy before unmapping
+	if (cacheView != nullptr)
+	{
+		triangleIndices.assign(triangleIndexData, triangleIndexData + numOfTriangleIndices);
+		ReleaseCache();
+	}
+
+	nodes.clear();
+	nodes.shrink_to_fit();
+
+	isQuantized = true;
+	UseOwnedStorage();
+
+	CalculateStats();
+
+	return true;
+}
+
+void HierarchicalAABB::Dequantize()
+{
+	if (!isQuantized) return;
+
+	nodes.resize(numOfNodes);
+
+	for (unsigned int i = 0; i < numOfNodes; i++)
+	{
+		nodes[i] = GetNode(i);
+	}
+
+	isQuantized = false;
+	quantizedNodes.clear();
+	quantizedNodes.shrink_to_fit();
+
+	UseOwnedStorage();
+}
+
+bool HierarchicalAABB::IsQuantized() const
+{
+	return isQuantized;
+}
+
+unsigned int HierarchicalAABB::GetNumOfNodes() const
+{
+	return numOfNodes;
+}
+
+const unsigned int* HierarchicalAABB::GetTriangleIndices() const
+{
+	return triangleIndexData;
+}
+
+void HierarchicalAABB::UpdateWorldSpace(const glm::mat4& transformMatrix)
+{
+	if (IsWorldSpaceCurrent(transformMatrix)) return;
+
+	const std::vector<Triangle>& triangles = phyObj->GetTriangleList();
+
+	transformedTriangles.resize(triangles.size());
+
+	for (size_t i = 0; i < triangles.size(); i++)
+	{
+		Triangle& triangle = transformedTriangles[i];
+
+		triangle.v1 = transformMatrix * glm::vec4(triangles[i].v1, 1.0f);
+		triangle.v2 = transformMatrix * glm::vec4(triangles[i].v2, 1.0f);
+		triangle.v3 = transformMatrix * glm::vec4(triangles[i].v3, 1.0f);
+		triangle.normal = transformMatrix * glm::vec4(triangles[i].normal, 0.0f);
+	}
+
+	//Refit from the world triangles rather than transforming the local boxes, which would only grow them
+	worldNodes.resize(numOfNodes);
+
+	for (unsigned int i = 0; i < numOfNodes; i++)
+	{
+		worldNodes[i] = GetNode(i);
+	}
+
+	RefitNodes(worldNodes.data(), numOfNodes, triangleIndexData, transformedTriangles);
+
+	worldMatrix = transformMatrix;
+	hasWorldSpace = true;
+}
+
+void HierarchicalAABB::ClearWorldSpace()
+{
+	if (!hasWorldSpace) return;
+
+	hasWorldSpace = false;
+	worldMatrix = glm::mat4(0.0f);
+
+	transformedTriangles.clear();
+	transformedTriangles.shrink_to_fit();
+	worldNodes.clear();
+	worldNodes.shrink_to_fit();
+}
+
+bool HierarchicalAABB::HasWorldSpace() const
+{
+	return hasWorldSpace;
+}
+
+bool HierarchicalAABB::IsWorldSpaceCurrent(const glm::mat4& transformMatrix) const
+{
+	return hasWorldSpace && worldMatrix == transformMatrix;
+}
+
+const std::vector<Triangle>& HierarchicalAABB::GetWorldTriangles() const
+{
+	return transformedTriangles;
+}
+
+void HierarchicalAABB::UseOwnedStorage()
+{
+	nodeData = isQuantized ? nullptr : nodes.data();
+	numOfNodes = (unsigned int)(isQuantized ? quantizedNodes.size() : nodes.size());
+	triangleIndexData = triangleIndices.data();
+	numOfTriangleIndices = (unsigned int)triangleIndices.size();
+}
+
+void HierarchicalAABB::ReleaseCache()
+{
+	if (cacheView == nullptr) return;
+
+	cacheView.reset();
+
+	nodeData = nullptr;
+	numOfNodes = 0;
+	triangleIndexData = nullptr;
+	numOfTriangleIndices = 0;
+}
+
+unsigned long long HierarchicalAABB::GetCacheKey() const
+{
+	unsigned long long hash = 14695981039346656037ULL;
+
+	//Everything the built tree depends on
+	int buildParams[] = { (int)BVH_CACHE_VERSION, maxDepth, (int)buildMode, SAH_NUM_OF_BINS,
+		SAH_MIN_LEAF_TRIANGLES, SAH_MAX_LEAF_TRIANGLES, BVH_MAX_DEPTH };
+
+	HashBytes(hash, buildParams, sizeof(buildParams));
+
+	for (MeshAndMaterial* mesh : phyObj->meshes)
+	{
+		const std::vector<Vertex>& vertices = mesh->mesh->vertices;
+		const std::vector<unsigned int>& indices = mesh->mesh->indices;
+
+		size_t sizes[] = { vertices.size(), indices.size() };
+		HashBytes(hash, sizes, sizeof(sizes));
+
+		for (const Vertex& vertex : vertices)
+		{
+			HashBytes(hash, &vertex.positions, sizeof(glm::vec3));
+		}
+
+		if (!indices.empty())
+		{
+			HashBytes(hash, indices.data(), indices.size() * sizeof(unsigned int));
+		}
+	}
+
+	return hash;
+}
+
+std::string HierarchicalAABB::GetCachePath(unsigned long long key) const
+{
+	std::stringstream path;
+	path << cacheDirectory << std::hex << key << ".bvh";
+
+	return path.str();
+}
+
+bool HierarchicalAABB::LoadFromCache(unsigned long long key)
+{
+	std::string path = GetCachePath(key);
+
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER fileSize;
+
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart < (long long)sizeof(BvhCacheHeader))
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	//The view stays valid after both handles are closed
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+
+	if (mapping == nullptr) return false;
+
+	const void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+
+	if (view == nullptr) return false;
+
+	const BvhCacheHeader* header = static_cast<const BvhCacheHeader*>(view);
+
+	unsigned long long expectedSize = sizeof(BvhCacheHeader) +
+		(unsigned long long)header->numOfNodes * sizeof(BvhNode) +
+		(unsigned long long)header->numOfTriangleIndices * sizeof(unsigned int);
+
+	if (std::memcmp(header->magic, "BVHC", 4) != 0 || header->version != BVH_CACHE_VERSION ||
+		header->key != key || (unsigned long long)fileSize.QuadPart != expectedSize)
+	{
+		UnmapViewOfFile(view);
+		return false;
+	}
+
+	cacheView = std::shared_ptr<const void>(view, [](const void* mappedView) { UnmapViewOfFile(mappedView); });
+	nodeData = reinterpret_cast<const BvhNode*>(header + 1);
+	numOfNodes = header->numOfNodes;
+	triangleIndexData = reinterpret_cast<const unsigned int*>(nodeData + numOfNodes);
+	numOfTriangleIndices = header->numOfTriangleIndices;
+
+	return true;
+}
+
+void HierarchicalAABB::SaveToCache(unsigned long long key) const
+{
+	CreateDirectoryA(cacheDirectory.c_str(), nullptr);
+
+	std::ofstream file(GetCachePath(key), std::ios::binary | std::ios::trunc);
+
+	if (!file.is_open()) return;
+
+	BvhCacheHeader header = {};
+	std::memcpy(header.magic, "BVHC", 4);
+	header.version = BVH_CACHE_VERSION;
+	header.key = key;
+	header.numOfNodes = (unsigned int)nodes.size();
+	header.numOfTriangleIndices = (unsigned int)triangleIndices.size();
+
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(BvhNode));
+	file.write(reinterpret_cast<const char*>(triangleIndices.data()), triangleIndices.size() * sizeof(unsigned int));
+}
+
+const BvhStats& HierarchicalAABB::GetStats() const
+{
+	return stats;
+}
+
+size_t HierarchicalAABB::GetMemoryUsage() const
+{
+	size_t memory = sizeof(HierarchicalAABB);
+
+	memory += nodes.capacity() * sizeof(BvhNode);
+	memory += quantizedNodes.capacity() * sizeof(QuantizedBvhNode);
+	memory += triangleIndices.capacity() * sizeof(unsigned int);
+	memory += worldNodes.capacity() * sizeof(BvhNode);
+	memory += transformedTriangles.capacity() * sizeof(Triangle);
+
+	if (cacheView != nullptr)
+	{
+		memory += numOfNodes * sizeof(BvhNode) + numOfTriangleIndices * sizeof(unsigned int);
+	}
+
+	return memory;
 }
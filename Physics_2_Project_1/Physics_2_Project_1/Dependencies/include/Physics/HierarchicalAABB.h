@@ -2,21 +2,194 @@
 
 #include "HierarchicalAABBNode.h"
 
+#include <memory>
+#include <string>
+
 class PhysicsObject;
 
+enum BvhBuildMode
+{
+	MIDPOINT_SPLIT = 0,
+	SAH_SPLIT = 1,
+};
+
+struct BvhStats
+{
+	int numOfNodes = 0;
+	int numOfLeaves = 0;
+	int maxDepth = 0;
+	int minLeafSize = 0;
+	int maxLeafSize = 0;
+	int numOfTriangleReferences = 0;	//More than the triangle count when triangles are duplicated across leaves
+	float averageLeafSize = 0;
+	float averageLeafDepth = 0;
+	float sahCost = 0;					//Expected cost of a query against the tree, in triangle tests
+	float buildTime = 0;				//Milliseconds for the last build or cache load, including the flatten step
+	bool loadedFromCache = false;
+};
+
+// Flattened tree node, 32 bytes. Nodes are in depth first order so the left child of an
+// internal node is the next node and offset is its right child. A leaf covers
+// GetTriangleIndices()[offset, offset + count).
+struct BvhNode
+{
+	glm::vec3 min;
+	unsigned int offset = 0;
+	glm::vec3 max;
+	unsigned int count = 0;
+
+	bool IsLeaf() const { return count > 0; }
+};
+
+static_assert(sizeof(BvhNode) == 32, "BvhNode should stay at 32 bytes");
+
+// Quantized node, 16 bytes. Bounds are 16 bit steps across the root box, rounded outwards so
+// they always contain the full precision box. data is the right child for internal nodes,
+// leaves set the top bit and pack the triangle count above a 24 bit offset.
+struct QuantizedBvhNode
+{
+	unsigned short min[3];
+	unsigned short max[3];
+	unsigned int data = 0;
+};
+
+static_assert(sizeof(QuantizedBvhNode) == 16, "QuantizedBvhNode should stay at 16 bytes");
+
+static const unsigned int QUANTIZED_LEAF_FLAG = 0x80000000u;
+static const unsigned int QUANTIZED_MAX_LEAF_OFFSET = 0x00FFFFFFu;
+static const unsigned int QUANTIZED_MAX_LEAF_TRIANGLES = 0x7Fu;
+
+static const int BVH_MAX_DEPTH = 48;
+static const int BVH_STACK_SIZE = 64;		//Traversal stack, only right children are pushed so depth + 1 is enough
+
 class HierarchicalAABB
 {
 private:
 
 	PhysicsObject* phyObj = nullptr;
 	int maxDepth = 0;
+	BvhBuildMode buildMode = SAH_SPLIT;
+	BvhStats stats;
+	float builtSahCost = 0;
+	size_t numOfBuiltTriangles = 0;
+
+	//World space copy for colliders that do not move, see UpdateWorldSpace
+	bool hasWorldSpace = false;
+	glm::mat4 worldMatrix = glm::mat4(0.0f);
 	std::vector<Triangle> transformedTriangles;
+	std::vector<BvhNode> worldNodes;
+
+	//Build time only
+	std::vector<Aabb> triangleBounds;
+	std::vector<glm::vec3> triangleCentroids;
+	std::vector<int> buildIndices;
+
+	std::vector<BvhNode> nodes;
+	std::vector<unsigned int> triangleIndices;
+
+	//What queries read, either the vectors above or a read only view of a cache file
+	const BvhNode* nodeData = nullptr;
+	unsigned int numOfNodes = 0;
+	const unsigned int* triangleIndexData = nullptr;
+	unsigned int numOfTriangleIndices = 0;
+	std::shared_ptr<const void> cacheView;		//Unmapped with the last tree sharing it
+
+	//Replaces nodes when the tree is quantized
+	bool isQuantized = false;
+	std::vector<QuantizedBvhNode> quantizedNodes;
+	glm::vec3 quantizedOrigin = glm::vec3(0);
+	glm::vec3 quantizedStep = glm::vec3(0);		//Size of one 16 bit step on each axis
+
+	//Only through Clone and CopyFrom, the data pointers have to be moved onto the copy's own storage
+	HierarchicalAABB(const HierarchicalAABB&) = default;
+	HierarchicalAABB& operator=(const HierarchicalAABB&) = default;
+
+	HierarchicalAABBNode* BuildSAH(int begin, int end, int depth, HierarchicalAABBNode* parentNode);
+
+	int Flatten(HierarchicalAABBNode* node);
+	void CalculateStats();
+
+	void UseOwnedStorage();
+	void ReleaseCache();
+	void Dequantize();
+
+	unsigned long long GetCacheKey() const;
+	std::string GetCachePath(unsigned long long key) const;
+	bool LoadFromCache(unsigned long long key);
+	void SaveToCache(unsigned long long key) const;
 
 public:
-	HierarchicalAABBNode* rootNode = nullptr;
 
-	HierarchicalAABB(PhysicsObject* phyObj, int maxDepth);
+	float rebuildThreshold = 1.5f;		//Rebuild once the SAH cost grows past this factor of the cost at build time
+
+	static std::string cacheDirectory;
+
+	//With useCache the tree is mapped from cacheDirectory when a file for the same mesh and settings exists,
+	//otherwise it is built and written there
+	HierarchicalAABB(PhysicsObject* phyObj, int maxDepth, BvhBuildMode buildMode = SAH_SPLIT, bool useCache = true);
+	~HierarchicalAABB();
+
+	//Copy to refit, rebuild or move to world space while queries keep reading this one
+	std::shared_ptr<HierarchicalAABB> Clone() const;
+	//Same as Clone into an existing tree, reuses its storage when large enough
+	void CopyFrom(const HierarchicalAABB& other);
+
 	void Construct();
 
-};
+	//Updates node bounds from the current triangles of phyObj, the tree shape is kept
+	void Refit();
+
+	//Refits, and rebuilds when the triangle count changed or the refitted tree got too slow. Returns true on rebuild
+	bool RefitOrRebuild();
+
+	//Swaps the nodes for quantized ones at half the size. Keeps full precision and returns false
+	//when a leaf does not fit the packed encoding
+	bool Quantize();
+	bool IsQuantized() const;
 
+	unsigned int GetNumOfNodes() const;
+	const unsigned int* GetTriangleIndices() const;
+
+	//Node in mesh space, decoded when the tree is quantized
+	BvhNode GetNode(unsigned int index) const
+	{
+		if (!isQuantized) return nodeData[index];
+
+		const QuantizedBvhNode& quantized = quantizedNodes[index];
+
+		BvhNode node;
+		node.min = quantizedOrigin + glm::vec3(quantized.min[0], quantized.min[1], quantized.min[2]) * quantizedStep;
+		node.max = quantizedOrigin + glm::vec3(quantized.max[0], quantized.max[1], quantized.max[2]) * quantizedStep;
+
+		if (quantized.data & QUANTIZED_LEAF_FLAG)
+		{
+			node.offset = quantized.data & QUANTIZED_MAX_LEAF_OFFSET;
+			node.count = (quantized.data >> 24) & QUANTIZED_MAX_LEAF_TRIANGLES;
+		}
+		else
+		{
+			node.offset = quantized.data;
+		}
+
+		return node;
+	}
+
+	//Node in the space queries run in, world space when a static copy is kept
+	BvhNode GetQueryNode(unsigned int index) const
+	{
+		return hasWorldSpace ? worldNodes[index] : GetNode(index);
+	}
+
+	const BvhStats& GetStats() const;
+	size_t GetMemoryUsage() const;
+
+	//Keeps world space triangles and tight world bounds so queries skip all matrix work.
+	//Only recomputed when transformMatrix differs from the last call, meant for static colliders
+	void UpdateWorldSpace(const glm::mat4& transformMatrix);
+	void ClearWorldSpace();
+
+	bool HasWorldSpace() const;
+	bool IsWorldSpaceCurrent(const glm::mat4& transformMatrix) const;
+	const std::vector<Triangle>& GetWorldTriangles() const;
+
+};
@@ -1,5 +1,7 @@
 #include "HierarchicalAABBNode.h"
 
+#include <future>
+
 HierarchicalAABBNode::HierarchicalAABBNode(const Aabb& aabb,
 	const std::vector<Triangle>& triangles, std::vector<int> triangleIndices, int nodeIndex,
 	HierarchicalAABBNode* parentNode, Model* model, int maxDepth)
@@ -51,6 +53,15 @@ HierarchicalAABBNode::HierarchicalAABBNode(const Aabb& aabb,
 
 }
 
+HierarchicalAABBNode::HierarchicalAABBNode(const Aabb& aabb, int nodeIndex,
+	HierarchicalAABBNode* parentNode, Model* model)
+	: aabb(aabb), leftNode(nullptr), rightNode(nullptr)
+{
+	this->nodeIndex = nodeIndex;
+	this->parentNode = parentNode;
+	this->model = model;
+}
+
 
 HierarchicalAABBNode::~HierarchicalAABBNode()
 {
@@ -79,8 +90,21 @@ void HierarchicalAABBNode::SplitNode(const std::vector<Triangle>& triangleList)
 	}
 
 
-	leftNode = new HierarchicalAABBNode(leftAABB, triangleList, leftTriangleIndices, (nodeIndex + 1), this, model,maxDepth);
-	rightNode = new HierarchicalAABBNode(rightAABB, triangleList, rightTriangleIndices, (nodeIndex + 1), this, model, maxDepth);
+	if ((int)triangleIndices.size() >= BVH_PARALLEL_BUILD_TRIANGLES && nodeIndex < BVH_PARALLEL_BUILD_DEPTH)
+	{
+		std::future<HierarchicalAABBNode*> leftTask = std::async(std::launch::async, [&]()
+			{
+				return new HierarchicalAABBNode(leftAABB, triangleList, leftTriangleIndices, (nodeIndex + 1), this, model, maxDepth);
+			});
+
+		rightNode = new HierarchicalAABBNode(rightAABB, triangleList, rightTriangleIndices, (nodeIndex + 1), this, model, maxDepth);
+		leftNode = leftTask.get();
+	}
+	else
+	{
+		leftNode = new HierarchicalAABBNode(leftAABB, triangleList, leftTriangleIndices, (nodeIndex + 1), this, model,maxDepth);
+		rightNode = new HierarchicalAABBNode(rightAABB, triangleList, rightTriangleIndices, (nodeIndex + 1), this, model, maxDepth);
+	}
 
 	//if (this->triangleIndices.size() > maxNumOfTriangles && nodeIndex < maxDepth)
 	//{
@@ -117,3 +141,8 @@ Aabb HierarchicalAABBNode::GetModelAABB()
 
 	return 	Aabb(transformedMinV, transformedMaxV);
 }
+
+const Aabb& HierarchicalAABBNode::GetAABB() const
+{
+	return aabb;
+}
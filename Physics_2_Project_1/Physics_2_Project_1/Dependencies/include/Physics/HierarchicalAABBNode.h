@@ -4,6 +4,10 @@
 #include <Graphics/Mesh/Model.h>
 #include "PhysicsShapeAndCollision.h"
 
+//Subtrees with at least this many triangles are built on another thread, only near the top so the task count stays small
+static const int BVH_PARALLEL_BUILD_TRIANGLES = 2048;
+static const int BVH_PARALLEL_BUILD_DEPTH = 4;
+
 class HierarchicalAABBNode
 {
 private:
@@ -23,10 +27,12 @@ public:
 
 	HierarchicalAABBNode(const Aabb& aabb, const std::vector<Triangle>& triangles,
 		std::vector<int> triangleIndices, int nodeIndex, HierarchicalAABBNode* parentNode, Model* model, int maxDepth);
+	HierarchicalAABBNode(const Aabb& aabb, int nodeIndex, HierarchicalAABBNode* parentNode, Model* model);
 	~HierarchicalAABBNode(); 
 
 	void SplitNode(const std::vector<Triangle>& triangleList);
 	Aabb GetModelAABB();
+	const Aabb& GetAABB() const;
 
 };
 
@@ -1,6 +1,7 @@
 #include "PhysicsEngine.h"
 #include <Graphics/Debugger.h>
 #include "PhysicsShapeAndCollision.h"
+#include <algorithm>
 
 
 bool PhysicsEngine::PhysicsObjectExists(PhysicsObject* physicsObject)
@@ -90,6 +91,11 @@ void PhysicsEngine::UpdateSoftBodyBufferData()
 	}
 }
 
+CRITICAL_SECTION* PhysicsEngine::GetSoftBodyCriticalSection()
+{
+	return softBody_CritSection;
+}
+
 void PhysicsEngine::SetDebugSpheres(Model* model, int count)
 {
 	debugSpheres.clear();
@@ -109,6 +115,22 @@ void PhysicsEngine::Shutdown()
 
 void PhysicsEngine::UpdatePhysics(float deltaTime)
 {
+	for (PhysicsObject* iteratorObject : physicsObjects)
+	{
+		if (!iteratorObject->isPhysicsEnabled) continue;
+
+		if (iteratorObject->isDeformable)
+		{
+			iteratorObject->UpdateDeformableShape();
+		}
+
+		iteratorObject->UpdateWorldSpaceShape();
+	}
+
+	std::shared_ptr<const BroadphaseSnapshot> snapshot = BuildBroadphase(deltaTime);
+	std::atomic_store(&broadphase, snapshot);
+
+	const std::vector<BroadphaseEntry>& broadphaseEntries = snapshot->GetEntries();
 
 	for (PhysicsObject* iteratorObject : physicsObjects)
 	{
@@ -145,8 +167,16 @@ void PhysicsEngine::UpdatePhysics(float deltaTime)
 
 #pragma region CheckingCollision
 
-		for (PhysicsObject* otherObject : physicsObjects)
+		broadphaseCandidates.clear();
+		snapshot->QueryAABB(iteratorObject->GetModelAABB(), ALL_PHYSICS_LAYERS, broadphaseCandidates);
+
+		//Entries are in physicsObjects order, keep visiting the others in that order
+		std::sort(broadphaseCandidates.begin(), broadphaseCandidates.end());
+
+		for (unsigned int entryIndex : broadphaseCandidates)
 		{
+			PhysicsObject* otherObject = broadphaseEntries[entryIndex].phyObj;
+
 			if (otherObject->isPhysicsEnabled == false)
 				continue;
 
@@ -248,5 +278,565 @@ bool PhysicsEngine::HandleCollision(PhysicsObject* first, PhysicsObject* second,
 	return false;
 }
 
+std::shared_ptr<const BroadphaseSnapshot> PhysicsEngine::BuildBroadphase(float deltaTime)
+{
+	std::vector<BroadphaseEntry> entries;
+	entries.reserve(physicsObjects.size());
+
+	for (PhysicsObject* phyObj : physicsObjects)
+	{
+		if (!phyObj->isPhysicsEnabled) continue;
+
+		BroadphaseEntry entry;
+		entry.phyObj = phyObj;
+		entry.shape = phyObj->shape;
+		entry.layerBit = 1u << (phyObj->layer & 31);
+		entry.aabb = phyObj->GetModelAABB();
+		entry.sweptAabb = entry.aabb;
+		entry.transformMatrix = phyObj->transform.GetTransformMatrix();
+		entry.inverseMatrix = phyObj->GetInverseTransformMatrix();
+
+		if (phyObj->shape == SPHERE)
+		{
+			entry.sphere = *dynamic_cast<Sphere*>(phyObj->GetTransformedPhysicsShape());
+		}
+		else if (phyObj->shape == PLANE)
+		{
+			entry.plane = *dynamic_cast<Plane*>(phyObj->GetTransformedPhysicsShape());
+		}
+		else if (phyObj->shape == CAPSULE)
+		{
+			entry.capsule = *dynamic_cast<Capsule*>(phyObj->GetTransformedPhysicsShape());
+		}
+		else if (phyObj->shape == MESH_OF_TRIANGLES)
+		{
+			entry.bvh = phyObj->GetSharedBvh();
+			entry.triangles = phyObj->GetSharedTriangleList();
+		}
+
+		//Moving objects are integrated once during the step, grow their bounds by that move so
+		//the pair search still finds them after earlier objects in the loop have moved
+		if (phyObj->mode != PhysicsMode::STATIC && phyObj->properties.GetInverseMass() >= 0)
+		{
+			glm::vec3 objectGravity = gravity * phyObj->properties.gravityScale;
+			glm::vec3 displacement = (phyObj->velocity +
+				objectGravity * deltaTime * phyObj->properties.GetInverseMass()) * deltaTime;
+
+			entry.sweptAabb.min += glm::min(displacement, glm::vec3(0.0f));
+			entry.sweptAabb.max += glm::max(displacement, glm::vec3(0.0f));
+		}
+
+		entries.push_back(entry);
+	}
+
+	return std::make_shared<const BroadphaseSnapshot>(std::move(entries));
+}
+
+std::shared_ptr<const BroadphaseSnapshot> PhysicsEngine::GetBroadphaseSnapshot() const
+{
+	return std::atomic_load(&broadphase);
+}
+
+static bool RayCastEntry(const BroadphaseEntry& entry, const glm::vec3& rayOrigin, const glm::vec3& rayDirection,
+	float maxDistance, RaycastHit& hit)
+{
+	glm::vec3 direction = rayDirection;
+
+	switch (entry.shape)
+	{
+	case SPHERE:
+	{
+		Sphere sphere = entry.sphere;
+
+		if (!RayCastSphere(rayOrigin, direction, &sphere, maxDistance, hit.point, hit.normal)) return false;
+
+		hit.distance = glm::distance(rayOrigin, hit.point);
+		break;
+	}
+	case AABB:
+
+		if (!RayCastAABB(rayOrigin, direction, entry.aabb, maxDistance, hit.point, hit.normal)) return false;
+
+		hit.distance = glm::distance(rayOrigin, hit.point);
+		break;
+
+	case PLANE:
+
+		if (!RayCastPlane(rayOrigin, direction, maxDistance, entry.plane, hit.distance)) return false;
+
+		hit.point = rayOrigin + direction * hit.distance;
+		hit.normal = entry.plane.normal;
+		break;
+
+	case CAPSULE:
+
+		if (!RayCastCapsule(rayOrigin, direction, maxDistance, entry.capsule, hit.distance, hit.normal)) return false;
+
+		hit.point = rayOrigin + direction * hit.distance;
+		break;
+
+	case MESH_OF_TRIANGLES:
+
+		if (entry.bvh != nullptr)
+		{
+			if (!RayCastMesh(rayOrigin, direction, entry.bvh.get(), entry.transformMatrix, entry.inverseMatrix,
+				maxDistance, *entry.triangles, hit)) return false;
+			break;
+		}
+
+		if (!RayCastMesh(rayOrigin, direction, entry.transformMatrix, maxDistance, *entry.triangles,
+			hit.point, hit.normal)) return false;
+
+		hit.distance = glm::distance(rayOrigin, hit.point);
+		break;
+
+	default:
+		return false;
+	}
+
+	hit.phyObj = entry.phyObj;
+	return true;
+}
+
+static bool SphereOverlapsAABB(const Sphere& sphere, const Aabb& aabb)
+{
+	glm::vec3 closestPoint = glm::clamp(sphere.position, aabb.min, aabb.max);
+	glm::vec3 offset = sphere.position - closestPoint;
+
+	return glm::dot(offset, offset) <= sphere.radius * sphere.radius;
+}
+
+//querySphere is null for box queries, queryAabb always bounds the query shape
+static bool OverlapEntry(const BroadphaseEntry& entry, const Aabb& queryAabb, const Sphere* querySphere)
+{
+	switch (entry.shape)
+	{
+	case SPHERE:
+
+		if (querySphere != nullptr)
+		{
+			glm::vec3 offset = querySphere->position - entry.sphere.position;
+			float radius = querySphere->radius + entry.sphere.radius;
+
+			return glm::dot(offset, offset) <= radius * radius;
+		}
+
+		return SphereOverlapsAABB(entry.sphere, queryAabb);
+
+	case AABB:
+
+		if (querySphere != nullptr) return SphereOverlapsAABB(*querySphere, entry.aabb);
+
+		return CollisionAABBvsAABB(queryAabb, entry.aabb);
+
+	case PLANE:
+	case CAPSULE:
+	{
+		std::vector<glm::vec3> collisionPoints;
+		std::vector<glm::vec3> collisionNormals;
+
+		if (entry.shape == PLANE)
+		{
+			if (querySphere != nullptr) return CollisionSphereVsPlane(*querySphere, entry.plane, collisionPoints, collisionNormals);
+
+			return CollisionAABBVsPlane(queryAabb, entry.plane, collisionPoints, collisionNormals);
+		}
+
+		if (querySphere != nullptr) return CollisionSphereVsCapsule(*querySphere, entry.capsule, collisionPoints, collisionNormals);
+
+		return CollisionCapsuleVsAABB(entry.capsule, queryAabb, collisionPoints, collisionNormals);
+	}
+	case MESH_OF_TRIANGLES:
+	{
+		if (entry.bvh == nullptr) return CollisionAABBvsAABB(queryAabb, entry.aabb);
+
+		std::vector<glm::vec3> collisionPoints;
+		std::vector<glm::vec3> collisionNormals;
+		std::vector<Aabb> collisionAabbs;
+
+		if (querySphere != nullptr)
+		{
+			Sphere sphere = *querySphere;
+
+			CollisionSphereVsMeshOfTriangles(queryAabb, &sphere, entry.bvh.get(), entry.transformMatrix, entry.inverseMatrix,
+				*entry.triangles, collisionPoints, collisionNormals, collisionAabbs);
+		}
+		else
+		{
+			CollisionAABBVsMeshOfTriangles(queryAabb, entry.bvh.get(), entry.transformMatrix, entry.inverseMatrix,
+				*entry.triangles, collisionPoints, collisionNormals, collisionAabbs);
+		}
+
+		//Both return true as soon as a leaf is reached, only actual triangle contacts count here
+		return !collisionPoints.empty();
+	}
+	default:
+		return CollisionAABBvsAABB(queryAabb, entry.aabb);
+	}
+}
+
+bool PhysicsEngine::Raycast(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, float maxDistance,
+	RaycastHit& hit, unsigned int layerMask) const
+{
+	std::shared_ptr<const BroadphaseSnapshot> snapshot = GetBroadphaseSnapshot();
+
+	if (snapshot == nullptr) return false;
+
+	glm::vec3 direction = glm::normalize(rayDirection);
+
+	std::vector<std::pair<float, unsigned int>> candidates;
+	snapshot->QueryRay(rayOrigin, direction, maxDistance, layerMask, candidates);
+
+	//Nearest bounds first, stop once the next object starts past the closest hit
+	std::sort(candidates.begin(), candidates.end());
+
+	float closestDistance = maxDistance;
+	bool found = false;
+
+	for (const std::pair<float, unsigned int>& candidate : candidates)
+	{
+		if (candidate.first > closestDistance) break;
+
+		RaycastHit candidateHit;
+
+		if (!RayCastEntry(snapshot->GetEntries()[candidate.second], rayOrigin, direction, closestDistance, candidateHit)) continue;
+
+		if (candidateHit.distance > closestDistance) continue;
+
+		hit = candidateHit;
+		closestDistance = candidateHit.distance;
+		found = true;
+	}
+
+	return found;
+}
+
+int PhysicsEngine::RaycastAll(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, float maxDistance,
+	std::vector<RaycastHit>& hits, unsigned int layerMask) const
+{
+	std::shared_ptr<const BroadphaseSnapshot> snapshot = GetBroadphaseSnapshot();
+
+	if (snapshot == nullptr) return 0;
+
+	glm::vec3 direction = glm::normalize(rayDirection);
+
+	std::vector<std::pair<float, unsigned int>> candidates;
+	snapshot->QueryRay(rayOrigin, direction, maxDistance, layerMask, candidates);
+
+	size_t firstHit = hits.size();
+
+	for (const std::pair<float, unsigned int>& candidate : candidates)
+	{
+		RaycastHit hit;
+
+		if (RayCastEntry(snapshot->GetEntries()[candidate.second], rayOrigin, direction, maxDistance, hit))
+		{
+			hits.push_back(hit);
+		}
+	}
+
+	std::sort(hits.begin() + firstHit, hits.end(),
+		[](const RaycastHit& a, const RaycastHit& b) { return a.distance < b.distance; });
+
+	return (int)(hits.size() - firstHit);
+}
+
+int PhysicsEngine::RaycastBatch(const Ray* rays, int numOfRays, RaycastHit* hits, unsigned int layerMask) const
+{
+	for (int i = 0; i < numOfRays; i++)
+	{
+		hits[i] = RaycastHit();
+	}
 
+	std::shared_ptr<const BroadphaseSnapshot> snapshot = GetBroadphaseSnapshot();
 
+	if (snapshot == nullptr) return 0;
+
+	std::vector<std::pair<float, unsigned int>> rayCandidates;
+	std::vector<unsigned int> packetCandidates;
+
+	int numOfHits = 0;
+
+	for (int first = 0; first < numOfRays; first += RAY_PACKET_SIZE)
+	{
+		int numOfLanes = std::min(RAY_PACKET_SIZE, numOfRays - first);
+
+		//maxDistance of each lane shrinks to its closest hit as objects are tested
+		Ray packetRays[RAY_PACKET_SIZE];
+		packetCandidates.clear();
+
+		for (int lane = 0; lane < numOfLanes; lane++)
+		{
+			packetRays[lane] = rays[first + lane];
+			packetRays[lane].direction = glm::normalize(packetRays[lane].direction);
+
+			rayCandidates.clear();
+			snapshot->QueryRay(packetRays[lane].origin, packetRays[lane].direction, packetRays[lane].maxDistance,
+				layerMask, rayCandidates);
+
+			for (const std::pair<float, unsigned int>& candidate : rayCandidates)
+			{
+				packetCandidates.push_back(candidate.second);
+			}
+		}
+
+		std::sort(packetCandidates.begin(), packetCandidates.end());
+		packetCandidates.erase(std::unique(packetCandidates.begin(), packetCandidates.end()), packetCandidates.end());
+
+		for (unsigned int entryIndex : packetCandidates)
+		{
+			const BroadphaseEntry& entry = snapshot->GetEntries()[entryIndex];
+
+			if (entry.shape == MESH_OF_TRIANGLES && entry.bvh != nullptr)
+			{
+				RayHit meshHits[RAY_PACKET_SIZE];
+
+				if (RayCastMeshBatch(packetRays, numOfLanes, entry.bvh.get(), entry.transformMatrix, entry.inverseMatrix,
+					*entry.triangles, meshHits) == 0) continue;
+
+				for (int lane = 0; lane < numOfLanes; lane++)
+				{
+					if (meshHits[lane].triangleIndex < 0) continue;
+
+					static_cast<RayHit&>(hits[first + lane]) = meshHits[lane];
+					hits[first + lane].phyObj = entry.phyObj;
+					packetRays[lane].maxDistance = meshHits[lane].distance;
+				}
+
+				continue;
+			}
+
+			for (int lane = 0; lane < numOfLanes; lane++)
+			{
+				RaycastHit hit;
+
+				if (!RayCastEntry(entry, packetRays[lane].origin, packetRays[lane].direction,
+					packetRays[lane].maxDistance, hit)) continue;
+
+				if (hit.distance > packetRays[lane].maxDistance) continue;
+
+				hits[first + lane] = hit;
+				packetRays[lane].maxDistance = hit.distance;
+			}
+		}
+
+		for (int lane = 0; lane < numOfLanes; lane++)
+		{
+			if (hits[first + lane].phyObj != nullptr) numOfHits++;
+		}
+	}
+
+	return numOfHits;
+}
+
+//box is null for sphere casts
+static bool SweepEntry(const BroadphaseEntry& entry, const Sphere* sphere, const Aabb* box,
+	const glm::vec3& direction, float maxDistance, ShapeCastHit& hit)
+{
+	switch (entry.shape)
+	{
+	case SPHERE:
+
+		if (sphere != nullptr)
+		{
+			if (!SweepSphereVsSphere(*sphere, direction, maxDistance, entry.sphere, hit.distance, hit.normal)) return false;
+
+			hit.point = entry.sphere.position + hit.normal * entry.sphere.radius;
+			break;
+		}
+
+		//Same as the sphere moving backwards into the still box
+		if (!SweepSphereVsAABB(entry.sphere, -direction, maxDistance, *box, hit.distance, hit.normal)) return false;
+
+		hit.normal = -hit.normal;
+		hit.point = entry.sphere.position + hit.normal * entry.sphere.radius;
+		break;
+
+	case PLANE:
+
+		if (sphere != nullptr)
+		{
+			if (!SweepSphereVsPlane(*sphere, direction, maxDistance, entry.plane, hit.distance, hit.normal)) return false;
+
+			hit.point = sphere->position + direction * hit.distance - hit.normal * sphere->radius;
+			break;
+		}
+
+		if (!SweepAABBVsPlane(*box, direction, maxDistance, entry.plane, hit.distance, hit.normal)) return false;
+
+		hit.point = (box->min + box->max) * 0.5f + direction * hit.distance;
+		hit.point -= hit.normal * (glm::dot(hit.normal, hit.point) - entry.plane.dotofPoint);
+		break;
+
+	case CAPSULE:
+
+		if (sphere != nullptr)
+		{
+			if (!SweepSphereVsCapsule(*sphere, direction, maxDistance, entry.capsule, hit.distance, hit.normal)) return false;
+
+			hit.point = sphere->position + direction * hit.distance - hit.normal * sphere->radius;
+			break;
+		}
+
+		//Boxes only see the capsule bounds
+		if (!SweepAABBVsAABB(*box, direction, maxDistance, entry.aabb, hit.distance, hit.normal)) return false;
+
+		hit.point = glm::clamp((box->min + box->max) * 0.5f + direction * hit.distance, entry.aabb.min, entry.aabb.max);
+		break;
+
+	case MESH_OF_TRIANGLES:
+
+		if (entry.bvh != nullptr)
+		{
+			if (sphere != nullptr)
+			{
+				if (!SweepSphereVsMesh(*sphere, direction, maxDistance, entry.bvh.get(), entry.transformMatrix,
+					entry.inverseMatrix, *entry.triangles, hit)) return false;
+			}
+			else
+			{
+				if (!SweepAABBVsMesh(*box, direction, maxDistance, entry.bvh.get(), entry.transformMatrix,
+					entry.inverseMatrix, *entry.triangles, hit)) return false;
+			}
+			break;
+		}
+
+		//Without a bvh the mesh is only as precise as its bounds
+	case AABB:
+
+		if (sphere != nullptr)
+		{
+			if (!SweepSphereVsAABB(*sphere, direction, maxDistance, entry.aabb, hit.distance, hit.normal)) return false;
+
+			hit.point = glm::clamp(sphere->position + direction * hit.distance, entry.aabb.min, entry.aabb.max);
+			break;
+		}
+
+		if (!SweepAABBVsAABB(*box, direction, maxDistance, entry.aabb, hit.distance, hit.normal)) return false;
+
+		hit.point = glm::clamp((box->min + box->max) * 0.5f + direction * hit.distance, entry.aabb.min, entry.aabb.max);
+		break;
+
+	default:
+		return false;
+	}
+
+	hit.phyObj = entry.phyObj;
+	return true;
+}
+
+static bool ShapeCast(const BroadphaseSnapshot& snapshot, const Sphere* sphere, const Aabb& shapeAabb,
+	const glm::vec3& direction, float maxDistance, ShapeCastHit& hit, unsigned int layerMask)
+{
+	glm::vec3 offset = direction * maxDistance;
+
+	Aabb sweptAabb(glm::min(shapeAabb.min, shapeAabb.min + offset), glm::max(shapeAabb.max, shapeAabb.max + offset));
+
+	std::vector<unsigned int> candidates;
+	snapshot.QueryAABB(sweptAabb, layerMask, candidates);
+
+	float closestDistance = maxDistance;
+	bool found = false;
+
+	for (unsigned int entryIndex : candidates)
+	{
+		const BroadphaseEntry& entry = snapshot.GetEntries()[entryIndex];
+
+		if (!CollisionAABBvsAABB(sweptAabb, entry.aabb)) continue;
+
+		ShapeCastHit candidateHit;
+
+		if (!SweepEntry(entry, sphere, sphere == nullptr ? &shapeAabb : nullptr, direction, closestDistance, candidateHit)) continue;
+
+		if (candidateHit.distance > closestDistance) continue;
+
+		hit = candidateHit;
+		closestDistance = candidateHit.distance;
+		found = true;
+	}
+
+	if (found)
+	{
+		hit.timeOfImpact = maxDistance > 0.0f ? hit.distance / maxDistance : 0.0f;
+	}
+
+	return found;
+}
+
+bool PhysicsEngine::SphereCast(const glm::vec3& center, float radius, const glm::vec3& direction, float maxDistance,
+	ShapeCastHit& hit, unsigned int layerMask) const
+{
+	std::shared_ptr<const BroadphaseSnapshot> snapshot = GetBroadphaseSnapshot();
+
+	if (snapshot == nullptr) return false;
+
+	Sphere sphere(center, radius);
+	Aabb sphereAabb(center - glm::vec3(radius), center + glm::vec3(radius));
+
+	return ShapeCast(*snapshot, &sphere, sphereAabb, glm::normalize(direction), maxDistance, hit, layerMask);
+}
+
+bool PhysicsEngine::BoxCast(const Aabb& box, const glm::vec3& direction, float maxDistance,
+	ShapeCastHit& hit, unsigned int layerMask) const
+{
+	std::shared_ptr<const BroadphaseSnapshot> snapshot = GetBroadphaseSnapshot();
+
+	if (snapshot == nullptr) return false;
+
+	return ShapeCast(*snapshot, nullptr, box, glm::normalize(direction), maxDistance, hit, layerMask);
+}
+
+int PhysicsEngine::OverlapSphere(const glm::vec3& center, float radius,
+	std::vector<PhysicsObject*>& results, unsigned int layerMask) const
+{
+	std::shared_ptr<const BroadphaseSnapshot> snapshot = GetBroadphaseSnapshot();
+
+	if (snapshot == nullptr) return 0;
+
+	Sphere sphere(center, radius);
+	Aabb sphereAabb(center - glm::vec3(radius), center + glm::vec3(radius));
+
+	std::vector<unsigned int> candidates;
+	snapshot->QueryAABB(sphereAabb, layerMask, candidates);
+
+	int count = 0;
+
+	for (unsigned int entryIndex : candidates)
+	{
+		const BroadphaseEntry& entry = snapshot->GetEntries()[entryIndex];
+
+		if (!CollisionAABBvsAABB(sphereAabb, entry.aabb)) continue;
+		if (!OverlapEntry(entry, sphereAabb, &sphere)) continue;
+
+		results.push_back(entry.phyObj);
+		count++;
+	}
+
+	return count;
+}
+
+int PhysicsEngine::OverlapAABB(const Aabb& aabb,
+	std::vector<PhysicsObject*>& results, unsigned int layerMask) const
+{
+	std::shared_ptr<const BroadphaseSnapshot> snapshot = GetBroadphaseSnapshot();
+
+	if (snapshot == nullptr) return 0;
+
+	std::vector<unsigned int> candidates;
+	snapshot->QueryAABB(aabb, layerMask, candidates);
+
+	int count = 0;
+
+	for (unsigned int entryIndex : candidates)
+	{
+		const BroadphaseEntry& entry = snapshot->GetEntries()[entryIndex];
+
+		if (!CollisionAABBvsAABB(aabb, entry.aabb)) continue;
+		if (!OverlapEntry(entry, aabb, nullptr)) continue;
+
+		results.push_back(entry.phyObj);
+		count++;
+	}
+
+	return count;
+}
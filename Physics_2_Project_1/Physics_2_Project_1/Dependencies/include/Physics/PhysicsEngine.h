@@ -1,8 +1,20 @@
 #pragma once
 
 #include "PhysicsObject.h"
+#include "Broadphase.h"
 #include "Softbody/BaseSoftBody.h"
 #include <Windows.h>
+#include <memory>
+
+struct RaycastHit : public RayHit
+{
+	PhysicsObject* phyObj = nullptr;
+};
+
+struct ShapeCastHit : public RaycastHit
+{
+	float timeOfImpact = 0;		//distance over maxDistance, 0 when the shape already overlaps at the start
+};
 
 class PhysicsEngine
 {
@@ -17,7 +29,11 @@ private:
 
 	CRITICAL_SECTION* softBody_CritSection = nullptr;
 
+	std::shared_ptr<const BroadphaseSnapshot> broadphase;
+	std::vector<unsigned int> broadphaseCandidates;
+
 	void UpdatePhysics(float deltaTime);
+	std::shared_ptr<const BroadphaseSnapshot> BuildBroadphase(float deltaTime);
  	
 public:
 	float fixedStepTime = 0.01f;
@@ -38,8 +54,32 @@ public:
 	void Update(float deltaTime);
 	void UpdateSoftBodies(float deltaTime, CRITICAL_SECTION& criticalSection);
 	void UpdateSoftBodyBufferData();
+	//Guards the soft body meshes, null until the soft body thread has run
+	CRITICAL_SECTION* GetSoftBodyCriticalSection();
 	void SetDebugSpheres(Model* model, int count);
 
+	//Scene queries against the snapshot of the last physics step, safe to call from any thread.
+	//Mesh shapes hold the triangles and bvh published at that step, later refits publish new copies
+	bool Raycast(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, float maxDistance,
+		RaycastHit& hit, unsigned int layerMask = ALL_PHYSICS_LAYERS) const;
+	int RaycastAll(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, float maxDistance,
+		std::vector<RaycastHit>& hits, unsigned int layerMask = ALL_PHYSICS_LAYERS) const;
+	//One hit per ray in hits, which needs numOfRays entries. Misses keep a null phyObj.
+	//Mesh shapes are traced a packet of rays at a time. Returns the number of rays that hit
+	int RaycastBatch(const Ray* rays, int numOfRays, RaycastHit* hits,
+		unsigned int layerMask = ALL_PHYSICS_LAYERS) const;
+	//Moves the shape along direction and returns the first object it touches. distance is how far
+	//the shape travels, point is where it touches and normal points back towards the moving shape
+	bool SphereCast(const glm::vec3& center, float radius, const glm::vec3& direction, float maxDistance,
+		ShapeCastHit& hit, unsigned int layerMask = ALL_PHYSICS_LAYERS) const;
+	bool BoxCast(const Aabb& box, const glm::vec3& direction, float maxDistance,
+		ShapeCastHit& hit, unsigned int layerMask = ALL_PHYSICS_LAYERS) const;
+	int OverlapSphere(const glm::vec3& center, float radius,
+		std::vector<PhysicsObject*>& results, unsigned int layerMask = ALL_PHYSICS_LAYERS) const;
+	int OverlapAABB(const Aabb& aabb,
+		std::vector<PhysicsObject*>& results, unsigned int layerMask = ALL_PHYSICS_LAYERS) const;
+
+	std::shared_ptr<const BroadphaseSnapshot> GetBroadphaseSnapshot() const;
 
 	void Shutdown();
 };
@@ -57,7 +97,40 @@ static bool RayCast(const glm::vec3& rayOrigin, glm::vec3 rayDir, PhysicsObject*
 	case AABB:
 		return RayCastAABB(rayOrigin, rayDir, phyObject->GetModelAABB(),
 			rayDistance, collisionPt, collisionNormal);
+	case PLANE:
+	{
+		Plane* plane = dynamic_cast<Plane*>(phyObject->GetTransformedPhysicsShape());
+		float distance;
+
+		if (!RayCastPlane(rayOrigin, glm::normalize(rayDir), rayDistance, *plane, distance)) return false;
+
+		collisionPt = rayOrigin + glm::normalize(rayDir) * distance;
+		collisionNormal = plane->normal;
+		return true;
+	}
+	case CAPSULE:
+	{
+		float distance;
+
+		if (!RayCastCapsule(rayOrigin, glm::normalize(rayDir), rayDistance,
+			*dynamic_cast<Capsule*>(phyObject->GetTransformedPhysicsShape()), distance, collisionNormal)) return false;
+
+		collisionPt = rayOrigin + glm::normalize(rayDir) * distance;
+		return true;
+	}
 	case MESH_OF_TRIANGLES:
+		if (phyObject->hierarchialAABB != nullptr)
+		{
+			RayHit hit;
+
+			if (!RayCastMesh(rayOrigin, rayDir, phyObject->hierarchialAABB, phyObject->transform.GetTransformMatrix(),
+				phyObject->GetInverseTransformMatrix(), rayDistance, phyObject->GetTriangleList(), hit)) return false;
+
+			collisionPt = hit.point;
+			collisionNormal = hit.normal;
+			return true;
+		}
+
 		return RayCastMesh(rayOrigin, rayDir, phyObject->transform.GetTransformMatrix(),
 			rayDistance, phyObject->GetTriangleList(), collisionPt, collisionNormal);
 	}
@@ -2,6 +2,7 @@
 #include <Graphics/Buffer/Triangle.h>
 #include <Graphics/Panels/ImguiDrawUtils.h>
 #include "PhysicsEngine.h"
+#include <Graphics/Debugger.h>
 
 
 PhysicsObject::PhysicsObject()
@@ -40,12 +41,56 @@ void PhysicsObject::SetDrawOrientation(const glm::vec3& newOrientation)
 
 const std::vector<Triangle>& PhysicsObject::GetTriangleList()
 {
-	return triangles;
+	return *triangles;
 }
 
-const std::vector<Sphere*>& PhysicsObject::GetSphereList()
+std::shared_ptr<const std::vector<Triangle>> PhysicsObject::GetSharedTriangleList()
 {
-	return triangleSpheres;
+	return std::atomic_load(&triangles);
+}
+
+std::shared_ptr<const std::vector<Sphere>> PhysicsObject::GetSharedSphereList()
+{
+	std::shared_ptr<const std::vector<Triangle>> currentTriangles = GetSharedTriangleList();
+	std::shared_ptr<const TriangleSpheres> cached = std::atomic_load(&triangleSpheres);
+
+	//Rebuilt only after new triangles are published, threads racing here build the same list
+	if (cached == nullptr || cached->triangles != currentTriangles)
+	{
+		std::shared_ptr<TriangleSpheres> newSpheres = std::make_shared<TriangleSpheres>();
+		newSpheres->triangles = currentTriangles;
+		newSpheres->spheres.reserve(currentTriangles->size());
+
+		for (const Triangle& triangle : *currentTriangles)
+		{
+			glm::vec3 sphereCenter = (triangle.v1 + triangle.v2 + triangle.v3) / 3.0f;
+			float radius = glm::max(glm::distance(sphereCenter, triangle.v1),
+				glm::max(glm::distance(sphereCenter, triangle.v2), glm::distance(sphereCenter, triangle.v3)));
+
+			newSpheres->spheres.push_back(Sphere(sphereCenter, radius));
+		}
+
+		cached = newSpheres;
+		std::atomic_store(&triangleSpheres, cached);
+	}
+
+	return std::shared_ptr<const std::vector<Sphere>>(cached, &cached->spheres);
+}
+
+std::shared_ptr<const HierarchicalAABB> PhysicsObject::GetSharedBvh()
+{
+	return std::atomic_load(&sharedHierarchialAABB);
+}
+
+void PhysicsObject::PublishTriangles(const std::shared_ptr<const std::vector<Triangle>>& newTriangles)
+{
+	std::atomic_store(&triangles, newTriangles);
+}
+
+void PhysicsObject::PublishBvh(const std::shared_ptr<HierarchicalAABB>& newBvh)
+{
+	hierarchialAABB = newBvh.get();
+	std::atomic_store(&sharedHierarchialAABB, newBvh);
 }
 
 const std::vector<glm::vec3>& PhysicsObject::GetCollisionPoints()
@@ -102,6 +147,26 @@ void PhysicsObject::DrawPhysicsShape()
 
 		break;
 	case PLANE:
+	{
+		Plane* plane = (Plane*)GetTransformedPhysicsShape();
+
+		//A square of the model size on the plane and the normal from its center
+		Aabb modelAabb = GetModelAABB();
+		glm::vec3 center = (modelAabb.min + modelAabb.max) * 0.5f;
+		center -= plane->normal * (glm::dot(plane->normal, center) - plane->dotofPoint);
+
+		float halfSize = glm::max(0.5f, 0.5f * glm::length(modelAabb.max - modelAabb.min));
+
+		glm::vec3 tangent = glm::abs(plane->normal.y) < 0.99f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0);
+		tangent = glm::normalize(glm::cross(plane->normal, tangent)) * halfSize;
+		glm::vec3 bitangent = glm::cross(plane->normal, tangent);
+
+		Renderer::GetInstance().DrawLine(center - tangent - bitangent, center + tangent - bitangent, shapeColor);
+		Renderer::GetInstance().DrawLine(center + tangent - bitangent, center + tangent + bitangent, shapeColor);
+		Renderer::GetInstance().DrawLine(center + tangent + bitangent, center - tangent + bitangent, shapeColor);
+		Renderer::GetInstance().DrawLine(center - tangent + bitangent, center - tangent - bitangent, shapeColor);
+		Renderer::GetInstance().DrawLine(center, center + plane->normal * halfSize * 0.25f, shapeColor);
+	}
 		break;
 	case TRIANGLE:
 		break;
@@ -109,6 +174,24 @@ void PhysicsObject::DrawPhysicsShape()
 		Renderer::GetInstance().DrawAABB(GetGraphicsAabb(GetModelAABB()), shapeColor);
 		break;
 	case CAPSULE:
+	{
+		Capsule* capsule = (Capsule*)GetTransformedPhysicsShape();
+
+		Renderer::GetInstance().DrawSphere(capsule->start, capsule->radius, shapeColor);
+		Renderer::GetInstance().DrawSphere(capsule->end, capsule->radius, shapeColor);
+
+		glm::vec3 axis = capsule->end - capsule->start;
+		axis = glm::dot(axis, axis) > 0.0f ? glm::normalize(axis) : glm::vec3(0, 1, 0);
+
+		glm::vec3 side = glm::abs(axis.y) < 0.99f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0);
+		side = glm::normalize(glm::cross(axis, side)) * capsule->radius;
+		glm::vec3 otherSide = glm::cross(axis, side);
+
+		Renderer::GetInstance().DrawLine(capsule->start + side, capsule->end + side, shapeColor);
+		Renderer::GetInstance().DrawLine(capsule->start - side, capsule->end - side, shapeColor);
+		Renderer::GetInstance().DrawLine(capsule->start + otherSide, capsule->end + otherSide, shapeColor);
+		Renderer::GetInstance().DrawLine(capsule->start - otherSide, capsule->end - otherSide, shapeColor);
+	}
 		break;
 	case MESH_OF_TRIANGLES:
 		Renderer::GetInstance().DrawAABB(GetGraphicsAabb(GetModelAABB()), shapeColor);
@@ -145,6 +228,75 @@ void PhysicsObject::DrawPhysicsProperties()
 	ImGui::TreePop();
 }
 
+void PhysicsObject::DrawBvhStats()
+{
+	if (shape != MESH_OF_TRIANGLES || hierarchialAABB == nullptr) return;
+
+	if (!ImGui::TreeNodeEx("BVH Stats"))
+	{
+		return;
+	}
+
+	const BvhStats& stats = hierarchialAABB->GetStats();
+
+	ImGui::Text("Nodes : %d", stats.numOfNodes);
+	ImGui::Text("Leaves : %d", stats.numOfLeaves);
+	ImGui::Text("Depth : %d", stats.maxDepth);
+	ImGui::Text("Leaf Size : %d - %d, avg %.2f", stats.minLeafSize, stats.maxLeafSize, stats.averageLeafSize);
+	ImGui::Text("Leaf Depth : avg %.2f", stats.averageLeafDepth);
+	ImGui::Text("Triangle Refs : %d / %d", stats.numOfTriangleReferences, (int)triangles->size());
+	ImGui::Text("SAH Cost : %.2f", stats.sahCost);
+	ImGui::Text(stats.loadedFromCache ? "Cache Load Time : %.2f ms" : "Build Time : %.2f ms", stats.buildTime);
+	ImGui::Text("Memory : %.1f KB%s", hierarchialAABB->GetMemoryUsage() / 1024.0f,
+		hierarchialAABB->IsQuantized() ? " (Quantized)" : "");
+
+	if (ImGui::Button("Compare Build Modes"))
+	{
+		CompareBvhBuildModes();
+	}
+
+	if (hasBvhBuildModeStats)
+	{
+		for (int i = 0; i < 2; i++)
+		{
+			const BvhStats& modeStats = bvhBuildModeStats[i];
+
+			ImGui::Text("%s : SAH %.2f, %d leaves, leaf size %d - %d avg %.2f, depth %d, %.2f ms", bvhBuildModeStrings[i],
+				modeStats.sahCost, modeStats.numOfLeaves, modeStats.minLeafSize, modeStats.maxLeafSize,
+				modeStats.averageLeafSize, modeStats.maxDepth, modeStats.buildTime);
+		}
+	}
+
+	ImGui::TreePop();
+}
+
+void PhysicsObject::CompareBvhBuildModes()
+{
+	if (shape != MESH_OF_TRIANGLES) return;
+
+	BvhBuildMode modes[2] = { MIDPOINT_SPLIT, SAH_SPLIT };
+
+	for (BvhBuildMode buildMode : modes)
+	{
+		HierarchicalAABB bvh(this, maxDepth, buildMode, false);
+
+		const BvhStats& modeStats = bvh.GetStats();
+		std::string prefix = "BVH " + std::string(bvhBuildModeStrings[(int)buildMode]) + " " + name;
+
+		Debugger::Print(prefix + " SAH cost : ", modeStats.sahCost);
+		Debugger::Print(prefix + " leaves : ", modeStats.numOfLeaves);
+		Debugger::Print(prefix + " leaf size min : ", modeStats.minLeafSize);
+		Debugger::Print(prefix + " leaf size max : ", modeStats.maxLeafSize);
+		Debugger::Print(prefix + " leaf size avg : ", modeStats.averageLeafSize);
+		Debugger::Print(prefix + " leaf depth avg : ", modeStats.averageLeafDepth);
+		Debugger::Print(prefix + " triangle refs : ", modeStats.numOfTriangleReferences);
+
+		bvhBuildModeStats[(int)buildMode] = modeStats;
+	}
+
+	hasBvhBuildModeStats = true;
+}
+
 void PhysicsObject::OnPropertyDraw()
 {
 	Model::OnPropertyDraw();
@@ -158,9 +310,18 @@ void PhysicsObject::OnPropertyDraw()
 	}
 
 	ImGuiUtils::DrawBool("InvokeCollision", isCollisionInvoke);
+	ImGuiUtils::DrawInt("Layer", layer);
 	ImGuiUtils::DrawBool("UseBVH", useBvh);
+	ImGuiUtils::DrawBool("Deformable", isDeformable);
+	ImGuiUtils::DrawBool("BVH_Cache", useBvhCache);
+	ImGuiUtils::DrawBool("BVH_Quantized", useQuantizedBvh);
 	ImGuiUtils::DrawFloat("BVH_Depth", maxDepth);
 
+	if (ImGuiUtils::DrawDropDown("BVH_Builder", bvhBuildModeInt, bvhBuildModeStrings, 2))
+	{
+		bvhBuildMode = (BvhBuildMode)bvhBuildModeInt;
+	};
+
 	if (ImGuiUtils::DrawDropDown("Mode", modeInt, modeStrings, 2))
 	{
 		mode = PhysicsMode(modeInt);
@@ -178,6 +339,7 @@ void PhysicsObject::OnPropertyDraw()
 	};
 
 	DrawPhysicsProperties();
+	DrawBvhStats();
 
 	ImGui::TreePop();
 }
@@ -303,6 +465,19 @@ Aabb PhysicsObject::GetAABB()
 	return aabb;
 }
 
+const glm::mat4& PhysicsObject::GetInverseTransformMatrix()
+{
+	glm::mat4 transformMatrix = transform.GetTransformMatrix();
+
+	if (cachedInverseSource != transformMatrix)
+	{
+		cachedInverseSource = transformMatrix;
+		cachedInverseMatrix = glm::inverse(transformMatrix);
+	}
+
+	return cachedInverseMatrix;
+}
+
 void PhysicsObject::AddExludingPhyObj(PhysicsObject* phyObj)
 {
 	listOfExcludingPhyObjects.push_back(phyObj);
@@ -335,11 +510,47 @@ void PhysicsObject::CalculatePhysicsShape()
 		physicsShape = new Sphere(position, radius);
 		transformedPhysicsShape = new Sphere();
 	}
+	else if (shape == PLANE)
+	{
+		//Flattest side of the model, facing along the positive axis through its center
+		glm::vec3 sideLengths = aabb.max - aabb.min;
+		glm::vec3 normal = glm::vec3(0.0f);
+
+		if (sideLengths.x < sideLengths.y && sideLengths.x < sideLengths.z) normal.x = 1.0f;
+		else if (sideLengths.z < sideLengths.y) normal.z = 1.0f;
+		else normal.y = 1.0f;
+
+		physicsShape = new Plane(normal, glm::dot(normal, (aabb.min + aabb.max) * 0.5f));
+		transformedPhysicsShape = new Plane();
+	}
+	else if (shape == CAPSULE)
+	{
+		//Along the longest side, as wide as the larger of the other two
+		glm::vec3 center = (aabb.min + aabb.max) * 0.5f;
+		glm::vec3 halfExtents = (aabb.max - aabb.min) * 0.5f;
+
+		int axis = aabb.GetMaxExtentAxis();
+		float radius = glm::max(halfExtents[(axis + 1) % 3], halfExtents[(axis + 2) % 3]);
+
+		glm::vec3 halfSegment = glm::vec3(0.0f);
+		halfSegment[axis] = glm::max(halfExtents[axis] - radius, 0.0f);
+
+		physicsShape = new Capsule(center - halfSegment, center + halfSegment, radius);
+		transformedPhysicsShape = new Capsule();
+	}
 	else if (shape == MESH_OF_TRIANGLES)
 	{
-		CalculateTriangleSpheres();
+		CalculateTriangles();
 		transformedPhysicsShape = new Triangle();
-		hierarchialAABB = new HierarchicalAABB(this, maxDepth);
+		std::shared_ptr<HierarchicalAABB> newBvh = std::make_shared<HierarchicalAABB>(this, maxDepth, bvhBuildMode,
+			useBvhCache && !isDeformable);
+
+		if (useQuantizedBvh)
+		{
+			newBvh->Quantize();
+		}
+
+		PublishBvh(newBvh);
 	}
 }
 
@@ -364,6 +575,39 @@ iShape* PhysicsObject::GetTransformedPhysicsShape()
 
 		return transformedPhysicsShape;
 	}
+	else if (shape == PLANE)
+	{
+		Plane* plane = dynamic_cast<Plane*>(physicsShape);
+		Plane* temp = dynamic_cast<Plane*>(transformedPhysicsShape);
+
+		glm::vec3 point = transform.GetTransformMatrix() * glm::vec4(plane->normal * plane->dotofPoint, 1.0f);
+		point += properties.offset;
+
+		//Normals go through the inverse transpose so non uniform scale keeps them perpendicular
+		temp->normal = glm::normalize(glm::transpose(glm::mat3(GetInverseTransformMatrix())) * plane->normal);
+		temp->dotofPoint = glm::dot(temp->normal, point);
+
+		return transformedPhysicsShape;
+	}
+	else if (shape == CAPSULE)
+	{
+		Capsule* capsule = dynamic_cast<Capsule*>(physicsShape);
+		Capsule* temp = dynamic_cast<Capsule*>(transformedPhysicsShape);
+
+		glm::mat4 transformMatrix = transform.GetTransformMatrix();
+
+		temp->start = glm::vec3(transformMatrix * glm::vec4(capsule->start, 1.0f)) + properties.offset;
+		temp->end = glm::vec3(transformMatrix * glm::vec4(capsule->end, 1.0f)) + properties.offset;
+
+		temp->radius = capsule->radius *
+			glm::max(
+				glm::max(transform.scale.x, transform.scale.y),
+				transform.scale.z);
+
+		temp->radius *= properties.colliderScale;
+
+		return transformedPhysicsShape;
+	}
 	else if (shape == TRIANGLE)
 	{
 	}
@@ -371,15 +615,18 @@ iShape* PhysicsObject::GetTransformedPhysicsShape()
 	return transformedPhysicsShape;
 }
 
-void PhysicsObject::CalculateTriangleSpheres()
+void PhysicsObject::CalculateTriangles()
 {
-	for (Sphere* sphere : triangleSpheres)
+	std::shared_ptr<std::vector<Triangle>> newTriangles = std::make_shared<std::vector<Triangle>>();
+
+	size_t numOfTriangles = 0;
+
+	for (MeshAndMaterial* mesh : meshes)
 	{
-		delete sphere;
+		numOfTriangles += mesh->mesh->triangles.size();
 	}
 
-	triangles.clear();
-	triangleSpheres.clear();
+	newTriangles->reserve(numOfTriangles);
 
 	for (MeshAndMaterial* mesh : meshes)
 	{
@@ -392,14 +639,123 @@ void PhysicsObject::CalculateTriangleSpheres()
 			temp.v3 = triangle.v3;
 			temp.normal = triangle.normal;
 
-			glm::vec3 sphereCenter = (temp.v1 + temp.v2 + temp.v3) / 3.0f;
-			float radius = glm::max(glm::distance(sphereCenter, temp.v1),
-				glm::max(glm::distance(sphereCenter, temp.v2), glm::distance(sphereCenter, temp.v3)));
+			newTriangles->push_back(std::move(temp));
+		}
+	}
+
+	PublishTriangles(newTriangles);
+}
+
+void PhysicsObject::UpdateDeformableShape()
+{
+	if (shape != MESH_OF_TRIANGLES || hierarchialAABB == nullptr) return;
+
+	//Same triangle order as CalculateTriangles, mesh triangles are built from the indices
+	size_t triangleIndex = 0;
+
+	//The new pose goes into a copy, the published triangles and bvh are never written again.
+	//The spare from the step before is written over unless a snapshot still holds it
+	std::shared_ptr<std::vector<Triangle>> newTriangles;
+
+	if (spareTriangles != nullptr && spareTriangles.use_count() == 1)
+	{
+		newTriangles = spareTriangles;
+		newTriangles->assign(triangles->begin(), triangles->end());
+	}
+	else
+	{
+		newTriangles = std::make_shared<std::vector<Triangle>>(*triangles);
+	}
+
+	//Soft bodies write these vertices and indices from their own thread, only the reads of the
+	//mesh are locked, the bvh refit works on the copied triangles
+	CRITICAL_SECTION* meshCriticalSection = PhysicsEngine::GetInstance().GetSoftBodyCriticalSection();
+
+	if (meshCriticalSection != nullptr) EnterCriticalSection(meshCriticalSection);
+
+	for (MeshAndMaterial* mesh : meshes)
+	{
+		const std::vector<Vertex>& vertices = mesh->mesh->vertices;
+		const std::vector<unsigned int>& indices = mesh->mesh->indices;
 
-			triangles.push_back(std::move(temp));
-			triangleSpheres.push_back(new Sphere(sphereCenter, radius));
+		for (size_t i = 0; i + 2 < indices.size() && triangleIndex < newTriangles->size(); i += 3, triangleIndex++)
+		{
+			const Vertex& vertA = vertices[indices[i]];
+			const Vertex& vertB = vertices[indices[i + 1]];
+			const Vertex& vertC = vertices[indices[i + 2]];
+
+			Triangle& triangle = (*newTriangles)[triangleIndex];
+
+			triangle.v1 = vertA.positions;
+			triangle.v2 = vertB.positions;
+			triangle.v3 = vertC.positions;
+			triangle.normal = (vertA.normals + vertB.normals + vertC.normals) / 3.0f;
 		}
 	}
+
+	aabb = CalculateModelAABB();
+
+	if (meshCriticalSection != nullptr) LeaveCriticalSection(meshCriticalSection);
+	cachedMatrix = glm::mat4(0.0f);		//Local bounds changed, GetModelAABB has to recompute
+
+	//Published lists are created writable here, the old one is reused once nothing else holds it
+	std::shared_ptr<std::vector<Triangle>> oldTriangles = std::const_pointer_cast<std::vector<Triangle>>(triangles);
+
+	//The bvh copy refits against the published triangles
+	PublishTriangles(newTriangles);
+	spareTriangles = oldTriangles;
+
+	std::shared_ptr<HierarchicalAABB> newBvh;
+
+	if (spareHierarchialAABB != nullptr && spareHierarchialAABB.use_count() == 1)
+	{
+		newBvh = spareHierarchialAABB;
+		newBvh->CopyFrom(*sharedHierarchialAABB);
+	}
+	else
+	{
+		newBvh = sharedHierarchialAABB->Clone();
+	}
+
+	newBvh->RefitOrRebuild();
+
+	std::shared_ptr<HierarchicalAABB> oldBvh = sharedHierarchialAABB;
+	PublishBvh(newBvh);
+	spareHierarchialAABB = oldBvh;
+}
+
+void PhysicsObject::UpdateWorldSpaceShape()
+{
+	if (shape != MESH_OF_TRIANGLES || hierarchialAABB == nullptr) return;
+
+	//A world copy is full precision, quantized trees trade the matrix work for memory
+	if (mode == PhysicsMode::STATIC && !isDeformable && !hierarchialAABB->IsQuantized())
+	{
+		glm::mat4 transformMatrix = transform.GetTransformMatrix();
+
+		if (hierarchialAABB->IsWorldSpaceCurrent(transformMatrix)) return;
+
+		std::shared_ptr<HierarchicalAABB> newBvh = sharedHierarchialAABB->Clone();
+		newBvh->UpdateWorldSpace(transformMatrix);
+		PublishBvh(newBvh);
+	}
+	else if (hierarchialAABB->HasWorldSpace())
+	{
+		std::shared_ptr<HierarchicalAABB> newBvh = sharedHierarchialAABB->Clone();
+		newBvh->ClearWorldSpace();
+		PublishBvh(newBvh);
+	}
+}
+
+//For tests run with the two shapes swapped, turns the new normals back to push this object
+static bool FlipNewNormals(bool collided, std::vector<glm::vec3>& collisionNormals, size_t firstNew)
+{
+	for (size_t i = firstNew; i < collisionNormals.size(); i++)
+	{
+		collisionNormals[i] = -collisionNormals[i];
+	}
+
+	return collided;
 }
 
 bool PhysicsObject::CheckCollision(PhysicsObject* other,
@@ -422,22 +778,24 @@ bool PhysicsObject::CheckCollision(PhysicsObject* other,
 		case TRIANGLE:
 			break;
 		case PLANE:
-			break;
+			return CollisionSphereVsPlane(*dynamic_cast<Sphere*>(GetTransformedPhysicsShape()),
+				*dynamic_cast<Plane*>(other->GetTransformedPhysicsShape()), collisionPoints, collisionNormals);
 		case CAPSULE:
-			break;
+			return CollisionSphereVsCapsule(*dynamic_cast<Sphere*>(GetTransformedPhysicsShape()),
+				*dynamic_cast<Capsule*>(other->GetTransformedPhysicsShape()), collisionPoints, collisionNormals);
 		case MESH_OF_TRIANGLES:
 			if (other->useBvh)
 			{
 				return CollisionSphereVsMeshOfTriangles(GetModelAABB(),
 					dynamic_cast<Sphere*>(GetTransformedPhysicsShape()),
-					other->hierarchialAABB->rootNode, other->transform.GetTransformMatrix(),
+					other->hierarchialAABB, other->transform.GetTransformMatrix(), other->GetInverseTransformMatrix(),
 					other->GetTriangleList(), collisionPoints, collisionNormals, collisionAabbs
 				);
 			}
 
 			return CollisionSphereVsMeshOfTriangles(dynamic_cast<Sphere*>(GetTransformedPhysicsShape()),
 				other->transform.GetTransformMatrix(),
-				other->GetTriangleList(), other->GetSphereList(),
+				other->GetTriangleList(), *other->GetSharedSphereList(),
 				collisionPoints, collisionNormals);
 		}
 		break;
@@ -455,19 +813,25 @@ bool PhysicsObject::CheckCollision(PhysicsObject* other,
 		case TRIANGLE:
 			break;
 		case PLANE:
-			break;
+			return CollisionAABBVsPlane(GetModelAABB(), *dynamic_cast<Plane*>(other->GetTransformedPhysicsShape()),
+				collisionPoints, collisionNormals);
 		case CAPSULE:
-			break;
+		{
+			size_t firstNew = collisionNormals.size();
+
+			return FlipNewNormals(CollisionCapsuleVsAABB(*dynamic_cast<Capsule*>(other->GetTransformedPhysicsShape()),
+				GetModelAABB(), collisionPoints, collisionNormals), collisionNormals, firstNew);
+		}
 		case MESH_OF_TRIANGLES:
 			if (other->useBvh)
 			{
 				return CollisionAABBVsMeshOfTriangles(GetModelAABB(),
-					other->hierarchialAABB->rootNode, other->transform.GetTransformMatrix(),
+					other->hierarchialAABB, other->transform.GetTransformMatrix(), other->GetInverseTransformMatrix(),
 					other->GetTriangleList(), collisionPoints, collisionNormals, collisionAabbs);
 			}
 			return CollisionAABBVsMeshOfTriangles(GetModelAABB(),
 				other->transform.GetTransformMatrix(),
-				other->GetTriangleList(), other->GetSphereList(),
+				other->GetTriangleList(), *other->GetSharedSphereList(),
 				collisionPoints, collisionNormals);
 		}
 		break;
@@ -481,12 +845,12 @@ bool PhysicsObject::CheckCollision(PhysicsObject* other,
 			if (other->useBvh)
 			{
 				return CollisionAABBVsMeshOfTriangles(other->GetModelAABB(),
-					hierarchialAABB->rootNode, transform.GetTransformMatrix(),
+					hierarchialAABB, transform.GetTransformMatrix(), GetInverseTransformMatrix(),
 					GetTriangleList(), collisionPoints, collisionNormals, collisionAabbs);
 			}
 			return CollisionAABBVsMeshOfTriangles(other->GetModelAABB(),
 				transform.GetTransformMatrix(),
-				GetTriangleList(), GetSphereList(),
+				GetTriangleList(), *GetSharedSphereList(),
 				collisionPoints, collisionNormals);
 
 		case SPHERE:
@@ -494,25 +858,28 @@ bool PhysicsObject::CheckCollision(PhysicsObject* other,
 			{
 				return CollisionSphereVsMeshOfTriangles(other->GetModelAABB(),
 					dynamic_cast<Sphere*>(other->GetTransformedPhysicsShape()),
-					hierarchialAABB->rootNode, transform.GetTransformMatrix(),
+					hierarchialAABB, transform.GetTransformMatrix(), GetInverseTransformMatrix(),
 					GetTriangleList(), collisionPoints, collisionNormals, collisionAabbs
 				);
 			}
 
 			return CollisionSphereVsMeshOfTriangles(dynamic_cast<Sphere*>(other->GetTransformedPhysicsShape()),
 				transform.GetTransformMatrix(),
-				GetTriangleList(), GetSphereList(),
+				GetTriangleList(), *GetSharedSphereList(),
 				collisionPoints, collisionNormals);
 		case TRIANGLE:
 			break;
 		case PLANE:
-			break;
+			return CollisionPlaneVsMeshOfTriangles(*dynamic_cast<Plane*>(other->GetTransformedPhysicsShape()),
+				hierarchialAABB, transform.GetTransformMatrix(), GetTriangleList(), collisionPoints, collisionNormals);
 		case CAPSULE:
-			break;
+			return CollisionCapsuleVsMeshOfTriangles(*dynamic_cast<Capsule*>(other->GetTransformedPhysicsShape()),
+				hierarchialAABB, transform.GetTransformMatrix(), GetInverseTransformMatrix(),
+				GetTriangleList(), collisionPoints, collisionNormals, collisionAabbs);
 		case MESH_OF_TRIANGLES:
 
-			return CollisionMeshVsMesh(hierarchialAABB->rootNode, other->hierarchialAABB->rootNode,
-				transform.GetTransformMatrix(), other->transform.GetTransformMatrix(),
+			return CollisionMeshVsMesh(hierarchialAABB, other->hierarchialAABB,
+				transform.GetTransformMatrix(), other->transform.GetTransformMatrix(), GetInverseTransformMatrix(),
 				GetTriangleList(), other->GetTriangleList(), collisionPoints, collisionNormals);
 			break;
 
@@ -520,6 +887,64 @@ bool PhysicsObject::CheckCollision(PhysicsObject* other,
 		break;
 #pragma endregion
 
+#pragma region PlaneVs
+	case PLANE:
+	{
+		Plane* plane = dynamic_cast<Plane*>(GetTransformedPhysicsShape());
+		size_t firstNew = collisionNormals.size();
+
+		switch (other->shape)
+		{
+		case SPHERE:
+			return FlipNewNormals(CollisionSphereVsPlane(*dynamic_cast<Sphere*>(other->GetTransformedPhysicsShape()),
+				*plane, collisionPoints, collisionNormals), collisionNormals, firstNew);
+		case AABB:
+			return FlipNewNormals(CollisionAABBVsPlane(other->GetModelAABB(), *plane,
+				collisionPoints, collisionNormals), collisionNormals, firstNew);
+		case CAPSULE:
+			return FlipNewNormals(CollisionCapsuleVsPlane(*dynamic_cast<Capsule*>(other->GetTransformedPhysicsShape()),
+				*plane, collisionPoints, collisionNormals), collisionNormals, firstNew);
+		case MESH_OF_TRIANGLES:
+			return FlipNewNormals(CollisionPlaneVsMeshOfTriangles(*plane, other->hierarchialAABB,
+				other->transform.GetTransformMatrix(), other->GetTriangleList(), collisionPoints, collisionNormals),
+				collisionNormals, firstNew);
+		default:
+			break;
+		}
+	}
+		break;
+#pragma endregion
+
+#pragma region CapsuleVs
+	case CAPSULE:
+	{
+		Capsule* capsule = dynamic_cast<Capsule*>(GetTransformedPhysicsShape());
+		size_t firstNew = collisionNormals.size();
+
+		switch (other->shape)
+		{
+		case SPHERE:
+			return FlipNewNormals(CollisionSphereVsCapsule(*dynamic_cast<Sphere*>(other->GetTransformedPhysicsShape()),
+				*capsule, collisionPoints, collisionNormals), collisionNormals, firstNew);
+		case AABB:
+			return CollisionCapsuleVsAABB(*capsule, other->GetModelAABB(), collisionPoints, collisionNormals);
+		case PLANE:
+			return CollisionCapsuleVsPlane(*capsule, *dynamic_cast<Plane*>(other->GetTransformedPhysicsShape()),
+				collisionPoints, collisionNormals);
+		case CAPSULE:
+			return CollisionCapsuleVsCapsule(*capsule, *dynamic_cast<Capsule*>(other->GetTransformedPhysicsShape()),
+				collisionPoints, collisionNormals);
+		case MESH_OF_TRIANGLES:
+			return CollisionCapsuleVsMeshOfTriangles(*capsule, other->hierarchialAABB,
+				other->transform.GetTransformMatrix(), other->GetInverseTransformMatrix(),
+				other->GetTriangleList(), collisionPoints, collisionNormals, collisionAabbs);
+		default:
+			break;
+		}
+	}
+		break;
+#pragma endregion
+
 	}
 
 	return false;
@@ -18,9 +18,25 @@ private:
 	Aabb cachedAABB;
 	Aabb aabb;
 	glm::mat4 cachedMatrix;
+	glm::mat4 cachedInverseSource = glm::mat4(0.0f);
+	glm::mat4 cachedInverseMatrix = glm::mat4(1.0f);
 
-	std::vector <Triangle> triangles;
-	std::vector <Sphere*>  triangleSpheres;
+	//Published copy on write, a snapshot or the soft body thread may still hold the old ones
+	std::shared_ptr<const std::vector<Triangle>> triangles = std::make_shared<std::vector<Triangle>>();
+	std::shared_ptr<HierarchicalAABB> sharedHierarchialAABB;
+
+	//Deformable meshes alternate between the published buffers and these, reused once no snapshot holds them
+	std::shared_ptr<std::vector<Triangle>> spareTriangles;
+	std::shared_ptr<HierarchicalAABB> spareHierarchialAABB;
+
+	//Bounding sphere per triangle for meshes tested without a bvh, built on first use
+	struct TriangleSpheres
+	{
+		std::shared_ptr<const std::vector<Triangle>> triangles;		//The list the spheres were built from
+		std::vector<Sphere> spheres;
+	};
+
+	std::shared_ptr<const TriangleSpheres> triangleSpheres;
 	std::vector <glm::vec3> collisionPoints;
 	std::vector <glm::vec3> collisionNormals;
 	std::vector<Aabb> collisionAabbs;
@@ -35,11 +51,21 @@ private:
 	const char* modeStrings[2] = { "Static", "Dynamic" };
 	const char* shapeStrings[6] = { "Sphere", "Plane",  "Triangle", "AABB", "Capsule", "Mesh"};
 	const char* collModeStrings[6] = { "Solid", "Trigger"};
+	const char* bvhBuildModeStrings[2] = { "Midpoint", "SAH" };
+
+	int bvhBuildModeInt = (int)SAH_SPLIT;
+
+	BvhStats bvhBuildModeStats[2];		//Indexed by BvhBuildMode, filled by CompareBvhBuildModes
+	bool hasBvhBuildModeStats = false;
 
 	glm::vec4 shapeColor = glm::vec4(0, 1, 0, 1);
 
 	void DrawPhysicsShape();
 	void DrawPhysicsProperties();
+	void DrawBvhStats();
+
+	void PublishTriangles(const std::shared_ptr<const std::vector<Triangle>>& newTriangles);
+	void PublishBvh(const std::shared_ptr<HierarchicalAABB>& newBvh);
 
 public:
 
@@ -47,7 +73,12 @@ public:
 	bool isPhysicsEnabled = true;
 	bool isCollisionInvoke = false;
 	bool useBvh = true;
+	bool isDeformable = false;		//Mesh vertices change at runtime, triangles and BVH are refit every physics step
+	bool useBvhCache = true;		//Map the BVH from HierarchicalAABB::cacheDirectory instead of building it on load
+	bool useQuantizedBvh = false;	//16 byte BVH nodes for large meshes, costs a decode per node visited
 	float maxDepth = 10;
+	BvhBuildMode bvhBuildMode = SAH_SPLIT;
+	int layer = 0;					//0 to 31, matched against the layer masks of PhysicsEngine queries
 
 	PhysicsMode mode = PhysicsMode::STATIC;
 	PhysicsShape shape = PhysicsShape::SPHERE;
@@ -64,7 +95,7 @@ public:
 
 	iShape* physicsShape;
 	iShape* transformedPhysicsShape;
-	HierarchicalAABB* hierarchialAABB;
+	HierarchicalAABB* hierarchialAABB = nullptr;		//The published bvh, for the main thread only
 	void* userData;
 
 	PhysicsObject();
@@ -80,20 +111,33 @@ public:
 	Aabb GetModelAABB();
 	Aabb GetAABB();
 
+	//Inverse of transform.GetTransformMatrix(), recomputed only when the transform changes
+	const glm::mat4& GetInverseTransformMatrix();
+
 	void AddExludingPhyObj(PhysicsObject* phyObj);
 	bool CheckIfExcluding(PhysicsObject* phyObj);
 
 	void CalculatePhysicsShape();
 	iShape* GetTransformedPhysicsShape();
 
-	void CalculateTriangleSpheres();
+	void CalculateTriangles();
+	void UpdateDeformableShape();
+
+	//Builds the mesh with both split modes, uncached, and logs the query cost and leaf stats of each
+	void CompareBvhBuildModes();
+
+	//Static meshes keep their triangles and BVH bounds in world space, moving ones drop that copy
+	void UpdateWorldSpaceShape();
 
 	bool CheckCollision(PhysicsObject* other,
 		std::vector<glm::vec3>& collisionPoints,
 		std::vector<glm::vec3>& collisionNormals);
 
 	const std::vector < Triangle >& GetTriangleList();
-	const std::vector < Sphere* >& GetSphereList();
+	//References that stay valid and unchanged while the physics step publishes new ones
+	std::shared_ptr<const std::vector<Triangle>> GetSharedTriangleList();
+	std::shared_ptr<const std::vector<Sphere>> GetSharedSphereList();
+	std::shared_ptr<const HierarchicalAABB> GetSharedBvh();
 	const std::vector <glm::vec3>& GetCollisionPoints();
 	const std::vector <glm::vec3>& GetCollisionNormals();
 	const std::vector<Aabb>& GetCollisionAabbs();
@@ -1,30 +1,70 @@
 #include "PhysicsShapeAndCollision.h"
-#include "HierarchicalAABBNode.h"
+#include "HierarchicalAABB.h"
 
-void CollisionAABBvsHAABB(const Aabb& sphereAabb, HierarchicalAABBNode* rootNode, 
-	std::set<int>& triangleIndices, std::vector<Aabb>& collisionAabbs)
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
+#include <xmmintrin.h>
+
+//World space triangle, read from the static copy when the bvh keeps one
+static const Triangle& GetWorldTriangle(const HierarchicalAABB* bvh, const std::vector<Triangle>& triangles,
+	int index, const glm::mat4& transformMatrix, Triangle& transformed)
+{
+	if (bvh->HasWorldSpace()) return bvh->GetWorldTriangles()[index];
+
+	const Triangle& triangle = triangles[index];
+
+	transformed.v1 = transformMatrix * glm::vec4(triangle.v1, 1.0f);
+	transformed.v2 = transformMatrix * glm::vec4(triangle.v2, 1.0f);
+	transformed.v3 = transformMatrix * glm::vec4(triangle.v3, 1.0f);
+	transformed.normal = transformMatrix * glm::vec4(triangle.normal, 0.0f);
+
+	return transformed;
+}
+
+void CollisionAABBvsHAABB(const Aabb& sphereAabb, const HierarchicalAABB* bvh, const glm::mat4& transformMatrix,
+	const glm::mat4& inverseMatrix, std::set<int>& triangleIndices, std::vector<Aabb>& collisionAabbs)
 {
-	if (CollisionAABBvsAABB(sphereAabb, rootNode->GetModelAABB()))
+	if (bvh->GetNumOfNodes() == 0) return;
+
+	//Query in mesh space against the stored bounds, no matrix work per node.
+	//Static meshes keep world bounds and need no transform at all
+	bool worldSpace = bvh->HasWorldSpace();
+
+	Aabb localAabb = worldSpace ? sphereAabb : TransformAabb(sphereAabb.min, sphereAabb.max, inverseMatrix);
+
+	const unsigned int* leafTriangles = bvh->GetTriangleIndices();
+
+	unsigned int stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+
+	unsigned int nodeIndex = 0;
+
+	while (true)
 	{
-		collisionAabbs.push_back(rootNode->GetModelAABB());
+		BvhNode node = bvh->GetQueryNode(nodeIndex);
 
-		if (rootNode->triangleIndices.empty())
+		if (CollisionAABBvsAABB(localAabb, Aabb(node.min, node.max)))
 		{
-			if (rootNode->leftNode != nullptr)
+			if (!node.IsLeaf())
 			{
-				CollisionAABBvsHAABB(sphereAabb, rootNode->leftNode, triangleIndices, collisionAabbs);
-				CollisionAABBvsHAABB(sphereAabb, rootNode->rightNode, triangleIndices, collisionAabbs);
+				stack[stackSize++] = node.offset;
+				nodeIndex++;
+				continue;
 			}
+
+			collisionAabbs.push_back(worldSpace ? Aabb(node.min, node.max) : TransformAabb(node.min, node.max, transformMatrix));
+			triangleIndices.insert(leafTriangles + node.offset, leafTriangles + node.offset + node.count);
 		}
-		else
-		{
-			triangleIndices.insert(rootNode->triangleIndices.begin(), rootNode->triangleIndices.end());
-		}
+
+		if (stackSize == 0) break;
+
+		nodeIndex = stack[--stackSize];
 	}
 }
 
-bool CollisionSphereVsMeshOfTriangles(const Aabb& sphereAabb, Sphere* sphere, HierarchicalAABBNode* rootNode, 
-	const glm::mat4 transformMatrix, const std::vector<Triangle>& triangles,
+bool CollisionSphereVsMeshOfTriangles(const Aabb& sphereAabb, Sphere* sphere, const HierarchicalAABB* bvh,
+	const glm::mat4 transformMatrix, const glm::mat4& inverseMatrix, const std::vector<Triangle>& triangles,
 	std::vector<glm::vec3>& collisionPoints,
 	std::vector<glm::vec3>& collisionNormals,
 	std::vector<Aabb>& collisionAabbs)
@@ -34,7 +74,7 @@ bool CollisionSphereVsMeshOfTriangles(const Aabb& sphereAabb, Sphere* sphere, Hi
 	collisionAabbs.clear();
 	std::set<int> triangleIndices;
 
-	CollisionAABBvsHAABB(sphereAabb, rootNode, triangleIndices, collisionAabbs);
+	CollisionAABBvsHAABB(sphereAabb, bvh, transformMatrix, inverseMatrix, triangleIndices, collisionAabbs);
 
 	if (triangleIndices.empty()) return false;
 
@@ -42,12 +82,8 @@ bool CollisionSphereVsMeshOfTriangles(const Aabb& sphereAabb, Sphere* sphere, Hi
 	{
 		glm::vec3 collisionPt;
 
-		Triangle triangle;
-
-		triangle.v1 = transformMatrix * glm::vec4(triangles[i].v1, 1.0f);
-		triangle.v2 = transformMatrix * glm::vec4(triangles[i].v2, 1.0f);
-		triangle.v3 = transformMatrix * glm::vec4(triangles[i].v3, 1.0f);
-		triangle.normal = transformMatrix * glm::vec4(triangles[i].normal, 0.0f);
+		Triangle transformed;
+		const Triangle& triangle = GetWorldTriangle(bvh, triangles, i, transformMatrix, transformed);
 
 		if (CollisionSphereVsTriangle(sphere, triangle, collisionPt))
 		{
@@ -60,8 +96,8 @@ bool CollisionSphereVsMeshOfTriangles(const Aabb& sphereAabb, Sphere* sphere, Hi
 
 }
 
-bool CollisionAABBVsMeshOfTriangles(const Aabb& aabb, HierarchicalAABBNode* rootNode, 
-	const glm::mat4 transformMatrix,
+bool CollisionAABBVsMeshOfTriangles(const Aabb& aabb, const HierarchicalAABB* bvh,
+	const glm::mat4 transformMatrix, const glm::mat4& inverseMatrix,
 	const std::vector<Triangle>& triangles, 
 	std::vector<glm::vec3>& collisionPoints, 
 	std::vector<glm::vec3>& collisionNormals,
@@ -70,7 +106,7 @@ bool CollisionAABBVsMeshOfTriangles(const Aabb& aabb, HierarchicalAABBNode* root
 
 	std::set<int> triangleIndices;
 
-	CollisionAABBvsHAABB(aabb, rootNode, triangleIndices, collisionAabbs);
+	CollisionAABBvsHAABB(aabb, bvh, transformMatrix, inverseMatrix, triangleIndices, collisionAabbs);
 
 	if (triangleIndices.empty()) return false;
 
@@ -78,12 +114,8 @@ bool CollisionAABBVsMeshOfTriangles(const Aabb& aabb, HierarchicalAABBNode* root
 	{
 		glm::vec3 collisionPt;
 
-		Triangle triangle;
-
-		triangle.v1 = transformMatrix * glm::vec4(triangles[i].v1, 1.0f);
-		triangle.v2 = transformMatrix * glm::vec4(triangles[i].v2, 1.0f);
-		triangle.v3 = transformMatrix * glm::vec4(triangles[i].v3, 1.0f);
-		triangle.normal = transformMatrix * glm::vec4(triangles[i].normal, 0.0f);
+		Triangle transformed;
+		const Triangle& triangle = GetWorldTriangle(bvh, triangles, i, transformMatrix, transformed);
 
 		if (CollisionAABBVsTriangle(aabb, triangle, collisionPt))
 		{
@@ -96,90 +128,2023 @@ bool CollisionAABBVsMeshOfTriangles(const Aabb& aabb, HierarchicalAABBNode* root
 	return true;
 }
 
-void CollisionMeshVsMeshRecursive(HierarchicalAABBNode* mesh1, HierarchicalAABBNode* mesh2,
-	std::set<int>& triangleIndices1, std::set<int>& triangleIndices2)
+static void CollisionSpheresVsHAABB(const std::vector<Aabb>& sphereAabbs, const HierarchicalAABB* bvh,
+	std::vector<int>& candidates, std::vector<std::pair<int, int>>& sphereTrianglePairs)
 {
-	if (CollisionAABBvsAABB(mesh1->GetModelAABB(), mesh2->GetModelAABB()))
+	// Every stack entry carries the range of candidates that reached its parent. The spheres
+	// overlapping a node are appended for its children, the buffer only grows along one path
+	// because entries deeper on the stack always have earlier ranges.
+
+	struct StackEntry
+	{
+		unsigned int nodeIndex;
+		unsigned int begin;
+		unsigned int end;
+	};
+
+	if (bvh->GetNumOfNodes() == 0) return;
+
+	const unsigned int* leafTriangles = bvh->GetTriangleIndices();
+
+	StackEntry stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+
+	stack[stackSize++] = { 0, 0, (unsigned int)candidates.size() };
+
+	while (stackSize > 0)
 	{
-		if (mesh1->leftNode != nullptr)
+		StackEntry entry = stack[--stackSize];
+
+		candidates.resize(entry.end);
+
+		BvhNode node = bvh->GetQueryNode(entry.nodeIndex);
+		Aabb nodeAabb = Aabb(node.min, node.max);
+
+		unsigned int childBegin = (unsigned int)candidates.size();
+
+		for (unsigned int i = entry.begin; i < entry.end; i++)
 		{
-			if (mesh2->leftNode != nullptr)
-			{
-				CollisionMeshVsMeshRecursive(mesh1->leftNode, mesh2->leftNode, triangleIndices1, triangleIndices2);
-				CollisionMeshVsMeshRecursive(mesh1->leftNode, mesh2->rightNode, triangleIndices1, triangleIndices2);
+			int sphereIndex = candidates[i];
 
-				CollisionMeshVsMeshRecursive(mesh1->rightNode, mesh2->leftNode, triangleIndices1, triangleIndices2);
-				CollisionMeshVsMeshRecursive(mesh1->rightNode, mesh2->rightNode, triangleIndices1, triangleIndices2);
+			if (CollisionAABBvsAABB(sphereAabbs[sphereIndex], nodeAabb))
+			{
+				candidates.push_back(sphereIndex);
 			}
-			else
+		}
+
+		unsigned int childEnd = (unsigned int)candidates.size();
+
+		if (childBegin == childEnd) continue;
+
+		if (node.IsLeaf())
+		{
+			for (unsigned int i = childBegin; i < childEnd; i++)
 			{
-				CollisionMeshVsMeshRecursive(mesh1->leftNode, mesh2, triangleIndices1, triangleIndices2);
-				CollisionMeshVsMeshRecursive(mesh1->rightNode, mesh2, triangleIndices1, triangleIndices2);
+				for (unsigned int j = node.offset; j < node.offset + node.count; j++)
+				{
+					sphereTrianglePairs.push_back({ candidates[i], (int)leafTriangles[j] });
+				}
 			}
 		}
 		else
 		{
-			if (mesh2->leftNode != nullptr)
+			stack[stackSize++] = { node.offset, childBegin, childEnd };
+			stack[stackSize++] = { entry.nodeIndex + 1, childBegin, childEnd };
+		}
+	}
+}
+
+bool CollisionSpheresVsMeshOfTriangles(const std::vector<Sphere>& spheres, const HierarchicalAABB* bvh,
+	const glm::mat4 transformMatrix, const glm::mat4& inverseMatrix, const std::vector<Triangle>& triangles,
+	std::vector<int>& collisionSphereIndices,
+	std::vector<glm::vec3>& collisionPoints,
+	std::vector<glm::vec3>& collisionNormals)
+{
+	if (spheres.empty()) return false;
+
+	std::vector<Aabb> sphereAabbs;
+	sphereAabbs.reserve(spheres.size());
+
+	std::vector<int> candidates;
+	candidates.reserve(spheres.size() * 2);
+
+	bool worldSpace = bvh->HasWorldSpace();
+
+	for (int i = 0; i < (int)spheres.size(); i++)
+	{
+		glm::vec3 extents = glm::vec3(spheres[i].radius);
+
+		if (worldSpace)
+		{
+			sphereAabbs.push_back(Aabb(spheres[i].position - extents, spheres[i].position + extents));
+		}
+		else
+		{
+			sphereAabbs.push_back(TransformAabb(spheres[i].position - extents, spheres[i].position + extents, inverseMatrix));
+		}
+
+		candidates.push_back(i);
+	}
+
+	std::vector<std::pair<int, int>> sphereTrianglePairs;
+
+	CollisionSpheresVsHAABB(sphereAabbs, bvh, candidates, sphereTrianglePairs);
+
+	if (sphereTrianglePairs.empty()) return false;
+
+	// Leaves can share triangles, and contacts are returned grouped by sphere
+	std::sort(sphereTrianglePairs.begin(), sphereTrianglePairs.end());
+	sphereTrianglePairs.erase(std::unique(sphereTrianglePairs.begin(), sphereTrianglePairs.end()), sphereTrianglePairs.end());
+
+	std::unordered_map<int, Triangle> transformedTriangles;
+
+	bool collided = false;
+
+	for (std::pair<int, int>& pair : sphereTrianglePairs)
+	{
+		const Triangle* triangle = nullptr;
+
+		if (worldSpace)
+		{
+			triangle = &bvh->GetWorldTriangles()[pair.second];
+		}
+		else
+		{
+			std::unordered_map<int, Triangle>::iterator it = transformedTriangles.find(pair.second);
+
+			if (it == transformedTriangles.end())
+			{
+				Triangle transformed;
+				GetWorldTriangle(bvh, triangles, pair.second, transformMatrix, transformed);
+
+				it = transformedTriangles.insert({ pair.second, transformed }).first;
+			}
+
+			triangle = &it->second;
+		}
+
+		Sphere sphere = spheres[pair.first];
+		glm::vec3 collisionPt;
+
+		if (CollisionSphereVsTriangle(&sphere, *triangle, collisionPt))
+		{
+			collisionSphereIndices.push_back(pair.first);
+			collisionPoints.push_back(collisionPt);
+			collisionNormals.push_back(triangle->normal);
+			collided = true;
+		}
+	}
+
+	return collided;
+}
+
+static void ProjectTriangle4(__m128 axisX, __m128 axisY, __m128 axisZ, const Triangle& triangle,
+	__m128& projMin, __m128& projMax)
+{
+	const glm::vec3* vertices[3] = { &triangle.v1, &triangle.v2, &triangle.v3 };
+
+	for (int i = 0; i < 3; i++)
+	{
+		__m128 projection = _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(axisX, _mm_set1_ps(vertices[i]->x)),
+			_mm_mul_ps(axisY, _mm_set1_ps(vertices[i]->y))),
+			_mm_mul_ps(axisZ, _mm_set1_ps(vertices[i]->z)));
+
+		if (i == 0)
+		{
+			projMin = projection;
+			projMax = projection;
+			continue;
+		}
+
+		projMin = _mm_min_ps(projMin, projection);
+		projMax = _mm_max_ps(projMax, projection);
+	}
+}
+
+static bool EdgeCrossesTriangle(const glm::vec3& start, const glm::vec3& end, const Triangle& triangle,
+	glm::vec3& crossPoint)
+{
+	glm::vec3 edge1 = triangle.v2 - triangle.v1;
+	glm::vec3 edge2 = triangle.v3 - triangle.v1;
+	glm::vec3 normal = glm::cross(edge1, edge2);
+
+	float startDist = glm::dot(normal, start - triangle.v1);
+	float endDist = glm::dot(normal, end - triangle.v1);
+
+	if (startDist * endDist > 0.0f || startDist == endDist) return false;
+
+	glm::vec3 point = start + (end - start) * (startDist / (startDist - endDist));
+
+	//Inside test with the edge normals of the triangle
+	if (glm::dot(glm::cross(edge1, point - triangle.v1), normal) < 0.0f) return false;
+	if (glm::dot(glm::cross(triangle.v3 - triangle.v2, point - triangle.v2), normal) < 0.0f) return false;
+	if (glm::dot(glm::cross(triangle.v1 - triangle.v3, point - triangle.v3), normal) < 0.0f) return false;
+
+	crossPoint = point;
+	return true;
+}
+
+bool CollisionTriangleVsTriangleSAT(const Triangle& t1, const Triangle& t2, glm::vec3& contactPoint)
+{
+	const int NUM_OF_AXES = 17;
+	const int NUM_OF_PADDED_AXES = 20;
+
+	glm::vec3 edges1[3] = { t1.v2 - t1.v1, t1.v3 - t1.v2, t1.v1 - t1.v3 };
+	glm::vec3 edges2[3] = { t2.v2 - t2.v1, t2.v3 - t2.v2, t2.v1 - t2.v3 };
+
+	glm::vec3 normal1 = glm::cross(edges1[0], edges1[1]);
+	glm::vec3 normal2 = glm::cross(edges2[0], edges2[1]);
+
+	//Edge normals inside each plane cover the coplanar case, where the edge cross products collapse
+	glm::vec3 axes[NUM_OF_PADDED_AXES];
+	int numOfAxes = 0;
+
+	axes[numOfAxes++] = normal1;
+	axes[numOfAxes++] = normal2;
+
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			axes[numOfAxes++] = glm::cross(edges1[i], edges2[j]);
+		}
+	}
+
+	for (int i = 0; i < 3; i++)
+	{
+		axes[numOfAxes++] = glm::cross(normal1, edges1[i]);
+		axes[numOfAxes++] = glm::cross(normal2, edges2[i]);
+	}
+
+	while (numOfAxes < NUM_OF_PADDED_AXES)
+	{
+		axes[numOfAxes++] = axes[NUM_OF_AXES - 1];
+	}
+
+	//Four axes per pass, a zero axis from parallel edges projects to 0 and never separates
+	for (int i = 0; i < NUM_OF_PADDED_AXES; i += 4)
+	{
+		__m128 axisX = _mm_set_ps(axes[i + 3].x, axes[i + 2].x, axes[i + 1].x, axes[i].x);
+		__m128 axisY = _mm_set_ps(axes[i + 3].y, axes[i + 2].y, axes[i + 1].y, axes[i].y);
+		__m128 axisZ = _mm_set_ps(axes[i + 3].z, axes[i + 2].z, axes[i + 1].z, axes[i].z);
+
+		__m128 min1, max1, min2, max2;
+		ProjectTriangle4(axisX, axisY, axisZ, t1, min1, max1);
+		ProjectTriangle4(axisX, axisY, axisZ, t2, min2, max2);
+
+		__m128 separated = _mm_or_ps(_mm_cmplt_ps(max1, min2), _mm_cmplt_ps(max2, min1));
+
+		if (_mm_movemask_ps(separated) != 0) return false;
+	}
+
+	const glm::vec3* vertices1[3] = { &t1.v1, &t1.v2, &t1.v3 };
+	const glm::vec3* vertices2[3] = { &t2.v1, &t2.v2, &t2.v3 };
+
+	glm::vec3 sumOfPoints = glm::vec3(0);
+	int numOfPoints = 0;
+	glm::vec3 crossPoint;
+
+	for (int i = 0; i < 3; i++)
+	{
+		if (EdgeCrossesTriangle(*vertices1[i], *vertices1[(i + 1) % 3], t2, crossPoint))
+		{
+			sumOfPoints += crossPoint;
+			numOfPoints++;
+		}
+
+		if (EdgeCrossesTriangle(*vertices2[i], *vertices2[(i + 1) % 3], t1, crossPoint))
+		{
+			sumOfPoints += crossPoint;
+			numOfPoints++;
+		}
+	}
+
+	if (numOfPoints == 0)
+	{
+		//Coplanar overlap, no edge leaves the other plane
+		glm::vec3 unused;
+
+		for (int i = 0; i < 3; i++)
+		{
+			if (PointInsideTriangle(*vertices1[i], t2, unused))
+			{
+				sumOfPoints += *vertices1[i];
+				numOfPoints++;
+			}
+
+			if (PointInsideTriangle(*vertices2[i], t1, unused))
+			{
+				sumOfPoints += *vertices2[i];
+				numOfPoints++;
+			}
+		}
+	}
+
+	if (numOfPoints == 0)
+	{
+		contactPoint = (t1.v1 + t1.v2 + t1.v3 + t2.v1 + t2.v2 + t2.v3) / 6.0f;
+		return true;
+	}
+
+	contactPoint = sumOfPoints / (float)numOfPoints;
+	return true;
+}
+
+static void CollisionMeshVsMeshTraverse(const HierarchicalAABB* mesh1, const HierarchicalAABB* mesh2,
+	const glm::mat4& mesh2ToMesh1, bool sameSpace, std::vector<std::pair<unsigned int, unsigned int>>& leafPairs)
+{
+	// Runs in the space of mesh1, only the bounds of mesh2 need transforming
+
+	std::vector<std::pair<unsigned int, unsigned int>> stack;
+	stack.reserve(BVH_STACK_SIZE);
+	stack.push_back({ 0, 0 });
+
+	while (!stack.empty())
+	{
+		std::pair<unsigned int, unsigned int> pair = stack.back();
+		stack.pop_back();
+
+		BvhNode node1 = mesh1->GetQueryNode(pair.first);
+		BvhNode node2 = mesh2->GetQueryNode(pair.second);
+
+		Aabb node2Aabb = sameSpace ? Aabb(node2.min, node2.max) : TransformAabb(node2.min, node2.max, mesh2ToMesh1);
+
+		if (!CollisionAABBvsAABB(Aabb(node1.min, node1.max), node2Aabb)) continue;
+
+		if (!node1.IsLeaf())
+		{
+			if (!node2.IsLeaf())
 			{
-				CollisionMeshVsMeshRecursive(mesh1, mesh2->leftNode, triangleIndices1, triangleIndices2);
-				CollisionMeshVsMeshRecursive(mesh1, mesh2->rightNode, triangleIndices1, triangleIndices2);
+				stack.push_back({ node1.offset, node2.offset });
+				stack.push_back({ node1.offset, pair.second + 1 });
+				stack.push_back({ pair.first + 1, node2.offset });
+				stack.push_back({ pair.first + 1, pair.second + 1 });
 			}
 			else
 			{
-				triangleIndices1.insert(mesh1->triangleIndices.begin(), mesh1->triangleIndices.end());
-				triangleIndices2.insert(mesh2->triangleIndices.begin(), mesh2->triangleIndices.end());
+				stack.push_back({ node1.offset, pair.second });
+				stack.push_back({ pair.first + 1, pair.second });
 			}
 		}
+		else if (!node2.IsLeaf())
+		{
+			stack.push_back({ pair.first, node2.offset });
+			stack.push_back({ pair.first, pair.second + 1 });
+		}
+		else
+		{
+			leafPairs.push_back(pair);
+		}
 	}
 }
 
 
-bool CollisionMeshVsMesh(HierarchicalAABBNode* mesh1, HierarchicalAABBNode* mesh2, 
-	const glm::mat4 transformMatrix1, const glm::mat4 transformMatrix2, 
+bool CollisionMeshVsMesh(const HierarchicalAABB* mesh1, const HierarchicalAABB* mesh2,
+	const glm::mat4 transformMatrix1, const glm::mat4 transformMatrix2, const glm::mat4& inverseMatrix1,
 	const std::vector<Triangle>& triangles1, const std::vector<Triangle>& triangles2, 
 	std::vector<glm::vec3>& collisionPoints, std::vector<glm::vec3>& collisionNormals)
 {
+	if (mesh1->GetNumOfNodes() == 0 || mesh2->GetNumOfNodes() == 0) return false;
+
+	// Tests run in the space of mesh1, which is world space when mesh1 keeps a static world copy.
+	// A static mesh2 is then already in that space as well.
+
+	bool worldSpace1 = mesh1->HasWorldSpace();
+	bool worldSpace2 = mesh2->HasWorldSpace();
+
+	const std::vector<Triangle>& spaceTriangles1 = worldSpace1 ? mesh1->GetWorldTriangles() : triangles1;
+	const std::vector<Triangle>& sourceTriangles2 = worldSpace2 ? mesh2->GetWorldTriangles() : triangles2;
+
+	glm::mat4 mesh2ToMesh1;
+
+	if (worldSpace2)
+	{
+		mesh2ToMesh1 = worldSpace1 ? glm::mat4(1.0f) : inverseMatrix1;
+	}
+	else
+	{
+		mesh2ToMesh1 = worldSpace1 ? transformMatrix2 : inverseMatrix1 * transformMatrix2;
+	}
 
-	std::set<int> triangleIndices1;
-	std::set<int> triangleIndices2;
+	bool sameSpace = worldSpace1 && worldSpace2;
 
-	CollisionMeshVsMeshRecursive(mesh1, mesh2, triangleIndices1, triangleIndices2);
+	std::vector<std::pair<unsigned int, unsigned int>> leafPairs;
 
-	if (triangleIndices1.empty() || triangleIndices2.empty()) return false;
+	CollisionMeshVsMeshTraverse(mesh1, mesh2, mesh2ToMesh1, sameSpace, leafPairs);
 
+	if (leafPairs.empty()) return false;
 
-	for (int i : triangleIndices1)
+	const unsigned int* leafTriangles1 = mesh1->GetTriangleIndices();
+	const unsigned int* leafTriangles2 = mesh2->GetTriangleIndices();
+
+	//Triangles of mesh2 are moved into mesh1 space once per leaf and reused by every pair with that leaf
+	std::unordered_map<unsigned int, unsigned int> transformedLeafs2;
+	std::vector<Triangle> transformedTriangles2;
+
+	bool collided = false;
+
+	for (const std::pair<unsigned int, unsigned int>& pair : leafPairs)
 	{
-		Triangle triangle1 = triangles1[i];
-		triangle1.v1 = transformMatrix1 * glm::vec4(triangle1.v1, 1.0f);
-		triangle1.v2 = transformMatrix1 * glm::vec4(triangle1.v2, 1.0f);
-		triangle1.v3 = transformMatrix1 * glm::vec4(triangle1.v3, 1.0f);
-		triangle1.normal = transformMatrix1 * glm::vec4(triangle1.normal, 0.0f);
+		BvhNode leaf1 = mesh1->GetQueryNode(pair.first);
+		BvhNode leaf2 = mesh2->GetQueryNode(pair.second);
+
+		unsigned int transformedOffset = 0;
 
-		for (int j : triangleIndices2)
+		if (!sameSpace)
 		{
+			std::unordered_map<unsigned int, unsigned int>::iterator it = transformedLeafs2.find(pair.second);
 
-			Triangle triangle2 = triangles2[j];
-			triangle2.v1 = transformMatrix2 * glm::vec4(triangle2.v1, 1.0f);
-			triangle2.v2 = transformMatrix2 * glm::vec4(triangle2.v2, 1.0f);
-			triangle2.v3 = transformMatrix2 * glm::vec4(triangle2.v3, 1.0f);
-			triangle2.normal = transformMatrix2 * glm::vec4(triangle2.normal, 0.0f);
+			if (it == transformedLeafs2.end())
+			{
+				it = transformedLeafs2.insert({ pair.second, (unsigned int)transformedTriangles2.size() }).first;
+
+				for (unsigned int i = 0; i < leaf2.count; i++)
+				{
+					Triangle triangle = sourceTriangles2[leafTriangles2[leaf2.offset + i]];
+					triangle.v1 = mesh2ToMesh1 * glm::vec4(triangle.v1, 1.0f);
+					triangle.v2 = mesh2ToMesh1 * glm::vec4(triangle.v2, 1.0f);
+					triangle.v3 = mesh2ToMesh1 * glm::vec4(triangle.v3, 1.0f);
+
+					transformedTriangles2.push_back(triangle);
+				}
+			}
+
+			transformedOffset = it->second;
+		}
+
+		for (unsigned int i = 0; i < leaf1.count; i++)
+		{
+			const Triangle& triangle1 = spaceTriangles1[leafTriangles1[leaf1.offset + i]];
 
-			glm::vec3 collPt;
-			if (CollisionTriangleVsTriangle(triangle1, triangle2))
+			for (unsigned int j = 0; j < leaf2.count; j++)
 			{
-				collisionPoints.push_back(collPt);
-				collisionNormals.push_back(triangle2.normal);
+				const Triangle& sourceTriangle2 = sourceTriangles2[leafTriangles2[leaf2.offset + j]];
+				const Triangle& triangle2 = sameSpace ? sourceTriangle2 : transformedTriangles2[transformedOffset + j];
+
+				glm::vec3 contactPoint;
+
+				if (!CollisionTriangleVsTriangleSAT(triangle1, triangle2, contactPoint)) continue;
+
+				glm::vec3 normal = worldSpace2 ? sourceTriangle2.normal :
+					glm::vec3(transformMatrix2 * glm::vec4(sourceTriangle2.normal, 0.0f));
+
+				collisionPoints.push_back(worldSpace1 ? contactPoint : glm::vec3(transformMatrix1 * glm::vec4(contactPoint, 1.0f)));
+				collisionNormals.push_back(glm::normalize(normal));
+				collided = true;
 			}
 		}
 	}
 
-	if (collisionPoints.empty()) return false;
+	return collided;
+}
+
+static bool RayCastBvhNode(const BvhNode& node, const glm::vec3& rayOrigin, const glm::vec3& invDirection,
+	float maxDistance, float& entryDistance)
+{
+	glm::vec3 t1 = (node.min - rayOrigin) * invDirection;
+	glm::vec3 t2 = (node.max - rayOrigin) * invDirection;
+
+	glm::vec3 tMin = glm::min(t1, t2);
+	glm::vec3 tMax = glm::max(t1, t2);
 
-	std::cout << "Size 1 : " << triangleIndices1.size() << std::endl;
-	std::cout << "Size 2 : " << triangleIndices2.size() << std::endl;
-	std::cout << "Collision Pt  : " << collisionPoints.size() << std::endl;
+	float tNear = glm::max(glm::max(tMin.x, tMin.y), glm::max(tMin.z, 0.0f));
+	float tFar = glm::min(glm::min(tMax.x, tMax.y), tMax.z);
 
+	if (tNear > tFar || tNear > maxDistance) return false;
 
+	entryDistance = tNear;
 	return true;
 }
+
+static bool RayCastTriangle(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, const Triangle& triangle,
+	float maxDistance, float& distance, float& u, float& v)
+{
+	const float EPSILON = 0.000001f;
+
+	glm::vec3 edge1 = triangle.v2 - triangle.v1;
+	glm::vec3 edge2 = triangle.v3 - triangle.v1;
+
+	glm::vec3 h = glm::cross(rayDirection, edge2);
+	float a = glm::dot(edge1, h);
+
+	if (a > -EPSILON && a < EPSILON) return false;
+
+	float f = 1.0f / a;
+	glm::vec3 s = rayOrigin - triangle.v1;
+
+	u = f * glm::dot(s, h);
+	if (u < 0.0f || u > 1.0f) return false;
+
+	glm::vec3 q = glm::cross(s, edge1);
+
+	v = f * glm::dot(rayDirection, q);
+	if (v < 0.0f || u + v > 1.0f) return false;
+
+	distance = f * glm::dot(edge2, q);
+
+	return distance > EPSILON && distance <= maxDistance;
+}
+
+bool RayCastMesh(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, const HierarchicalAABB* bvh,
+	const glm::mat4& transformMatrix, const glm::mat4& inverseMatrix, float maxDistance,
+	const std::vector<Triangle>& triangles, RayHit& hit)
+{
+	struct StackEntry
+	{
+		unsigned int nodeIndex;
+		float entryDistance;
+	};
+
+	if (bvh->GetNumOfNodes() == 0) return false;
+
+	glm::vec3 worldDirection = glm::normalize(rayDirection);
+
+	// The local direction is left unnormalized, so distances along it are world distances
+	bool worldSpace = bvh->HasWorldSpace();
+
+	glm::vec3 origin = worldSpace ? rayOrigin : glm::vec3(inverseMatrix * glm::vec4(rayOrigin, 1.0f));
+	glm::vec3 direction = worldSpace ? worldDirection : glm::vec3(inverseMatrix * glm::vec4(worldDirection, 0.0f));
+	glm::vec3 invDirection = 1.0f / direction;
+
+	const std::vector<Triangle>& spaceTriangles = worldSpace ? bvh->GetWorldTriangles() : triangles;
+	const unsigned int* leafTriangles = bvh->GetTriangleIndices();
+
+	float closestDistance = maxDistance;
+	int closestTriangle = -1;
+	float closestU = 0;
+	float closestV = 0;
+
+	StackEntry stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+
+	float entryDistance;
+
+	if (!RayCastBvhNode(bvh->GetQueryNode(0), origin, invDirection, closestDistance, entryDistance)) return false;
+
+	stack[stackSize++] = { 0, entryDistance };
+
+	while (stackSize > 0)
+	{
+		StackEntry entry = stack[--stackSize];
+
+		if (entry.entryDistance > closestDistance) continue;
+
+		BvhNode node = bvh->GetQueryNode(entry.nodeIndex);
+
+		if (node.IsLeaf())
+		{
+			for (unsigned int i = node.offset; i < node.offset + node.count; i++)
+			{
+				float distance, u, v;
+
+				if (RayCastTriangle(origin, direction, spaceTriangles[leafTriangles[i]], closestDistance, distance, u, v))
+				{
+					closestDistance = distance;
+					closestTriangle = (int)leafTriangles[i];
+					closestU = u;
+					closestV = v;
+				}
+			}
+
+			continue;
+		}
+
+		unsigned int leftIndex = entry.nodeIndex + 1;
+		unsigned int rightIndex = node.offset;
+
+		float leftDistance, rightDistance;
+
+		bool hitLeft = RayCastBvhNode(bvh->GetQueryNode(leftIndex), origin, invDirection, closestDistance, leftDistance);
+		bool hitRight = RayCastBvhNode(bvh->GetQueryNode(rightIndex), origin, invDirection, closestDistance, rightDistance);
+
+		//Farther child goes on the stack first so the nearer one is visited next
+		if (hitLeft && hitRight)
+		{
+			if (leftDistance <= rightDistance)
+			{
+				stack[stackSize++] = { rightIndex, rightDistance };
+				stack[stackSize++] = { leftIndex, leftDistance };
+			}
+			else
+			{
+				stack[stackSize++] = { leftIndex, leftDistance };
+				stack[stackSize++] = { rightIndex, rightDistance };
+			}
+		}
+		else if (hitLeft)
+		{
+			stack[stackSize++] = { leftIndex, leftDistance };
+		}
+		else if (hitRight)
+		{
+			stack[stackSize++] = { rightIndex, rightDistance };
+		}
+	}
+
+	if (closestTriangle < 0) return false;
+
+	const Triangle& triangle = spaceTriangles[closestTriangle];
+
+	hit.distance = closestDistance;
+	hit.point = rayOrigin + worldDirection * closestDistance;
+	hit.normal = glm::normalize(worldSpace ? triangle.normal : glm::vec3(transformMatrix * glm::vec4(triangle.normal, 0.0f)));
+	hit.triangleIndex = closestTriangle;
+	hit.barycentrics = glm::vec3(1.0f - closestU - closestV, closestU, closestV);
+
+	return true;
+}
+
+struct RayPacket
+{
+	__m128 originX, originY, originZ;
+	__m128 directionX, directionY, directionZ;
+	__m128 invDirectionX, invDirectionY, invDirectionZ;
+};
+
+//Slab test of every lane against one node, returns the mask of lanes that enter it before their closest hit
+static int RayCastPacketNode(const RayPacket& packet, const BvhNode& node, __m128 closest, float& entryDistance)
+{
+	__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.min.x), packet.originX), packet.invDirectionX);
+	__m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.max.x), packet.originX), packet.invDirectionX);
+
+	__m128 tNear = _mm_min_ps(t1, t2);
+	__m128 tFar = _mm_max_ps(t1, t2);
+
+	t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.min.y), packet.originY), packet.invDirectionY);
+	t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.max.y), packet.originY), packet.invDirectionY);
+
+	tNear = _mm_max_ps(tNear, _mm_min_ps(t1, t2));
+	tFar = _mm_min_ps(tFar, _mm_max_ps(t1, t2));
+
+	t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.min.z), packet.originZ), packet.invDirectionZ);
+	t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.max.z), packet.originZ), packet.invDirectionZ);
+
+	tNear = _mm_max_ps(_mm_max_ps(tNear, _mm_min_ps(t1, t2)), _mm_setzero_ps());
+	tFar = _mm_min_ps(tFar, _mm_max_ps(t1, t2));
+
+	int mask = _mm_movemask_ps(_mm_and_ps(_mm_cmple_ps(tNear, tFar), _mm_cmple_ps(tNear, closest)));
+
+	if (mask == 0) return 0;
+
+	float lanes[RAY_PACKET_SIZE];
+	_mm_storeu_ps(lanes, tNear);
+
+	entryDistance = std::numeric_limits<float>::max();
+
+	for (int lane = 0; lane < RAY_PACKET_SIZE; lane++)
+	{
+		if (mask & (1 << lane)) entryDistance = std::min(entryDistance, lanes[lane]);
+	}
+
+	return mask;
+}
+
+//Moller-Trumbore for all lanes against one triangle, lanes that hit closer take the triangle
+static void RayCastPacketTriangle(const RayPacket& packet, const Triangle& triangle, int triangleIndex,
+	__m128& closest, __m128& closestU, __m128& closestV, int* closestTriangles)
+{
+	const __m128 EPSILON = _mm_set1_ps(0.000001f);
+
+	glm::vec3 edge1 = triangle.v2 - triangle.v1;
+	glm::vec3 edge2 = triangle.v3 - triangle.v1;
+
+	__m128 edge1X = _mm_set1_ps(edge1.x), edge1Y = _mm_set1_ps(edge1.y), edge1Z = _mm_set1_ps(edge1.z);
+	__m128 edge2X = _mm_set1_ps(edge2.x), edge2Y = _mm_set1_ps(edge2.y), edge2Z = _mm_set1_ps(edge2.z);
+
+	__m128 hX = _mm_sub_ps(_mm_mul_ps(packet.directionY, edge2Z), _mm_mul_ps(packet.directionZ, edge2Y));
+	__m128 hY = _mm_sub_ps(_mm_mul_ps(packet.directionZ, edge2X), _mm_mul_ps(packet.directionX, edge2Z));
+	__m128 hZ = _mm_sub_ps(_mm_mul_ps(packet.directionX, edge2Y), _mm_mul_ps(packet.directionY, edge2X));
+
+	__m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(edge1X, hX), _mm_mul_ps(edge1Y, hY)), _mm_mul_ps(edge1Z, hZ));
+	__m128 absA = _mm_andnot_ps(_mm_set1_ps(-0.0f), a);
+	__m128 f = _mm_div_ps(_mm_set1_ps(1.0f), a);
+
+	__m128 sX = _mm_sub_ps(packet.originX, _mm_set1_ps(triangle.v1.x));
+	__m128 sY = _mm_sub_ps(packet.originY, _mm_set1_ps(triangle.v1.y));
+	__m128 sZ = _mm_sub_ps(packet.originZ, _mm_set1_ps(triangle.v1.z));
+
+	__m128 u = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sX, hX), _mm_mul_ps(sY, hY)), _mm_mul_ps(sZ, hZ)));
+
+	__m128 qX = _mm_sub_ps(_mm_mul_ps(sY, edge1Z), _mm_mul_ps(sZ, edge1Y));
+	__m128 qY = _mm_sub_ps(_mm_mul_ps(sZ, edge1X), _mm_mul_ps(sX, edge1Z));
+	__m128 qZ = _mm_sub_ps(_mm_mul_ps(sX, edge1Y), _mm_mul_ps(sY, edge1X));
+
+	__m128 v = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(packet.directionX, qX),
+		_mm_mul_ps(packet.directionY, qY)), _mm_mul_ps(packet.directionZ, qZ)));
+	__m128 t = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(edge2X, qX), _mm_mul_ps(edge2Y, qY)), _mm_mul_ps(edge2Z, qZ)));
+
+	__m128 valid = _mm_cmpgt_ps(absA, EPSILON);
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(u, _mm_setzero_ps()));
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(v, _mm_setzero_ps()));
+	valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+	valid = _mm_and_ps(valid, _mm_cmpgt_ps(t, EPSILON));
+	valid = _mm_and_ps(valid, _mm_cmple_ps(t, closest));
+
+	int mask = _mm_movemask_ps(valid);
+
+	if (mask == 0) return;
+
+	closest = _mm_or_ps(_mm_and_ps(valid, t), _mm_andnot_ps(valid, closest));
+	closestU = _mm_or_ps(_mm_and_ps(valid, u), _mm_andnot_ps(valid, closestU));
+	closestV = _mm_or_ps(_mm_and_ps(valid, v), _mm_andnot_ps(valid, closestV));
+
+	for (int lane = 0; lane < RAY_PACKET_SIZE; lane++)
+	{
+		if (mask & (1 << lane)) closestTriangles[lane] = triangleIndex;
+	}
+}
+
+int RayCastMeshBatch(const Ray* rays, int numOfRays, const HierarchicalAABB* bvh,
+	const glm::mat4& transformMatrix, const glm::mat4& inverseMatrix,
+	const std::vector<Triangle>& triangles, RayHit* hits)
+{
+	struct StackEntry
+	{
+		unsigned int nodeIndex;
+		float entryDistance;
+	};
+
+	for (int i = 0; i < numOfRays; i++)
+	{
+		hits[i] = RayHit();
+	}
+
+	if (bvh->GetNumOfNodes() == 0) return 0;
+
+	bool worldSpace = bvh->HasWorldSpace();
+
+	const std::vector<Triangle>& spaceTriangles = worldSpace ? bvh->GetWorldTriangles() : triangles;
+	const unsigned int* leafTriangles = bvh->GetTriangleIndices();
+
+	int numOfHits = 0;
+
+	for (int first = 0; first < numOfRays; first += RAY_PACKET_SIZE)
+	{
+		int numOfLanes = std::min(RAY_PACKET_SIZE, numOfRays - first);
+
+		// Same setup as RayCastMesh per lane. Unused lanes copy the first ray with a negative
+		// closest distance, so every node and triangle test fails for them.
+
+		float lanes[9][RAY_PACKET_SIZE];
+		float laneClosest[RAY_PACKET_SIZE];
+		glm::vec3 worldDirections[RAY_PACKET_SIZE];
+
+		for (int lane = 0; lane < RAY_PACKET_SIZE; lane++)
+		{
+			const Ray& ray = rays[first + (lane < numOfLanes ? lane : 0)];
+
+			worldDirections[lane] = glm::normalize(ray.direction);
+
+			glm::vec3 origin = worldSpace ? ray.origin : glm::vec3(inverseMatrix * glm::vec4(ray.origin, 1.0f));
+			glm::vec3 direction = worldSpace ? worldDirections[lane] :
+				glm::vec3(inverseMatrix * glm::vec4(worldDirections[lane], 0.0f));
+
+			for (int axis = 0; axis < 3; axis++)
+			{
+				lanes[axis][lane] = origin[axis];
+				lanes[3 + axis][lane] = direction[axis];
+				lanes[6 + axis][lane] = 1.0f / direction[axis];
+			}
+
+			laneClosest[lane] = lane < numOfLanes ? ray.maxDistance : -1.0f;
+		}
+
+		RayPacket packet;
+		packet.originX = _mm_loadu_ps(lanes[0]);
+		packet.originY = _mm_loadu_ps(lanes[1]);
+		packet.originZ = _mm_loadu_ps(lanes[2]);
+		packet.directionX = _mm_loadu_ps(lanes[3]);
+		packet.directionY = _mm_loadu_ps(lanes[4]);
+		packet.directionZ = _mm_loadu_ps(lanes[5]);
+		packet.invDirectionX = _mm_loadu_ps(lanes[6]);
+		packet.invDirectionY = _mm_loadu_ps(lanes[7]);
+		packet.invDirectionZ = _mm_loadu_ps(lanes[8]);
+
+		__m128 closest = _mm_loadu_ps(laneClosest);
+		__m128 closestU = _mm_setzero_ps();
+		__m128 closestV = _mm_setzero_ps();
+		int closestTriangles[RAY_PACKET_SIZE] = { -1, -1, -1, -1 };
+
+		StackEntry stack[BVH_STACK_SIZE];
+		int stackSize = 0;
+
+		float entryDistance;
+
+		if (RayCastPacketNode(packet, bvh->GetQueryNode(0), closest, entryDistance) != 0)
+		{
+			stack[stackSize++] = { 0, entryDistance };
+		}
+
+		while (stackSize > 0)
+		{
+			StackEntry entry = stack[--stackSize];
+
+			//Skip once every lane already has a hit closer than the node
+			_mm_storeu_ps(laneClosest, closest);
+
+			float farthestClosest = std::max(std::max(laneClosest[0], laneClosest[1]), std::max(laneClosest[2], laneClosest[3]));
+
+			if (entry.entryDistance > farthestClosest) continue;
+
+			BvhNode node = bvh->GetQueryNode(entry.nodeIndex);
+
+			if (node.IsLeaf())
+			{
+				for (unsigned int i = node.offset; i < node.offset + node.count; i++)
+				{
+					RayCastPacketTriangle(packet, spaceTriangles[leafTriangles[i]], (int)leafTriangles[i],
+						closest, closestU, closestV, closestTriangles);
+				}
+
+				continue;
+			}
+
+			unsigned int leftIndex = entry.nodeIndex + 1;
+			unsigned int rightIndex = node.offset;
+
+			float leftDistance, rightDistance;
+
+			bool hitLeft = RayCastPacketNode(packet, bvh->GetQueryNode(leftIndex), closest, leftDistance) != 0;
+			bool hitRight = RayCastPacketNode(packet, bvh->GetQueryNode(rightIndex), closest, rightDistance) != 0;
+
+			if (hitLeft && hitRight)
+			{
+				if (leftDistance <= rightDistance)
+				{
+					stack[stackSize++] = { rightIndex, rightDistance };
+					stack[stackSize++] = { leftIndex, leftDistance };
+				}
+				else
+				{
+					stack[stackSize++] = { leftIndex, leftDistance };
+					stack[stackSize++] = { rightIndex, rightDistance };
+				}
+			}
+			else if (hitLeft)
+			{
+				stack[stackSize++] = { leftIndex, leftDistance };
+			}
+			else if (hitRight)
+			{
+				stack[stackSize++] = { rightIndex, rightDistance };
+			}
+		}
+
+		float laneU[RAY_PACKET_SIZE], laneV[RAY_PACKET_SIZE];
+		_mm_storeu_ps(laneClosest, closest);
+		_mm_storeu_ps(laneU, closestU);
+		_mm_storeu_ps(laneV, closestV);
+
+		for (int lane = 0; lane < numOfLanes; lane++)
+		{
+			if (closestTriangles[lane] < 0) continue;
+
+			const Triangle& triangle = spaceTriangles[closestTriangles[lane]];
+			RayHit& hit = hits[first + lane];
+
+			hit.distance = laneClosest[lane];
+			hit.point = rays[first + lane].origin + worldDirections[lane] * laneClosest[lane];
+			hit.normal = glm::normalize(worldSpace ? triangle.normal : glm::vec3(transformMatrix * glm::vec4(triangle.normal, 0.0f)));
+			hit.triangleIndex = closestTriangles[lane];
+			hit.barycentrics = glm::vec3(1.0f - laneU[lane] - laneV[lane], laneU[lane], laneV[lane]);
+
+			numOfHits++;
+		}
+	}
+
+	return numOfHits;
+}
+
+static glm::vec3 ClosestPointOnEdge(const glm::vec3& start, const glm::vec3& end, const glm::vec3& point)
+{
+	glm::vec3 edge = end - start;
+	float lengthSquared = glm::dot(edge, edge);
+
+	if (lengthSquared <= 0.0f) return start;
+
+	return start + edge * glm::clamp(glm::dot(point - start, edge) / lengthSquared, 0.0f, 1.0f);
+}
+
+//Entry distance of a ray into a sphere, 0 when the origin is already inside
+static bool RayEntersSphere(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, float maxDistance,
+	const glm::vec3& center, float radius, float& distance)
+{
+	glm::vec3 offset = rayOrigin - center;
+
+	float b = glm::dot(offset, rayDirection);
+	float c = glm::dot(offset, offset) - radius * radius;
+
+	if (c <= 0.0f)
+	{
+		distance = 0.0f;
+		return true;
+	}
+
+	if (b > 0.0f) return false;
+
+	float discriminant = b * b - c;
+
+	if (discriminant < 0.0f) return false;
+
+	distance = -b - sqrt(discriminant);
+
+	return distance <= maxDistance;
+}
+
+//Slab test that also reports the axis of the entry face
+static bool RayEntersAabb(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, float maxDistance,
+	const glm::vec3& min, const glm::vec3& max, float& distance, glm::vec3& normal)
+{
+	float tNear = 0.0f;
+	float tFar = maxDistance;
+	int nearAxis = -1;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (std::abs(rayDirection[axis]) < 0.000001f)
+		{
+			if (rayOrigin[axis] < min[axis] || rayOrigin[axis] > max[axis]) return false;
+			continue;
+		}
+
+		float invDirection = 1.0f / rayDirection[axis];
+		float t1 = (min[axis] - rayOrigin[axis]) * invDirection;
+		float t2 = (max[axis] - rayOrigin[axis]) * invDirection;
+
+		if (t1 > t2) std::swap(t1, t2);
+
+		if (t1 > tNear)
+		{
+			tNear = t1;
+			nearAxis = axis;
+		}
+
+		tFar = std::min(tFar, t2);
+
+		if (tNear > tFar) return false;
+	}
+
+	distance = tNear;
+	normal = glm::vec3(0.0f);
+
+	if (nearAxis < 0)
+	{
+		normal = -rayDirection;
+	}
+	else
+	{
+		normal[nearAxis] = rayDirection[nearAxis] > 0.0f ? -1.0f : 1.0f;
+	}
+
+	return true;
+}
+
+bool RayCastCapsule(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, float maxDistance,
+	const glm::vec3& capsuleStart, const glm::vec3& capsuleEnd, float radius, float& distance)
+{
+	glm::vec3 axis = capsuleEnd - capsuleStart;
+	glm::vec3 startToOrigin = rayOrigin - capsuleStart;
+
+	if (glm::length(rayOrigin - ClosestPointOnEdge(capsuleStart, capsuleEnd, rayOrigin)) <= radius)
+	{
+		distance = 0.0f;
+		return true;
+	}
+
+	float closest = std::numeric_limits<float>::max();
+
+	// Side of the infinite cylinder, only kept when the hit lies between the two caps
+	float axisDotAxis = glm::dot(axis, axis);
+	float axisDotDirection = glm::dot(axis, rayDirection);
+	float axisDotOrigin = glm::dot(axis, startToOrigin);
+
+	float a = axisDotAxis - axisDotDirection * axisDotDirection;
+	float b = axisDotAxis * glm::dot(startToOrigin, rayDirection) - axisDotOrigin * axisDotDirection;
+	float c = axisDotAxis * glm::dot(startToOrigin, startToOrigin) - axisDotOrigin * axisDotOrigin -
+		radius * radius * axisDotAxis;
+
+	if (a > 0.000001f)
+	{
+		float discriminant = b * b - a * c;
+
+		if (discriminant >= 0.0f)
+		{
+			float t = (-b - sqrt(discriminant)) / a;
+			float alongAxis = axisDotOrigin + t * axisDotDirection;
+
+			if (t >= 0.0f && alongAxis >= 0.0f && alongAxis <= axisDotAxis)
+			{
+				closest = t;
+			}
+		}
+	}
+
+	float capDistance;
+
+	if (RayEntersSphere(rayOrigin, rayDirection, maxDistance, capsuleStart, radius, capDistance))
+	{
+		closest = std::min(closest, capDistance);
+	}
+
+	if (RayEntersSphere(rayOrigin, rayDirection, maxDistance, capsuleEnd, radius, capDistance))
+	{
+		closest = std::min(closest, capDistance);
+	}
+
+	if (closest > maxDistance) return false;
+
+	distance = closest;
+	return true;
+}
+
+bool SweepSphereVsSphere(const Sphere& sphere, const glm::vec3& direction, float maxDistance,
+	const Sphere& target, float& distance, glm::vec3& normal)
+{
+	if (!RayEntersSphere(sphere.position, direction, maxDistance, target.position,
+		sphere.radius + target.radius, distance)) return false;
+
+	glm::vec3 offset = sphere.position + direction * distance - target.position;
+
+	normal = glm::dot(offset, offset) > 0.0f ? glm::normalize(offset) : -direction;
+	return true;
+}
+
+bool SweepSphereVsAABB(const Sphere& sphere, const glm::vec3& direction, float maxDistance,
+	const Aabb& target, float& distance, glm::vec3& normal)
+{
+	// Ray from the center against the box grown by the radius with rounded edges. The grown box
+	// is tested first, a hit past two or three faces lands in an edge or corner region and is
+	// checked again against the capsules of the three edges at the nearest corner.
+
+	glm::vec3 closestPoint = glm::clamp(sphere.position, target.min, target.max);
+	glm::vec3 offset = sphere.position - closestPoint;
+
+	if (glm::dot(offset, offset) <= sphere.radius * sphere.radius)
+	{
+		distance = 0.0f;
+		normal = glm::dot(offset, offset) > 0.0f ? glm::normalize(offset) : -direction;
+		return true;
+	}
+
+	glm::vec3 grow = glm::vec3(sphere.radius);
+
+	if (!RayEntersAabb(sphere.position, direction, maxDistance, target.min - grow, target.max + grow,
+		distance, normal)) return false;
+
+	glm::vec3 point = sphere.position + direction * distance;
+
+	glm::vec3 corner;
+	int numOfOutsideAxes = 0;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (point[axis] < target.min[axis])
+		{
+			corner[axis] = target.min[axis];
+			numOfOutsideAxes++;
+		}
+		else if (point[axis] > target.max[axis])
+		{
+			corner[axis] = target.max[axis];
+			numOfOutsideAxes++;
+		}
+		else
+		{
+			corner[axis] = point[axis] - target.min[axis] < target.max[axis] - point[axis] ? target.min[axis] : target.max[axis];
+		}
+	}
+
+	if (numOfOutsideAxes < 2) return true;
+
+	float closest = std::numeric_limits<float>::max();
+	glm::vec3 closestNormal;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		glm::vec3 edgeEnd = corner;
+		edgeEnd[axis] = corner[axis] == target.min[axis] ? target.max[axis] : target.min[axis];
+
+		float edgeDistance;
+
+		if (RayCastCapsule(sphere.position, direction, maxDistance, corner, edgeEnd, sphere.radius, edgeDistance) &&
+			edgeDistance < closest)
+		{
+			glm::vec3 center = sphere.position + direction * edgeDistance;
+
+			closest = edgeDistance;
+			closestNormal = glm::normalize(center - ClosestPointOnEdge(corner, edgeEnd, center));
+		}
+	}
+
+	if (closest > maxDistance) return false;
+
+	distance = closest;
+	normal = closestNormal;
+	return true;
+}
+
+bool SweepSphereVsTriangle(const Sphere& sphere, const glm::vec3& direction, float maxDistance,
+	const Triangle& target, float& distance, glm::vec3& normal)
+{
+	glm::vec3 closestPoint = ClosestPointOnTriangle(sphere.position, target.v1, target.v2, target.v3);
+	glm::vec3 offset = sphere.position - closestPoint;
+
+	glm::vec3 faceNormal = glm::cross(target.v2 - target.v1, target.v3 - target.v1);
+
+	if (glm::dot(faceNormal, faceNormal) <= 0.0f) return false;
+
+	faceNormal = glm::normalize(faceNormal);
+
+	if (glm::dot(offset, offset) <= sphere.radius * sphere.radius)
+	{
+		distance = 0.0f;
+		normal = glm::dot(offset, offset) > 0.0f ? glm::normalize(offset) : faceNormal;
+		return true;
+	}
+
+	//Face the side the sphere starts on
+	float planeDistance = glm::dot(sphere.position - target.v1, faceNormal);
+
+	if (planeDistance < 0.0f)
+	{
+		faceNormal = -faceNormal;
+		planeDistance = -planeDistance;
+	}
+
+	float approachSpeed = -glm::dot(direction, faceNormal);
+
+	if (approachSpeed > 0.000001f)
+	{
+		float t = (planeDistance - sphere.radius) / approachSpeed;
+
+		if (t >= 0.0f && t <= maxDistance)
+		{
+			glm::vec3 contact = sphere.position + direction * t - faceNormal * sphere.radius;
+
+			bool inside =
+				glm::dot(glm::cross(target.v2 - target.v1, contact - target.v1), faceNormal) >= 0.0f &&
+				glm::dot(glm::cross(target.v3 - target.v2, contact - target.v2), faceNormal) >= 0.0f &&
+				glm::dot(glm::cross(target.v1 - target.v3, contact - target.v3), faceNormal) >= 0.0f;
+
+			bool flipped =
+				glm::dot(glm::cross(target.v2 - target.v1, contact - target.v1), faceNormal) <= 0.0f &&
+				glm::dot(glm::cross(target.v3 - target.v2, contact - target.v2), faceNormal) <= 0.0f &&
+				glm::dot(glm::cross(target.v1 - target.v3, contact - target.v3), faceNormal) <= 0.0f;
+
+			if (inside || flipped)
+			{
+				distance = t;
+				normal = faceNormal;
+				return true;
+			}
+		}
+	}
+
+	//Missed the face, the first touch is on an edge or a corner
+	const glm::vec3* vertices[3] = { &target.v1, &target.v2, &target.v3 };
+
+	float closest = std::numeric_limits<float>::max();
+
+	for (int i = 0; i < 3; i++)
+	{
+		const glm::vec3& edgeStart = *vertices[i];
+		const glm::vec3& edgeEnd = *vertices[(i + 1) % 3];
+
+		float edgeDistance;
+
+		if (RayCastCapsule(sphere.position, direction, maxDistance, edgeStart, edgeEnd, sphere.radius, edgeDistance) &&
+			edgeDistance < closest)
+		{
+			glm::vec3 center = sphere.position + direction * edgeDistance;
+
+			closest = edgeDistance;
+			normal = glm::normalize(center - ClosestPointOnEdge(edgeStart, edgeEnd, center));
+		}
+	}
+
+	if (closest > maxDistance) return false;
+
+	distance = closest;
+	return true;
+}
+
+bool SweepAABBVsAABB(const Aabb& box, const glm::vec3& direction, float maxDistance,
+	const Aabb& target, float& distance, glm::vec3& normal)
+{
+	//Ray from the box center against the target grown by the box half size
+	glm::vec3 halfSize = (box.max - box.min) * 0.5f;
+	glm::vec3 center = (box.min + box.max) * 0.5f;
+
+	return RayEntersAabb(center, direction, maxDistance, target.min - halfSize, target.max + halfSize, distance, normal);
+}
+
+bool SweepAABBVsTriangle(const Aabb& box, const glm::vec3& direction, float maxDistance,
+	const Triangle& target, float& distance, glm::vec3& normal)
+{
+	// Moving separating axis test. On every axis the box and triangle projections give the time
+	// interval in which they overlap, the shapes touch while all intervals overlap. The first touch
+	// is the latest entry time and its axis is the contact normal.
+
+	glm::vec3 halfSize = (box.max - box.min) * 0.5f;
+	glm::vec3 center = (box.min + box.max) * 0.5f;
+
+	glm::vec3 edges[3] = { target.v2 - target.v1, target.v3 - target.v2, target.v1 - target.v3 };
+
+	glm::vec3 axes[13];
+	int numOfAxes = 0;
+
+	axes[numOfAxes++] = glm::vec3(1, 0, 0);
+	axes[numOfAxes++] = glm::vec3(0, 1, 0);
+	axes[numOfAxes++] = glm::vec3(0, 0, 1);
+	axes[numOfAxes++] = glm::cross(edges[0], edges[1]);
+
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			glm::vec3 boxAxis = glm::vec3(0);
+			boxAxis[i] = 1.0f;
+
+			axes[numOfAxes++] = glm::cross(boxAxis, edges[j]);
+		}
+	}
+
+	float tFirst = -std::numeric_limits<float>::max();
+	float tLast = std::numeric_limits<float>::max();
+	glm::vec3 firstAxis = -direction;
+
+	for (int i = 0; i < numOfAxes; i++)
+	{
+		glm::vec3 axis = axes[i];
+
+		if (glm::dot(axis, axis) < 0.000001f) continue;
+
+		axis = glm::normalize(axis);
+
+		float boxRadius = glm::dot(halfSize, glm::abs(axis));
+		float boxCenter = glm::dot(center, axis);
+
+		float triangleMin = glm::dot(target.v1, axis);
+		float triangleMax = triangleMin;
+
+		triangleMin = std::min(triangleMin, std::min(glm::dot(target.v2, axis), glm::dot(target.v3, axis)));
+		triangleMax = std::max(triangleMax, std::max(glm::dot(target.v2, axis), glm::dot(target.v3, axis)));
+
+		float speed = glm::dot(direction, axis);
+
+		if (std::abs(speed) < 0.000001f)
+		{
+			if (boxCenter + boxRadius < triangleMin || boxCenter - boxRadius > triangleMax) return false;
+			continue;
+		}
+
+		float tEnter = (triangleMin - (boxCenter + boxRadius)) / speed;
+		float tExit = (triangleMax - (boxCenter - boxRadius)) / speed;
+
+		if (tEnter > tExit) std::swap(tEnter, tExit);
+
+		if (tEnter > tFirst)
+		{
+			tFirst = tEnter;
+			firstAxis = speed > 0.0f ? -axis : axis;
+		}
+
+		tLast = std::min(tLast, tExit);
+
+		if (tFirst > tLast) return false;
+	}
+
+	if (tLast < 0.0f || tFirst > maxDistance) return false;
+
+	distance = std::max(tFirst, 0.0f);
+	normal = tFirst > 0.0f ? firstAxis : -direction;
+	return true;
+}
+
+bool SweepSphereVsMesh(const Sphere& sphere, const glm::vec3& direction, float maxDistance,
+	const HierarchicalAABB* bvh, const glm::mat4& transformMatrix, const glm::mat4& inverseMatrix,
+	const std::vector<Triangle>& triangles, RayHit& hit)
+{
+	glm::vec3 extents = glm::vec3(sphere.radius);
+	glm::vec3 end = sphere.position + direction * maxDistance;
+
+	Aabb sweptAabb(glm::min(sphere.position, end) - extents, glm::max(sphere.position, end) + extents);
+
+	std::set<int> triangleIndices;
+	std::vector<Aabb> collisionAabbs;
+
+	CollisionAABBvsHAABB(sweptAabb, bvh, transformMatrix, inverseMatrix, triangleIndices, collisionAabbs);
+
+	float closest = maxDistance;
+	bool found = false;
+
+	for (int i : triangleIndices)
+	{
+		Triangle transformed;
+		const Triangle& triangle = GetWorldTriangle(bvh, triangles, i, transformMatrix, transformed);
+
+		float distance;
+		glm::vec3 normal;
+
+		if (!SweepSphereVsTriangle(sphere, direction, closest, triangle, distance, normal)) continue;
+
+		closest = distance;
+		found = true;
+
+		hit.distance = distance;
+		hit.normal = normal;
+		hit.point = sphere.position + direction * distance - normal * sphere.radius;
+		hit.triangleIndex = i;
+	}
+
+	return found;
+}
+
+bool SweepAABBVsMesh(const Aabb& box, const glm::vec3& direction, float maxDistance,
+	const HierarchicalAABB* bvh, const glm::mat4& transformMatrix, const glm::mat4& inverseMatrix,
+	const std::vector<Triangle>& triangles, RayHit& hit)
+{
+	glm::vec3 offset = direction * maxDistance;
+
+	Aabb sweptAabb(glm::min(box.min, box.min + offset), glm::max(box.max, box.max + offset));
+
+	std::set<int> triangleIndices;
+	std::vector<Aabb> collisionAabbs;
+
+	CollisionAABBvsHAABB(sweptAabb, bvh, transformMatrix, inverseMatrix, triangleIndices, collisionAabbs);
+
+	float closest = maxDistance;
+	bool found = false;
+
+	for (int i : triangleIndices)
+	{
+		Triangle transformed;
+		const Triangle& triangle = GetWorldTriangle(bvh, triangles, i, transformMatrix, transformed);
+
+		float distance;
+		glm::vec3 normal;
+
+		if (!SweepAABBVsTriangle(box, direction, closest, triangle, distance, normal)) continue;
+
+		closest = distance;
+		found = true;
+
+		//Point of the triangle nearest the moved box, kept on the box surface
+		glm::vec3 movedMin = box.min + direction * distance;
+		glm::vec3 movedMax = box.max + direction * distance;
+		glm::vec3 trianglePoint = ClosestPointOnTriangle((movedMin + movedMax) * 0.5f, triangle.v1, triangle.v2, triangle.v3);
+
+		hit.distance = distance;
+		hit.normal = normal;
+		hit.point = glm::clamp(trianglePoint, movedMin, movedMax);
+		hit.triangleIndex = i;
+	}
+
+	return found;
+}
+
+static __m128 SelectLanes(__m128 mask, __m128 a, __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static void ResizeContacts(const SphereBatch& spheres, SphereBatchContacts& contacts)
+{
+	size_t padded = spheres.positionX.size();
+
+	contacts.hitMasks.resize(padded / SPHERE_BATCH_WIDTH);
+	contacts.normalX.resize(padded);
+	contacts.normalY.resize(padded);
+	contacts.normalZ.resize(padded);
+	contacts.depth.resize(padded);
+}
+
+//Lanes of the group at first that hold a sphere, the padding of the last group is masked off
+static int GetValidLanes(int first, int count)
+{
+	int numOfValid = std::min(count - first, SPHERE_BATCH_WIDTH);
+
+	return (1 << numOfValid) - 1;
+}
+
+int CollisionSpheresVsAABB(const SphereBatch& spheres, const Aabb& aabb, SphereBatchContacts& contacts)
+{
+	ResizeContacts(spheres, contacts);
+
+	const __m128 minX = _mm_set1_ps(aabb.min.x), minY = _mm_set1_ps(aabb.min.y), minZ = _mm_set1_ps(aabb.min.z);
+	const __m128 maxX = _mm_set1_ps(aabb.max.x), maxY = _mm_set1_ps(aabb.max.y), maxZ = _mm_set1_ps(aabb.max.z);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 minusOne = _mm_set1_ps(-1.0f);
+
+	int numOfHits = 0;
+
+	for (int first = 0; first < spheres.count; first += SPHERE_BATCH_WIDTH)
+	{
+		__m128 positionX = _mm_loadu_ps(&spheres.positionX[first]);
+		__m128 positionY = _mm_loadu_ps(&spheres.positionY[first]);
+		__m128 positionZ = _mm_loadu_ps(&spheres.positionZ[first]);
+		__m128 radius = _mm_loadu_ps(&spheres.radius[first]);
+
+		//Offset from the closest point of the box, zero when the center is inside
+		__m128 offsetX = _mm_sub_ps(positionX, _mm_min_ps(_mm_max_ps(positionX, minX), maxX));
+		__m128 offsetY = _mm_sub_ps(positionY, _mm_min_ps(_mm_max_ps(positionY, minY), maxY));
+		__m128 offsetZ = _mm_sub_ps(positionZ, _mm_min_ps(_mm_max_ps(positionZ, minZ), maxZ));
+
+		__m128 sqDistance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(offsetX, offsetX), _mm_mul_ps(offsetY, offsetY)),
+			_mm_mul_ps(offsetZ, offsetZ));
+
+		int hitMask = _mm_movemask_ps(_mm_cmple_ps(sqDistance, _mm_mul_ps(radius, radius))) & GetValidLanes(first, spheres.count);
+
+		contacts.hitMasks[first / SPHERE_BATCH_WIDTH] = (unsigned char)hitMask;
+
+		if (hitMask == 0) continue;
+
+		numOfHits += (hitMask & 1) + ((hitMask >> 1) & 1) + ((hitMask >> 2) & 1) + ((hitMask >> 3) & 1);
+
+		__m128 distance = _mm_sqrt_ps(sqDistance);
+		__m128 outside = _mm_cmpgt_ps(sqDistance, zero);
+		__m128 invDistance = _mm_div_ps(one, SelectLanes(outside, distance, one));
+
+		// Centers inside the box are pushed out through the nearest face
+
+		__m128 toMinX = _mm_sub_ps(positionX, minX), toMaxX = _mm_sub_ps(maxX, positionX);
+		__m128 toMinY = _mm_sub_ps(positionY, minY), toMaxY = _mm_sub_ps(maxY, positionY);
+		__m128 toMinZ = _mm_sub_ps(positionZ, minZ), toMaxZ = _mm_sub_ps(maxZ, positionZ);
+
+		__m128 faceX = _mm_min_ps(toMinX, toMaxX);
+		__m128 faceY = _mm_min_ps(toMinY, toMaxY);
+		__m128 faceZ = _mm_min_ps(toMinZ, toMaxZ);
+
+		__m128 signX = SelectLanes(_mm_cmplt_ps(toMinX, toMaxX), minusOne, one);
+		__m128 signY = SelectLanes(_mm_cmplt_ps(toMinY, toMaxY), minusOne, one);
+		__m128 signZ = SelectLanes(_mm_cmplt_ps(toMinZ, toMaxZ), minusOne, one);
+
+		__m128 useX = _mm_and_ps(_mm_cmple_ps(faceX, faceY), _mm_cmple_ps(faceX, faceZ));
+		__m128 useY = _mm_andnot_ps(useX, _mm_cmple_ps(faceY, faceZ));
+		__m128 useZ = _mm_andnot_ps(_mm_or_ps(useX, useY), _mm_cmpeq_ps(zero, zero));
+
+		__m128 insideDepth = _mm_add_ps(radius, _mm_min_ps(faceX, _mm_min_ps(faceY, faceZ)));
+
+		__m128 normalX = SelectLanes(outside, _mm_mul_ps(offsetX, invDistance), _mm_and_ps(useX, signX));
+		__m128 normalY = SelectLanes(outside, _mm_mul_ps(offsetY, invDistance), _mm_and_ps(useY, signY));
+		__m128 normalZ = SelectLanes(outside, _mm_mul_ps(offsetZ, invDistance), _mm_and_ps(useZ, signZ));
+		__m128 depth = SelectLanes(outside, _mm_sub_ps(radius, distance), insideDepth);
+
+		_mm_storeu_ps(&contacts.normalX[first], normalX);
+		_mm_storeu_ps(&contacts.normalY[first], normalY);
+		_mm_storeu_ps(&contacts.normalZ[first], normalZ);
+		_mm_storeu_ps(&contacts.depth[first], depth);
+	}
+
+	return numOfHits;
+}
+
+int CollisionSpheresVsSphere(const SphereBatch& spheres, const Sphere& sphere, SphereBatchContacts& contacts)
+{
+	ResizeContacts(spheres, contacts);
+
+	const __m128 centerX = _mm_set1_ps(sphere.position.x);
+	const __m128 centerY = _mm_set1_ps(sphere.position.y);
+	const __m128 centerZ = _mm_set1_ps(sphere.position.z);
+	const __m128 targetRadius = _mm_set1_ps(sphere.radius);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+
+	int numOfHits = 0;
+
+	for (int first = 0; first < spheres.count; first += SPHERE_BATCH_WIDTH)
+	{
+		__m128 offsetX = _mm_sub_ps(_mm_loadu_ps(&spheres.positionX[first]), centerX);
+		__m128 offsetY = _mm_sub_ps(_mm_loadu_ps(&spheres.positionY[first]), centerY);
+		__m128 offsetZ = _mm_sub_ps(_mm_loadu_ps(&spheres.positionZ[first]), centerZ);
+		__m128 radiusSum = _mm_add_ps(_mm_loadu_ps(&spheres.radius[first]), targetRadius);
+
+		__m128 sqDistance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(offsetX, offsetX), _mm_mul_ps(offsetY, offsetY)),
+			_mm_mul_ps(offsetZ, offsetZ));
+
+		int hitMask = _mm_movemask_ps(_mm_cmple_ps(sqDistance, _mm_mul_ps(radiusSum, radiusSum))) & GetValidLanes(first, spheres.count);
+
+		contacts.hitMasks[first / SPHERE_BATCH_WIDTH] = (unsigned char)hitMask;
+
+		if (hitMask == 0) continue;
+
+		numOfHits += (hitMask & 1) + ((hitMask >> 1) & 1) + ((hitMask >> 2) & 1) + ((hitMask >> 3) & 1);
+
+		__m128 distance = _mm_sqrt_ps(sqDistance);
+		__m128 apart = _mm_cmpgt_ps(sqDistance, zero);
+		__m128 invDistance = _mm_div_ps(one, SelectLanes(apart, distance, one));
+
+		//Same centers have no direction, push those up
+		_mm_storeu_ps(&contacts.normalX[first], _mm_and_ps(apart, _mm_mul_ps(offsetX, invDistance)));
+		_mm_storeu_ps(&contacts.normalY[first], SelectLanes(apart, _mm_mul_ps(offsetY, invDistance), one));
+		_mm_storeu_ps(&contacts.normalZ[first], _mm_and_ps(apart, _mm_mul_ps(offsetZ, invDistance)));
+		_mm_storeu_ps(&contacts.depth[first], _mm_sub_ps(radiusSum, distance));
+	}
+
+	return numOfHits;
+}
+
+static std::vector<Sphere> GetSpheres(const SphereBatch& spheres)
+{
+	std::vector<Sphere> listOfSpheres;
+	listOfSpheres.reserve(spheres.count);
+
+	for (int i = 0; i < spheres.count; i++)
+	{
+		listOfSpheres.push_back(Sphere(glm::vec3(spheres.positionX[i], spheres.positionY[i], spheres.positionZ[i]),
+			spheres.radius[i]));
+	}
+
+	return listOfSpheres;
+}
+
+static float GetMillisecondsSince(const std::chrono::high_resolution_clock::time_point& startTime)
+{
+	return std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+}
+
+BatchCollisionTimings BenchmarkSpheresVsAABB(const SphereBatch& spheres, const Aabb& aabb, int numOfRepeats)
+{
+	BatchCollisionTimings timings;
+	timings.numOfSpheres = spheres.count;
+	timings.numOfRepeats = numOfRepeats;
+
+	std::vector<Sphere> listOfSpheres = GetSpheres(spheres);
+	std::vector<glm::vec3> collisionPts, collisionNr;
+	SphereBatchContacts contacts;
+
+	std::chrono::high_resolution_clock::time_point startTime = std::chrono::high_resolution_clock::now();
+
+	for (int repeat = 0; repeat < numOfRepeats; repeat++)
+	{
+		timings.scalarHits = 0;
+
+		for (Sphere& sphere : listOfSpheres)
+		{
+			collisionPts.clear();
+			collisionNr.clear();
+
+			if (CollisionSpherevsAABB(&sphere, aabb, false, collisionPts, collisionNr)) timings.scalarHits++;
+		}
+	}
+
+	timings.scalarTime = GetMillisecondsSince(startTime);
+	startTime = std::chrono::high_resolution_clock::now();
+
+	for (int repeat = 0; repeat < numOfRepeats; repeat++)
+	{
+		timings.batchHits = CollisionSpheresVsAABB(spheres, aabb, contacts);
+	}
+
+	timings.batchTime = GetMillisecondsSince(startTime);
+
+	return timings;
+}
+
+BatchCollisionTimings BenchmarkSpheresVsSphere(const SphereBatch& spheres, const Sphere& sphere, int numOfRepeats)
+{
+	BatchCollisionTimings timings;
+	timings.numOfSpheres = spheres.count;
+	timings.numOfRepeats = numOfRepeats;
+
+	std::vector<Sphere> listOfSpheres = GetSpheres(spheres);
+	std::vector<glm::vec3> collisionPts, collisionNr;
+	SphereBatchContacts contacts;
+	Sphere target = sphere;
+
+	std::chrono::high_resolution_clock::time_point startTime = std::chrono::high_resolution_clock::now();
+
+	for (int repeat = 0; repeat < numOfRepeats; repeat++)
+	{
+		timings.scalarHits = 0;
+
+		for (Sphere& listSphere : listOfSpheres)
+		{
+			collisionPts.clear();
+			collisionNr.clear();
+
+			if (CollisionSphereVSSphere(&listSphere, &target, collisionPts, collisionNr)) timings.scalarHits++;
+		}
+	}
+
+	timings.scalarTime = GetMillisecondsSince(startTime);
+	startTime = std::chrono::high_resolution_clock::now();
+
+	for (int repeat = 0; repeat < numOfRepeats; repeat++)
+	{
+		timings.batchHits = CollisionSpheresVsSphere(spheres, sphere, contacts);
+	}
+
+	timings.batchTime = GetMillisecondsSince(startTime);
+
+	return timings;
+}
+
+static glm::vec3 ContactNormal(const glm::vec3& point, const glm::vec3& closestPoint, const glm::vec3& fallback)
+{
+	glm::vec3 offset = point - closestPoint;
+
+	return glm::dot(offset, offset) > 0.0f ? glm::normalize(offset) : fallback;
+}
+
+//Face of the box nearest to a point inside it
+static glm::vec3 NearestFaceNormal(const glm::vec3& point, const Aabb& aabb)
+{
+	glm::vec3 normal = glm::vec3(0.0f);
+
+	int nearestAxis = 0;
+	float nearest = std::numeric_limits<float>::max();
+	float sign = 1.0f;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float toMin = point[axis] - aabb.min[axis];
+		float toMax = aabb.max[axis] - point[axis];
+
+		if (std::min(toMin, toMax) < nearest)
+		{
+			nearest = std::min(toMin, toMax);
+			nearestAxis = axis;
+			sign = toMin < toMax ? -1.0f : 1.0f;
+		}
+	}
+
+	normal[nearestAxis] = sign;
+
+	return normal;
+}
+
+static void ClosestPointsOnSegments(const glm::vec3& start1, const glm::vec3& end1,
+	const glm::vec3& start2, const glm::vec3& end2, glm::vec3& closest1, glm::vec3& closest2)
+{
+	glm::vec3 d1 = end1 - start1;
+	glm::vec3 d2 = end2 - start2;
+	glm::vec3 r = start1 - start2;
+
+	float a = glm::dot(d1, d1);
+	float e = glm::dot(d2, d2);
+	float f = glm::dot(d2, r);
+
+	float s = 0.0f;
+	float t = 0.0f;
+
+	if (a <= 0.000001f && e <= 0.000001f)
+	{
+		closest1 = start1;
+		closest2 = start2;
+		return;
+	}
+
+	if (a <= 0.000001f)
+	{
+		t = glm::clamp(f / e, 0.0f, 1.0f);
+	}
+	else
+	{
+		float c = glm::dot(d1, r);
+
+		if (e <= 0.000001f)
+		{
+			s = glm::clamp(-c / a, 0.0f, 1.0f);
+		}
+		else
+		{
+			float b = glm::dot(d1, d2);
+			float denom = a * e - b * b;
+
+			//Parallel segments pick any s, the clamps below fix t
+			s = denom != 0.0f ? glm::clamp((b * f - c * e) / denom, 0.0f, 1.0f) : 0.0f;
+			t = (b * s + f) / e;
+
+			if (t < 0.0f)
+			{
+				t = 0.0f;
+				s = glm::clamp(-c / a, 0.0f, 1.0f);
+			}
+			else if (t > 1.0f)
+			{
+				t = 1.0f;
+				s = glm::clamp((b - c) / a, 0.0f, 1.0f);
+			}
+		}
+	}
+
+	closest1 = start1 + d1 * s;
+	closest2 = start2 + d2 * t;
+}
+
+bool CollisionSphereVsPlane(const Sphere& sphere, const Plane& plane,
+	std::vector<glm::vec3>& collisionPoints, std::vector<glm::vec3>& collisionNormals)
+{
+	float distance = glm::dot(plane.normal, sphere.position) - plane.dotofPoint;
+
+	if (distance > sphere.radius) return false;
+
+	collisionPoints.push_back(sphere.position - plane.normal * distance);
+	collisionNormals.push_back(plane.normal);
+
+	return true;
+}
+
+bool CollisionAABBVsPlane(const Aabb& aabb, const Plane& plane,
+	std::vector<glm::vec3>& collisionPoints, std::vector<glm::vec3>& collisionNormals)
+{
+	glm::vec3 center = (aabb.min + aabb.max) * 0.5f;
+	glm::vec3 extents = (aabb.max - aabb.min) * 0.5f;
+
+	float distance = glm::dot(plane.normal, center) - plane.dotofPoint;
+
+	if (distance > glm::dot(extents, glm::abs(plane.normal))) return false;
+
+	collisionPoints.push_back(ClosestPtPlaneToAABB(plane, aabb));
+	collisionNormals.push_back(plane.normal);
+
+	return true;
+}
+
+bool CollisionCapsuleVsPlane(const Capsule& capsule, const Plane& plane,
+	std::vector<glm::vec3>& collisionPoints, std::vector<glm::vec3>& collisionNormals)
+{
+	//Both ends can rest on the plane, each one under it is a contact
+	float startDistance = glm::dot(plane.normal, capsule.start) - plane.dotofPoint;
+	float endDistance = glm::dot(plane.normal, capsule.end) - plane.dotofPoint;
+
+	bool collided = false;
+
+	if (startDistance <= capsule.radius)
+	{
+		collisionPoints.push_back(capsule.start - plane.normal * startDistance);
+		collisionNormals.push_back(plane.normal);
+		collided = true;
+	}
+
+	if (endDistance <= capsule.radius)
+	{
+		collisionPoints.push_back(capsule.end - plane.normal * endDistance);
+		collisionNormals.push_back(plane.normal);
+		collided = true;
+	}
+
+	return collided;
+}
+
+bool CollisionSphereVsCapsule(const Sphere& sphere, const Capsule& capsule,
+	std::vector<glm::vec3>& collisionPoints, std::vector<glm::vec3>& collisionNormals)
+{
+	glm::vec3 segmentPoint = ClosestPointOnEdge(capsule.start, capsule.end, sphere.position);
+	glm::vec3 offset = sphere.position - segmentPoint;
+
+	float radius = sphere.radius + capsule.radius;
+
+	if (glm::dot(offset, offset) > radius * radius) return false;
+
+	glm::vec3 normal = ContactNormal(sphere.position, segmentPoint, glm::vec3(0, 1, 0));
+
+	collisionPoints.push_back(segmentPoint + normal * capsule.radius);
+	collisionNormals.push_back(normal);
+
+	return true;
+}
+
+bool CollisionCapsuleVsAABB(const Capsule& capsule, const Aabb& aabb,
+	std::vector<glm::vec3>& collisionPoints, std::vector<glm::vec3>& collisionNormals)
+{
+	// Closest points of the segment and the box by projecting onto each in turn, both are convex
+	// so this converges and a few rounds are close enough for a proxy shape
+
+	glm::vec3 segmentPoint = ClosestPointOnEdge(capsule.start, capsule.end, (aabb.min + aabb.max) * 0.5f);
+	glm::vec3 boxPoint = glm::clamp(segmentPoint, aabb.min, aabb.max);
+
+	for (int i = 0; i < 4; i++)
+	{
+		segmentPoint = ClosestPointOnEdge(capsule.start, capsule.end, boxPoint);
+		boxPoint = glm::clamp(segmentPoint, aabb.min, aabb.max);
+	}
+
+	glm::vec3 offset = segmentPoint - boxPoint;
+
+	if (glm::dot(offset, offset) > capsule.radius * capsule.radius) return false;
+
+	collisionPoints.push_back(boxPoint);
+	collisionNormals.push_back(ContactNormal(segmentPoint, boxPoint, NearestFaceNormal(segmentPoint, aabb)));
+
+	return true;
+}
+
+bool CollisionCapsuleVsCapsule(const Capsule& capsule1, const Capsule& capsule2,
+	std::vector<glm::vec3>& collisionPoints, std::vector<glm::vec3>& collisionNormals)
+{
+	glm::vec3 closest1, closest2;
+	ClosestPointsOnSegments(capsule1.start, capsule1.end, capsule2.start, capsule2.end, closest1, closest2);
+
+	glm::vec3 offset = closest1 - closest2;
+	float radius = capsule1.radius + capsule2.radius;
+
+	if (glm::dot(offset, offset) > radius * radius) return false;
+
+	glm::vec3 normal = ContactNormal(closest1, closest2, glm::vec3(0, 1, 0));
+
+	collisionPoints.push_back(closest2 + normal * capsule2.radius);
+	collisionNormals.push_back(normal);
+
+	return true;
+}
+
+bool CollisionCapsuleVsTriangle(const Capsule& capsule, const Triangle& triangle, glm::vec3& collisionPoint)
+{
+	glm::vec3 faceNormal = glm::cross(triangle.v2 - triangle.v1, triangle.v3 - triangle.v1);
+
+	//Segment passing through the face
+	float startDistance = glm::dot(capsule.start - triangle.v1, faceNormal);
+	float endDistance = glm::dot(capsule.end - triangle.v1, faceNormal);
+
+	if (startDistance * endDistance <= 0.0f && startDistance != endDistance)
+	{
+		glm::vec3 crossing = capsule.start + (capsule.end - capsule.start) * (startDistance / (startDistance - endDistance));
+
+		glm::vec3 closest = ClosestPointOnTriangle(crossing, triangle.v1, triangle.v2, triangle.v3);
+
+		if (glm::dot(crossing - closest, crossing - closest) <= 0.000001f)
+		{
+			collisionPoint = crossing;
+			return true;
+		}
+	}
+
+	//Otherwise the closest pair has a segment end or a triangle edge in it
+	glm::vec3 trianglePoint = ClosestPointOnTriangle(capsule.start, triangle.v1, triangle.v2, triangle.v3);
+	float closestSq = glm::dot(capsule.start - trianglePoint, capsule.start - trianglePoint);
+
+	glm::vec3 candidate = ClosestPointOnTriangle(capsule.end, triangle.v1, triangle.v2, triangle.v3);
+	float candidateSq = glm::dot(capsule.end - candidate, capsule.end - candidate);
+
+	if (candidateSq < closestSq)
+	{
+		closestSq = candidateSq;
+		trianglePoint = candidate;
+	}
+
+	const glm::vec3* vertices[3] = { &triangle.v1, &triangle.v2, &triangle.v3 };
+
+	for (int i = 0; i < 3; i++)
+	{
+		glm::vec3 segmentPoint;
+		ClosestPointsOnSegments(capsule.start, capsule.end, *vertices[i], *vertices[(i + 1) % 3], segmentPoint, candidate);
+
+		candidateSq = glm::dot(segmentPoint - candidate, segmentPoint - candidate);
+
+		if (candidateSq < closestSq)
+		{
+			closestSq = candidateSq;
+			trianglePoint = candidate;
+		}
+	}
+
+	if (closestSq > capsule.radius * capsule.radius) return false;
+
+	collisionPoint = trianglePoint;
+	return true;
+}
+
+bool CollisionCapsuleVsMeshOfTriangles(const Capsule& capsule, const HierarchicalAABB* bvh,
+	const glm::mat4& transformMatrix, const glm::mat4& inverseMatrix, const std::vector<Triangle>& triangles,
+	std::vector<glm::vec3>& collisionPoints, std::vector<glm::vec3>& collisionNormals, std::vector<Aabb>& collisionAabbs)
+{
+	collisionAabbs.clear();
+	std::set<int> triangleIndices;
+
+	CollisionAABBvsHAABB(capsule.GetAABB(), bvh, transformMatrix, inverseMatrix, triangleIndices, collisionAabbs);
+
+	bool collided = false;
+
+	for (int i : triangleIndices)
+	{
+		glm::vec3 collisionPt;
+
+		Triangle transformed;
+		const Triangle& triangle = GetWorldTriangle(bvh, triangles, i, transformMatrix, transformed);
+
+		if (CollisionCapsuleVsTriangle(capsule, triangle, collisionPt))
+		{
+			collisionPoints.push_back(collisionPt);
+			collisionNormals.push_back(triangle.normal);
+			collided = true;
+		}
+	}
+
+	return collided;
+}
+
+bool CollisionPlaneVsMeshOfTriangles(const Plane& plane, const HierarchicalAABB* bvh,
+	const glm::mat4& transformMatrix, const std::vector<Triangle>& triangles,
+	std::vector<glm::vec3>& collisionPoints, std::vector<glm::vec3>& collisionNormals)
+{
+	if (bvh->GetNumOfNodes() == 0) return false;
+
+	bool worldSpace = bvh->HasWorldSpace();
+
+	// Plane in the space of the stored bounds. For x = Ay + t, n.x = d becomes (A^T n).y = d - n.t,
+	// the node test works with the normal unnormalized
+
+	glm::vec3 nodeNormal = worldSpace ? plane.normal : glm::transpose(glm::mat3(transformMatrix)) * plane.normal;
+	float nodeDotOfPoint = worldSpace ? plane.dotofPoint : plane.dotofPoint - glm::dot(plane.normal, glm::vec3(transformMatrix[3]));
+
+	const unsigned int* leafTriangles = bvh->GetTriangleIndices();
+
+	unsigned int stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+
+	unsigned int nodeIndex = 0;
+	bool collided = false;
+
+	while (true)
+	{
+		BvhNode node = bvh->GetQueryNode(nodeIndex);
+
+		glm::vec3 center = (node.min + node.max) * 0.5f;
+		glm::vec3 extents = (node.max - node.min) * 0.5f;
+
+		if (glm::dot(nodeNormal, center) - nodeDotOfPoint <= glm::dot(extents, glm::abs(nodeNormal)))
+		{
+			if (!node.IsLeaf())
+			{
+				stack[stackSize++] = node.offset;
+				nodeIndex++;
+				continue;
+			}
+
+			for (unsigned int i = node.offset; i < node.offset + node.count; i++)
+			{
+				Triangle transformed;
+				const Triangle& triangle = GetWorldTriangle(bvh, triangles, leafTriangles[i], transformMatrix, transformed);
+
+				const glm::vec3* vertices[3] = { &triangle.v1, &triangle.v2, &triangle.v3 };
+
+				for (const glm::vec3* vertex : vertices)
+				{
+					if (glm::dot(plane.normal, *vertex) - plane.dotofPoint > 0.0f) continue;
+
+					collisionPoints.push_back(*vertex);
+					collisionNormals.push_back(plane.normal);
+					collided = true;
+				}
+			}
+		}
+
+		if (stackSize == 0) break;
+
+		nodeIndex = stack[--stackSize];
+	}
+
+	return collided;
+}
+
+bool RayCastPlane(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, float maxDistance,
+	const Plane& plane, float& distance)
+{
+	float approachSpeed = -glm::dot(plane.normal, rayDirection);
+
+	if (approachSpeed <= 0.000001f) return false;
+
+	float originDistance = glm::dot(plane.normal, rayOrigin) - plane.dotofPoint;
+
+	if (originDistance < 0.0f) return false;
+
+	distance = originDistance / approachSpeed;
+
+	return distance <= maxDistance;
+}
+
+bool RayCastCapsule(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, float maxDistance,
+	const Capsule& capsule, float& distance, glm::vec3& normal)
+{
+	if (!RayCastCapsule(rayOrigin, rayDirection, maxDistance, capsule.start, capsule.end, capsule.radius, distance)) return false;
+
+	glm::vec3 point = rayOrigin + rayDirection * distance;
+
+	normal = ContactNormal(point, ClosestPointOnEdge(capsule.start, capsule.end, point), -rayDirection);
+	return true;
+}
+
+bool SweepSphereVsPlane(const Sphere& sphere, const glm::vec3& direction, float maxDistance,
+	const Plane& target, float& distance, glm::vec3& normal)
+{
+	float startDistance = glm::dot(target.normal, sphere.position) - target.dotofPoint;
+
+	normal = target.normal;
+
+	if (startDistance <= sphere.radius)
+	{
+		distance = 0.0f;
+		return true;
+	}
+
+	float approachSpeed = -glm::dot(target.normal, direction);
+
+	if (approachSpeed <= 0.000001f) return false;
+
+	distance = (startDistance - sphere.radius) / approachSpeed;
+
+	return distance <= maxDistance;
+}
+
+bool SweepSphereVsCapsule(const Sphere& sphere, const glm::vec3& direction, float maxDistance,
+	const Capsule& target, float& distance, glm::vec3& normal)
+{
+	Capsule grown(target.start, target.end, target.radius + sphere.radius);
+
+	return RayCastCapsule(sphere.position, direction, maxDistance, grown, distance, normal);
+}
+
+bool SweepAABBVsPlane(const Aabb& box, const glm::vec3& direction, float maxDistance,
+	const Plane& target, float& distance, glm::vec3& normal)
+{
+	//Same as a sphere whose radius is the box extent along the normal
+	glm::vec3 extents = (box.max - box.min) * 0.5f;
+
+	Sphere projected((box.min + box.max) * 0.5f, glm::dot(extents, glm::abs(target.normal)));
+
+	return SweepSphereVsPlane(projected, direction, maxDistance, target, distance, normal);
+}
@@ -6,7 +6,7 @@
 
 #define NOMINMAX
 
-class HierarchicalAABBNode;
+class HierarchicalAABB;
 
 enum PhysicsShape
 {
@@ -118,6 +118,27 @@ struct Plane : iShape
 	float dotofPoint;
 };
 
+//Segment from start to end grown by radius
+struct Capsule : iShape
+{
+	Capsule() {}
+	Capsule(glm::vec3 start, glm::vec3 end, float radius)
+	{
+		this->start = start;
+		this->end = end;
+		this->radius = radius;
+	}
+
+	glm::vec3 start;
+	glm::vec3 end;
+	float radius;
+
+	Aabb GetAABB() const
+	{
+		return Aabb(glm::min(start, end) - glm::vec3(radius), glm::max(start, end) + glm::vec3(radius));
+	}
+};
+
 static const modelAABB& GetGraphicsAabb(const Aabb& aabb)
 {
 	return { aabb.min, aabb.max };
@@ -147,6 +168,25 @@ static Aabb CalculateAABB(const std::vector<Vertex>& vertices)
 	return Aabb{ min, max };
 }
 
+// Bounds of an aabb after the transform, same as transforming the 8 corners
+static Aabb TransformAabb(const glm::vec3& min, const glm::vec3& max, const glm::mat4& transformMatrix)
+{
+	glm::vec3 center = (min + max) * 0.5f;
+	glm::vec3 extents = (max - min) * 0.5f;
+
+	glm::mat3 absMatrix = glm::mat3(transformMatrix);
+
+	for (int i = 0; i < 3; i++)
+	{
+		absMatrix[i] = glm::abs(absMatrix[i]);
+	}
+
+	glm::vec3 transformedCenter = transformMatrix * glm::vec4(center, 1.0f);
+	glm::vec3 transformedExtents = absMatrix * extents;
+
+	return Aabb(transformedCenter - transformedExtents, transformedCenter + transformedExtents);
+}
+
 //static Sphere CalculateSphere(const std::vector<Vertex>& vertices)
 //{
 //    if (vertices.empty()) {
@@ -801,7 +841,7 @@ static bool CollisionTriangleVsTriangle(const Triangle& triangle1, const Triangl
 static bool CollisionSphereVsMeshOfTriangles(Sphere* sphere,
 	const glm::mat4& transformMatrix,
 	const std::vector <Triangle>& triangles,
-	const std::vector<Sphere*>& triangleSpheres,
+	const std::vector<Sphere>& triangleSpheres,
 	std::vector<glm::vec3>& collisionPoints,
 	std::vector<glm::vec3>& collisionNormals)
 {
@@ -816,11 +856,11 @@ static bool CollisionSphereVsMeshOfTriangles(Sphere* sphere,
 		Triangle triangle = triangles[i];
 
 		// Transform the sphere's position using the transformMatrix
-		glm::vec4 transformedCenter = transformMatrix * glm::vec4(triangleSpheres[i]->position, 1.0f);
+		glm::vec4 transformedCenter = transformMatrix * glm::vec4(triangleSpheres[i].position, 1.0f);
 		sphereTriangle->position = glm::vec3(transformedCenter);
 
 		// Transform the sphere's radius based on scaling
-		sphereTriangle->radius = triangleSpheres[i]->radius * maxScale;
+		sphereTriangle->radius = triangleSpheres[i].radius * maxScale;
 
 		// Now you can check for collision between the transformed sphere and sphereTriangle
 		std::vector<glm::vec3> collisionPoint;
@@ -854,19 +894,29 @@ static bool CollisionSphereVsMeshOfTriangles(Sphere* sphere,
 	return false;
 }
 
-extern  void CollisionAABBvsHAABB(const Aabb& sphereAabb, 
-	HierarchicalAABBNode* rootNode, std::set<int>& triangleIndices, std::vector<Aabb>& collisionAabbs);
+// The query volume is taken into mesh space with inverseMatrix, collisionAabbs gets the world bounds of the leaves it reached
+extern  void CollisionAABBvsHAABB(const Aabb& sphereAabb, const HierarchicalAABB* bvh,
+	const glm::mat4& transformMatrix, const glm::mat4& inverseMatrix,
+	std::set<int>& triangleIndices, std::vector<Aabb>& collisionAabbs);
 
-extern  bool CollisionSphereVsMeshOfTriangles(const Aabb& sphereAabb, Sphere* sphere, HierarchicalAABBNode* rootNode,
-	const glm::mat4 transformMatrix, const std::vector <Triangle>& triangles,
+extern  bool CollisionSphereVsMeshOfTriangles(const Aabb& sphereAabb, Sphere* sphere, const HierarchicalAABB* bvh,
+	const glm::mat4 transformMatrix, const glm::mat4& inverseMatrix, const std::vector <Triangle>& triangles,
 	std::vector<glm::vec3>& collisionPoints,
 	std::vector<glm::vec3>& collisionNormals,
 	std::vector<Aabb>& collisionAabbs);
 
+// Batched version for many spheres (e.g. soft body nodes) against one mesh, the tree is walked once for all of them.
+// Contacts are returned grouped by sphere, collisionSphereIndices[i] is the sphere of collisionPoints[i]
+extern bool CollisionSpheresVsMeshOfTriangles(const std::vector<Sphere>& spheres, const HierarchicalAABB* bvh,
+	const glm::mat4 transformMatrix, const glm::mat4& inverseMatrix, const std::vector <Triangle>& triangles,
+	std::vector<int>& collisionSphereIndices,
+	std::vector<glm::vec3>& collisionPoints,
+	std::vector<glm::vec3>& collisionNormals);
+
 static bool CollisionAABBVsMeshOfTriangles(const Aabb& aabb,
 	const glm::mat4& transformMatrix,
 	const std::vector <Triangle>& triangles,
-	const std::vector<Sphere*>& triangleSpheres,
+	const std::vector<Sphere>& triangleSpheres,
 	std::vector<glm::vec3>& collisionPoints,
 	std::vector<glm::vec3>& collisionNormals)
 {
@@ -882,11 +932,11 @@ static bool CollisionAABBVsMeshOfTriangles(const Aabb& aabb,
 		Triangle triangle = triangles[i];
 
 		// Transform the sphere's position using the transformMatrix
-		glm::vec4 transformedCenter = transformMatrix * glm::vec4(triangleSpheres[i]->position, 1.0f);
+		glm::vec4 transformedCenter = transformMatrix * glm::vec4(triangleSpheres[i].position, 1.0f);
 		sphereTriangle->position = glm::vec3(transformedCenter);
 
 		// Transform the sphere's radius based on scaling
-		sphereTriangle->radius = triangleSpheres[i]->radius * maxScale;
+		sphereTriangle->radius = triangleSpheres[i].radius * maxScale;
 
 		// Now you can check for collision between the transformed sphere and sphereTriangle
 		std::vector<glm::vec3> collisionPoint;
@@ -923,14 +973,14 @@ static bool CollisionAABBVsMeshOfTriangles(const Aabb& aabb,
 	return false;
 }
 
-extern bool CollisionAABBVsMeshOfTriangles(const Aabb& aabb, HierarchicalAABBNode* rootNode,
-	const glm::mat4 transformMatrix, const std::vector <Triangle>& triangles,
+extern bool CollisionAABBVsMeshOfTriangles(const Aabb& aabb, const HierarchicalAABB* bvh,
+	const glm::mat4 transformMatrix, const glm::mat4& inverseMatrix, const std::vector <Triangle>& triangles,
 	std::vector<glm::vec3>& collisionPoints,
 	std::vector<glm::vec3>& collisionNormals,
 	std::vector<Aabb>& collisionAabbs);
 
-extern bool CollisionMeshVsMesh(HierarchicalAABBNode* mesh1, HierarchicalAABBNode* mesh2,
-	const glm::mat4 transformMatrix1, const glm::mat4 transformMatrix2,
+extern bool CollisionMeshVsMesh(const HierarchicalAABB* mesh1, const HierarchicalAABB* mesh2,
+	const glm::mat4 transformMatrix1, const glm::mat4 transformMatrix2, const glm::mat4& inverseMatrix1,
 	const std::vector <Triangle>& triangles1, const std::vector <Triangle>& triangles2,
 	std::vector<glm::vec3>& collisionPoints,
 	std::vector<glm::vec3>& collisionNormals);
@@ -1061,6 +1111,7 @@ static bool RayCastTriangle(const glm::vec3& rayOrigin, glm::vec3& rayDirection,
 	return false;
 }
 
+//Brute force closest hit, for meshes without a bvh
 static bool RayCastMesh(const glm::vec3& rayOrigin, glm::vec3& rayDirection,
 	const glm::mat4& transformMatrix, const float& maxDistance,
 	const std::vector <Triangle>& triangles,
@@ -1068,6 +1119,9 @@ static bool RayCastMesh(const glm::vec3& rayOrigin, glm::vec3& rayDirection,
 {
 	rayDirection = glm::normalize(rayDirection);
 
+	float closestDistance = maxDistance;
+	bool hit = false;
+
 	for (size_t i = 0; i < triangles.size(); i++)
 	{
 		Triangle triangle = triangles[i];
@@ -1075,36 +1129,196 @@ static bool RayCastMesh(const glm::vec3& rayOrigin, glm::vec3& rayDirection,
 		triangle.v2 = transformMatrix * glm::vec4(triangle.v2, 1.0f);
 		triangle.v3 = transformMatrix * glm::vec4(triangle.v3, 1.0f);
 
-		if (RayCastTriangle(rayOrigin, rayDirection, maxDistance, triangle, collisionPt, collisionNr))
+		glm::vec3 trianglePt;
+
+		if (RayCastTriangle(rayOrigin, rayDirection, closestDistance, triangle, trianglePt, collisionNr))
 		{
-			collisionNr = transformMatrix * glm::vec4(triangle.normal, 0.0f);
-			return true;
+			collisionPt = trianglePt;
+			collisionNr = glm::normalize(glm::vec3(transformMatrix * glm::vec4(triangle.normal, 0.0f)));
+			closestDistance = glm::distance(rayOrigin, trianglePt);
+			hit = true;
 		}
 	}
 
-	return false;
+	return hit;
 }
 
-static bool CollisionTriangleVsTriangle(const Triangle& t1, const Triangle& t2)
+struct RayHit
 {
-	glm::vec3 unusedIntersectionPoint;
-	glm::vec3 dummyCollisionNormal;
-
-	glm::vec3 temp1 = glm::normalize(t1.v2 - t1.v1);
-	glm::vec3 temp2 = glm::normalize(t1.v3 - t1.v2);
-	glm::vec3 temp3 = glm::normalize(t1.v1 - t1.v3);
-	glm::vec3 temp4 = glm::normalize(t2.v2 - t2.v1);
-	glm::vec3 temp5 = glm::normalize(t2.v3 - t2.v2);
-	glm::vec3 temp6 = glm::normalize(t2.v1 - t2.v3);
-
-	if (RayCastTriangle(t1.v1, temp1, std::numeric_limits<float>::max(), t2, unusedIntersectionPoint, dummyCollisionNormal) ||
-		RayCastTriangle(t1.v2, temp2, std::numeric_limits<float>::max(), t2, unusedIntersectionPoint, dummyCollisionNormal) ||
-		RayCastTriangle(t1.v3, temp3, std::numeric_limits<float>::max(), t2, unusedIntersectionPoint, dummyCollisionNormal) ||
-		RayCastTriangle(t2.v1, temp4, std::numeric_limits<float>::max(), t1, unusedIntersectionPoint, dummyCollisionNormal) ||
-		RayCastTriangle(t2.v2, temp5, std::numeric_limits<float>::max(), t1, unusedIntersectionPoint, dummyCollisionNormal) ||
-		RayCastTriangle(t2.v3, temp6, std::numeric_limits<float>::max(), t1, unusedIntersectionPoint, dummyCollisionNormal)) {
-		return true;
+	float distance = 0;
+	glm::vec3 point = glm::vec3(0);
+	glm::vec3 normal = glm::vec3(0);
+	int triangleIndex = -1;
+	glm::vec3 barycentrics = glm::vec3(0);		//Weights of v1, v2 and v3 at the hit point
+};
+
+//Closest hit through the bvh, nodes are visited front to back and skipped once they start past the current hit
+extern bool RayCastMesh(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, const HierarchicalAABB* bvh,
+	const glm::mat4& transformMatrix, const glm::mat4& inverseMatrix, float maxDistance,
+	const std::vector <Triangle>& triangles, RayHit& hit);
+
+struct Ray
+{
+	glm::vec3 origin = glm::vec3(0);
+	glm::vec3 direction = glm::vec3(0, 0, 1);
+	float maxDistance = std::numeric_limits<float>::max();
+};
+
+static const int RAY_PACKET_SIZE = 4;
+
+//Traces the rays RAY_PACKET_SIZE at a time with SSE, each packet shares one walk of the bvh.
+//hits needs numOfRays entries, rays that miss get triangleIndex -1. Returns the number of rays that hit
+extern int RayCastMeshBatch(const Ray* rays, int numOfRays, const HierarchicalAABB* bvh,
+	const glm::mat4& transformMatrix, const glm::mat4& inverseMatrix,
+	const std::vector <Triangle>& triangles, RayHit* hits);
+
+static const int SPHERE_BATCH_WIDTH = 4;
+
+//Sphere centers and radii as separate arrays, padded to a multiple of SPHERE_BATCH_WIDTH
+//so the batch kernels load four spheres at once
+struct SphereBatch
+{
+	std::vector<float> positionX, positionY, positionZ, radius;
+	int count = 0;
+
+	void Resize(int numOfSpheres)
+	{
+		count = numOfSpheres;
+
+		size_t padded = (size_t)((numOfSpheres + SPHERE_BATCH_WIDTH - 1) / SPHERE_BATCH_WIDTH) * SPHERE_BATCH_WIDTH;
+
+		positionX.assign(padded, 0.0f);
+		positionY.assign(padded, 0.0f);
+		positionZ.assign(padded, 0.0f);
+		radius.assign(padded, 0.0f);
 	}
 
-	return false;
-}
\ No newline at end of file
+	void Set(int index, const glm::vec3& position, float sphereRadius)
+	{
+		positionX[index] = position.x;
+		positionY[index] = position.y;
+		positionZ[index] = position.z;
+		radius[index] = sphereRadius;
+	}
+
+	size_t GetMemoryUsage() const
+	{
+		return (positionX.capacity() + positionY.capacity() + positionZ.capacity() + radius.capacity()) * sizeof(float);
+	}
+};
+
+//Results of a batch test, one entry per sphere. Bit i of hitMasks[group] is set when sphere
+//group * SPHERE_BATCH_WIDTH + i overlaps. normal points from the target to the sphere and depth
+//is how far the sphere is inside, both only meaningful for lanes that hit
+struct SphereBatchContacts
+{
+	std::vector<unsigned char> hitMasks;
+	std::vector<float> normalX, normalY, normalZ, depth;
+
+	bool IsHit(int index) const
+	{
+		return (hitMasks[index / SPHERE_BATCH_WIDTH] >> (index % SPHERE_BATCH_WIDTH)) & 1;
+	}
+
+	glm::vec3 GetNormal(int index) const
+	{
+		return glm::vec3(normalX[index], normalY[index], normalZ[index]);
+	}
+
+	size_t GetMemoryUsage() const
+	{
+		return hitMasks.capacity() + (normalX.capacity() + normalY.capacity() + normalZ.capacity() +
+			depth.capacity()) * sizeof(float);
+	}
+};
+
+//Every sphere of the batch against one target, SPHERE_BATCH_WIDTH spheres per SSE pass.
+//Returns the number of spheres that overlap
+extern int CollisionSpheresVsAABB(const SphereBatch& spheres, const Aabb& aabb, SphereBatchContacts& contacts);
+extern int CollisionSpheresVsSphere(const SphereBatch& spheres, const Sphere& sphere, SphereBatchContacts& contacts);
+
+//Milliseconds spent by the one pair tests and by the batch kernel on the same spheres, numOfRepeats runs each
+struct BatchCollisionTimings
+{
+	int numOfSpheres = 0;
+	int numOfRepeats = 0;
+	int scalarHits = 0;
+	int batchHits = 0;
+	float scalarTime = 0;
+	float batchTime = 0;
+};
+
+extern BatchCollisionTimings BenchmarkSpheresVsAABB(const SphereBatch& spheres, const Aabb& aabb, int numOfRepeats);
+extern BatchCollisionTimings BenchmarkSpheresVsSphere(const SphereBatch& spheres, const Sphere& sphere, int numOfRepeats);
+
+// Sweeps move a shape from its start along a normalized direction. distance is how far it travels
+// before first touching the target, 0 when it already overlaps at the start. normal points from the
+// target towards the moving shape.
+
+extern bool RayCastCapsule(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, float maxDistance,
+	const glm::vec3& capsuleStart, const glm::vec3& capsuleEnd, float radius, float& distance);
+
+extern bool SweepSphereVsSphere(const Sphere& sphere, const glm::vec3& direction, float maxDistance,
+	const Sphere& target, float& distance, glm::vec3& normal);
+extern bool SweepSphereVsAABB(const Sphere& sphere, const glm::vec3& direction, float maxDistance,
+	const Aabb& target, float& distance, glm::vec3& normal);
+extern bool SweepSphereVsTriangle(const Sphere& sphere, const glm::vec3& direction, float maxDistance,
+	const Triangle& target, float& distance, glm::vec3& normal);
+
+extern bool SweepAABBVsAABB(const Aabb& box, const glm::vec3& direction, float maxDistance,
+	const Aabb& target, float& distance, glm::vec3& normal);
+extern bool SweepAABBVsTriangle(const Aabb& box, const glm::vec3& direction, float maxDistance,
+	const Triangle& target, float& distance, glm::vec3& normal);
+
+//Only triangles under the bvh leaves the swept bounds reach are tested
+extern bool SweepSphereVsMesh(const Sphere& sphere, const glm::vec3& direction, float maxDistance,
+	const HierarchicalAABB* bvh, const glm::mat4& transformMatrix, const glm::mat4& inverseMatrix,
+	const std::vector <Triangle>& triangles, RayHit& hit);
+extern bool SweepAABBVsMesh(const Aabb& box, const glm::vec3& direction, float maxDistance,
+	const HierarchicalAABB* bvh, const glm::mat4& transformMatrix, const glm::mat4& inverseMatrix,
+	const std::vector <Triangle>& triangles, RayHit& hit);
+
+//Separating axis test over the face normals, edge pairs and in plane edge normals.
+//On overlap the contact point is the average of the points where each triangle's edges cross the other
+extern bool CollisionTriangleVsTriangleSAT(const Triangle& t1, const Triangle& t2, glm::vec3& contactPoint);
+
+// Planes are solid half spaces, everything behind the normal collides. Contact normals push the
+// first shape away from the second one.
+
+extern bool CollisionSphereVsPlane(const Sphere& sphere, const Plane& plane,
+	std::vector<glm::vec3>& collisionPoints, std::vector<glm::vec3>& collisionNormals);
+extern bool CollisionAABBVsPlane(const Aabb& aabb, const Plane& plane,
+	std::vector<glm::vec3>& collisionPoints, std::vector<glm::vec3>& collisionNormals);
+extern bool CollisionCapsuleVsPlane(const Capsule& capsule, const Plane& plane,
+	std::vector<glm::vec3>& collisionPoints, std::vector<glm::vec3>& collisionNormals);
+
+extern bool CollisionSphereVsCapsule(const Sphere& sphere, const Capsule& capsule,
+	std::vector<glm::vec3>& collisionPoints, std::vector<glm::vec3>& collisionNormals);
+extern bool CollisionCapsuleVsAABB(const Capsule& capsule, const Aabb& aabb,
+	std::vector<glm::vec3>& collisionPoints, std::vector<glm::vec3>& collisionNormals);
+extern bool CollisionCapsuleVsCapsule(const Capsule& capsule1, const Capsule& capsule2,
+	std::vector<glm::vec3>& collisionPoints, std::vector<glm::vec3>& collisionNormals);
+extern bool CollisionCapsuleVsTriangle(const Capsule& capsule, const Triangle& triangle, glm::vec3& collisionPoint);
+
+//Mesh contacts use the triangle normals like the other mesh tests
+extern bool CollisionCapsuleVsMeshOfTriangles(const Capsule& capsule, const HierarchicalAABB* bvh,
+	const glm::mat4& transformMatrix, const glm::mat4& inverseMatrix, const std::vector<Triangle>& triangles,
+	std::vector<glm::vec3>& collisionPoints, std::vector<glm::vec3>& collisionNormals, std::vector<Aabb>& collisionAabbs);
+//Skips bvh nodes entirely in front of the plane, the mesh vertices behind it are the contacts
+extern bool CollisionPlaneVsMeshOfTriangles(const Plane& plane, const HierarchicalAABB* bvh,
+	const glm::mat4& transformMatrix, const std::vector<Triangle>& triangles,
+	std::vector<glm::vec3>& collisionPoints, std::vector<glm::vec3>& collisionNormals);
+
+//Only the front face is hit, rays starting behind the plane pass through
+extern bool RayCastPlane(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, float maxDistance,
+	const Plane& plane, float& distance);
+//RayCastCapsule with the surface normal at the hit
+extern bool RayCastCapsule(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, float maxDistance,
+	const Capsule& capsule, float& distance, glm::vec3& normal);
+
+extern bool SweepSphereVsPlane(const Sphere& sphere, const glm::vec3& direction, float maxDistance,
+	const Plane& target, float& distance, glm::vec3& normal);
+extern bool SweepSphereVsCapsule(const Sphere& sphere, const glm::vec3& direction, float maxDistance,
+	const Capsule& target, float& distance, glm::vec3& normal);
+extern bool SweepAABBVsPlane(const Aabb& box, const glm::vec3& direction, float maxDistance,
+	const Plane& target, float& distance, glm::vec3& normal);
@@ -2,6 +2,108 @@
 #include <Graphics/Renderer.h>
 #include <Graphics/Panels/ImguiDrawUtils.h>
 
+#include <queue>
+#include <pmmintrin.h>
+
+unsigned int BaseSoftBody::NodeArrays::Add(const glm::vec3& position, bool locked)
+{
+	unsigned int index = count++;
+
+	// Grow by a whole batch, the new padding lanes are locked so the integration pass leaves them alone
+	if ((size_t)count > positionX.size())
+	{
+		size_t padded = positionX.size() + NODE_BATCH_WIDTH;
+
+		for (std::vector<float>* values : { &positionX, &positionY, &positionZ, &oldPositionX, &oldPositionY,
+			&oldPositionZ, &velocityX, &velocityY, &velocityZ, &applyGravity, &isColliding })
+		{
+			values->resize(padded, 0.0f);
+		}
+
+		isLocked.resize(padded, 1.0f);
+	}
+
+	positionX[index] = oldPositionX[index] = position.x;
+	positionY[index] = oldPositionY[index] = position.y;
+	positionZ[index] = oldPositionZ[index] = position.z;
+	velocityX[index] = velocityY[index] = velocityZ[index] = 0.0f;
+
+	isLocked[index] = locked ? 1.0f : 0.0f;
+	applyGravity[index] = 1.0f;
+	isColliding[index] = 0.0f;
+
+	return index;
+}
+
+void BaseSoftBody::NodeArrays::Clear()
+{
+	for (std::vector<float>* values : { &positionX, &positionY, &positionZ, &oldPositionX, &oldPositionY,
+		&oldPositionZ, &velocityX, &velocityY, &velocityZ, &isLocked, &applyGravity, &isColliding })
+	{
+		values->clear();
+	}
+
+	count = 0;
+}
+
+size_t BaseSoftBody::NodeArrays::GetMemoryUsage() const
+{
+	size_t bytes = 0;
+
+	for (const std::vector<float>* values : { &positionX, &positionY, &positionZ, &oldPositionX, &oldPositionY,
+		&oldPositionZ, &velocityX, &velocityY, &velocityZ, &isLocked, &applyGravity, &isColliding })
+	{
+		bytes += values->capacity() * sizeof(float);
+	}
+
+	return bytes;
+}
+
+static __m128 SelectLanes(__m128 mask, __m128 a, __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+//Gravity and clamp for one axis of four nodes, only the free lanes change
+static __m128 StepVelocity(float* velocity, __m128 gravityStep, __m128 gravityScale, __m128 maxVelocity, __m128 free)
+{
+	__m128 oldVelocity = _mm_loadu_ps(velocity);
+	__m128 newVelocity = _mm_add_ps(oldVelocity, _mm_mul_ps(gravityStep, gravityScale));
+
+	newVelocity = _mm_min_ps(_mm_max_ps(newVelocity, _mm_sub_ps(_mm_setzero_ps(), maxVelocity)), maxVelocity);
+	newVelocity = SelectLanes(free, newVelocity, oldVelocity);
+
+	_mm_storeu_ps(velocity, newVelocity);
+
+	return newVelocity;
+}
+
+//Verlet step for one axis of four nodes, colliding nodes move by their velocity instead.
+//Returns the squared displacement of the free lanes along the axis
+static __m128 StepPosition(float* position, float* oldPosition, __m128 velocity, __m128 deltaTime,
+	__m128 deltaTimeSq, __m128 free, __m128 colliding)
+{
+	__m128 current = _mm_loadu_ps(position);
+	__m128 old = _mm_loadu_ps(oldPosition);
+	__m128 displacement = _mm_sub_ps(current, old);
+
+	__m128 verlet = _mm_add_ps(_mm_add_ps(current, displacement), _mm_mul_ps(velocity, deltaTimeSq));
+	__m128 explicitStep = _mm_add_ps(current, _mm_mul_ps(velocity, deltaTime));
+
+	_mm_storeu_ps(position, SelectLanes(free, SelectLanes(colliding, explicitStep, verlet), current));
+	_mm_storeu_ps(oldPosition, SelectLanes(free, current, old));
+
+	return _mm_and_ps(free, _mm_mul_ps(displacement, displacement));
+}
+
+static float GetMaxLane(__m128 value)
+{
+	float lanes[BaseSoftBody::NODE_BATCH_WIDTH];
+	_mm_storeu_ps(lanes, value);
+
+	return glm::max(glm::max(lanes[0], lanes[1]), glm::max(lanes[2], lanes[3]));
+}
+
 void BaseSoftBody::CleanZeros(glm::vec3& value)
 {
 	const float minFloat = 1.192092896e-07f;
@@ -24,18 +126,21 @@ void BaseSoftBody::Render()
 {
 	if (!showDebugModels) return;
 
+	//Tearing adds nodes on the physics thread, which can move the node arrays
+	if (mCriticalSection != nullptr) EnterCriticalSection(mCriticalSection);
+
 	for (Node* node : mListOfNodes)
 	{
-		Renderer::GetInstance().DrawSphere(node->mCurrentPosition, node->mRadius, nodeColor);
+		Renderer::GetInstance().DrawSphere(node->GetPosition(), node->mRadius, nodeColor);
 	}
 
 
 	for (Stick* stick : mListOfSticks)
 	{
-		if (!stick->isConnected) continue;
-
-		Renderer::GetInstance().DrawLine(stick->mNodeA->mCurrentPosition, stick->mNodeB->mCurrentPosition, stickColor);
+		Renderer::GetInstance().DrawLine(stick->mNodeA->GetPosition(), stick->mNodeB->GetPosition(), stickColor);
 	}
+
+	if (mCriticalSection != nullptr) LeaveCriticalSection(mCriticalSection);
 }
 
 void BaseSoftBody::AddCollidersToCheck(PhysicsObject* phyObj)
@@ -48,9 +153,269 @@ void BaseSoftBody::SetNodeRadius(int index, float radius)
 	mListOfNodes[index]->mRadius = radius;
 }
 
+void BaseSoftBody::SetNodeApplyGravity(int index, bool applyGravity)
+{
+	mListOfNodes[index]->SetApplyGravity(applyGravity);
+}
+
+bool BaseSoftBody::ShouldApplyGravity(Node* node)
+{
+	return node->ShouldApplyGravity();
+}
+
+void BaseSoftBody::UpdateGravityFlags()
+{
+	// Nothing to do unless mListOfNonGravityNodes was changed since the last step
+
+	if (mListOfNonGravityNodes == mListOfAppliedNonGravityNodes) return;
+
+	for (Node* node : mListOfAppliedNonGravityNodes)
+	{
+		node->SetApplyGravity(true);
+	}
+
+	for (Node* node : mListOfNonGravityNodes)
+	{
+		node->SetApplyGravity(false);
+	}
+
+	mListOfAppliedNonGravityNodes = mListOfNonGravityNodes;
+}
+
 void BaseSoftBody::DisconnectStick(Stick* stick)
 {
+	if (!stick->isConnected) return;
+
+	if (mCriticalSection != nullptr) EnterCriticalSection(mCriticalSection);
+
 	stick->isConnected = false;
+	mListOfSticksToRemove.push_back(stick);
+
+	if (mCriticalSection != nullptr) LeaveCriticalSection(mCriticalSection);
+}
+
+void BaseSoftBody::ReleaseTopology()
+{
+	if (mCriticalSection != nullptr) EnterCriticalSection(mCriticalSection);
+
+	mListOfNodes.clear();
+	mListOfSticks.clear();
+	mListOfDisconnectedSticks.clear();
+	mListOfSticksToRemove.clear();
+	mListOfTethers.clear();
+	mListOfNonGravityNodes.clear();
+	mListOfAppliedNonGravityNodes.clear();
+
+	mStickPool.Release();
+	mNodePool.Release();
+	mNodeArrays.Clear();
+
+	if (mCriticalSection != nullptr) LeaveCriticalSection(mCriticalSection);
+}
+
+BaseSoftBody::Node* BaseSoftBody::AddNode(const glm::vec3& position, float radius, bool isLocked)
+{
+	Node* node = mNodePool.Create(&mNodeArrays, mNodeArrays.Add(position, isLocked), radius);
+
+	mListOfNodes.push_back(node);
+
+	return node;
+}
+
+BaseSoftBody::Stick* BaseSoftBody::AddStick(Node* nodeA, Node* nodeB, int triangleIndex)
+{
+	Stick* stick = mStickPool.Create(nodeA, nodeB);
+	stick->mActiveIndex = mListOfSticks.size();
+	stick->mTriangleIndex = triangleIndex;
+
+	mListOfSticks.push_back(stick);
+
+	return stick;
+}
+
+void BaseSoftBody::SetupTethers()
+{
+	// Multi source Dijkstra over the rest lengths of the sticks, starting from every
+	// locked node, gives each free node its nearest anchor and the geodesic distance to it.
+
+	mListOfTethers.clear();
+
+	if (mListOfNodes.empty()) return;
+
+	const float infinity = std::numeric_limits<float>::max();
+
+	std::vector<float> distances(mListOfNodes.size(), infinity);
+	std::vector<Node*> anchors(mListOfNodes.size(), nullptr);
+
+	typedef std::pair<float, size_t> QueueEntry;
+	std::priority_queue<QueueEntry, std::vector<QueueEntry>, std::greater<QueueEntry>> queue;
+
+	for (size_t i = 0; i < mListOfNodes.size(); i++)
+	{
+		if (!mListOfNodes[i]->IsLocked()) continue;
+
+		distances[i] = 0;
+		anchors[i] = mListOfNodes[i];
+		queue.push({ 0.0f, i });
+	}
+
+	while (!queue.empty())
+	{
+		QueueEntry entry = queue.top();
+		queue.pop();
+
+		if (entry.first > distances[entry.second]) continue;
+
+		Node* node = mListOfNodes[entry.second];
+
+		for (Stick* stick : node->mListOfConnectedSticks)
+		{
+			Node* otherNode = stick->mNodeA == node ? stick->mNodeB : stick->mNodeA;
+			size_t otherIndex = otherNode->mIndex;
+
+			float distance = entry.first + stick->mRestLength;
+
+			if (distance >= distances[otherIndex]) continue;
+
+			distances[otherIndex] = distance;
+			anchors[otherIndex] = anchors[entry.second];
+			queue.push({ distance, otherIndex });
+		}
+	}
+
+	for (size_t i = 0; i < mListOfNodes.size(); i++)
+	{
+		Node* node = mListOfNodes[i];
+
+		if (node->IsLocked() || anchors[i] == nullptr) continue;
+
+		mListOfTethers.push_back({ node, anchors[i], distances[i] });
+	}
+}
+
+void BaseSoftBody::SatisfyTethers()
+{
+	if (!mUseTethers) return;
+
+	for (Tether& tether : mListOfTethers)
+	{
+		Node* node = tether.mNode;
+
+		if (node->IsLocked() || node->IsColliding()) continue;
+
+		glm::vec3 anchorPosition = tether.mAnchor->GetPosition();
+		glm::vec3 delta = node->GetPosition() - anchorPosition;
+		float sqLength = glm::dot(delta, delta);
+
+		// Unilateral, only pulls back when stretched past the rest distance
+		if (sqLength <= tether.mMaxLength * tether.mMaxLength) continue;
+
+		node->SetPosition(anchorPosition + delta * (tether.mMaxLength / glm::sqrt(sqLength)));
+	}
+}
+
+static void RemoveStickFromNode(BaseSoftBody::Node* node, BaseSoftBody::Stick* stick)
+{
+	std::vector<BaseSoftBody::Stick*>& sticks = node->mListOfConnectedSticks;
+
+	for (size_t i = 0; i < sticks.size(); i++)
+	{
+		if (sticks[i] != stick) continue;
+
+		sticks[i] = sticks.back();
+		sticks.pop_back();
+		return;
+	}
+}
+
+void BaseSoftBody::RemoveDisconnectedSticks()
+{
+	// Sticks are only unlinked here, on the physics thread between steps, so the
+	// constraint loops never see the list change underneath them.
+
+	EnterCriticalSection(mCriticalSection);
+
+	//DisconnectStick pushes from other threads under the same lock
+	if (mListOfSticksToRemove.empty())
+	{
+		LeaveCriticalSection(mCriticalSection);
+		return;
+	}
+
+	for (size_t i = 0; i < mListOfSticksToRemove.size(); i++)
+	{
+		Stick* stick = mListOfSticksToRemove[i];
+
+		Stick* lastStick = mListOfSticks.back();
+		mListOfSticks[stick->mActiveIndex] = lastStick;
+		lastStick->mActiveIndex = stick->mActiveIndex;
+		mListOfSticks.pop_back();
+
+		RemoveStickFromNode(stick->mNodeA, stick);
+		RemoveStickFromNode(stick->mNodeB, stick);
+
+		mListOfDisconnectedSticks.push_back(stick);
+
+		// May queue more sticks (e.g. the twin edge of the neighbouring triangle)
+		OnStickRemoved(stick);
+	}
+
+	mListOfSticksToRemove.clear();
+
+	LeaveCriticalSection(mCriticalSection);
+
+	// Torn pieces must not stay tethered to anchors they are no longer connected to.
+	// Tethers and topology only change on this thread, so this runs outside the lock.
+	if (!mListOfTethers.empty())
+	{
+		RemoveUnreachableTethers();
+	}
+}
+
+static unsigned int FindRoot(std::vector<unsigned int>& parents, unsigned int index)
+{
+	while (parents[index] != index)
+	{
+		parents[index] = parents[parents[index]];
+		index = parents[index];
+	}
+
+	return index;
+}
+
+void BaseSoftBody::RemoveUnreachableTethers()
+{
+	// Union find over the connected sticks, a tether stays while its node and anchor share a piece.
+	// Kept tethers keep their rest distance, a tear can only make the real path longer.
+
+	std::vector<unsigned int> parents(mListOfNodes.size());
+
+	for (unsigned int i = 0; i < parents.size(); i++)
+	{
+		parents[i] = i;
+	}
+
+	for (Stick* stick : mListOfSticks)
+	{
+		unsigned int rootA = FindRoot(parents, stick->mNodeA->mIndex);
+		unsigned int rootB = FindRoot(parents, stick->mNodeB->mIndex);
+
+		if (rootA != rootB) parents[rootA] = rootB;
+	}
+
+	for (size_t i = 0; i < mListOfTethers.size(); )
+	{
+		Tether& tether = mListOfTethers[i];
+
+		if (FindRoot(parents, tether.mNode->mIndex) == FindRoot(parents, tether.mAnchor->mIndex))
+		{
+			i++;
+			continue;
+		}
+
+		mListOfTethers[i] = mListOfTethers.back();
+		mListOfTethers.pop_back();
+	}
 }
 
 void BaseSoftBody::OnPropertyDraw()
@@ -64,116 +429,211 @@ void BaseSoftBody::OnPropertyDraw()
 
 	ImGuiUtils::DrawBool("ShowDebug", showDebugModels);
 	ImGuiUtils::DrawFloat("BounceFactor", mBounceFactor);
+	ImGuiUtils::DrawBool("AdaptiveIterations", mUseAdaptiveIterations);
+	ImGuiUtils::DrawFloat("ResidualTolerance", mResidualTolerance);
+
+	ImGui::Text("Iterations : %u", mLastNumOfIterations);
+	ImGui::Text("Residual : %f", mLastResidual);
+	ImGui::Text("Memory : %.1f KB", GetMemoryUsage() / 1024.0f);
+
+	if (ImGui::Button("Benchmark Batch Collision"))
+	{
+		RunBatchCollisionBenchmark();
+	}
+
+	for (std::pair<std::string, BatchCollisionTimings>& timings : mListOfBatchTimings)
+	{
+		ImGui::Text("%s : Scalar %.3f ms, Batch %.3f ms", timings.first.c_str(),
+			timings.second.scalarTime, timings.second.batchTime);
+	}
 
 	ImGui::TreePop();
 
 }
 
-bool BaseSoftBody::ShouldApplyGravity(Node* node)
+void BaseSoftBody::RunBatchCollisionBenchmark(int numOfRepeats)
 {
-	for (Node* noGravNode : mListOfNonGravityNodes)
+	SphereBatch spheres;
+
+	// Copy the node spheres, the physics thread keeps moving the nodes
+	if (mCriticalSection != nullptr) EnterCriticalSection(mCriticalSection);
+
+	spheres.Resize((int)mListOfNodes.size());
+
+	for (int i = 0; i < (int)mListOfNodes.size(); i++)
 	{
-		if (node == noGravNode)
+		spheres.Set(i, mListOfNodes[i]->GetPosition(), mListOfNodes[i]->mRadius);
+	}
+
+	if (mCriticalSection != nullptr) LeaveCriticalSection(mCriticalSection);
+
+	mListOfBatchTimings.clear();
+
+	for (PhysicsObject* phyObj : mListOfCollidersToCheck)
+	{
+		BatchCollisionTimings timings;
+
+		if (phyObj->shape == SPHERE)
+		{
+			timings = BenchmarkSpheresVsSphere(spheres, *(Sphere*)phyObj->transformedPhysicsShape, numOfRepeats);
+		}
+		else if (phyObj->shape == AABB)
 		{
-			return false;
+			timings = BenchmarkSpheresVsAABB(spheres, phyObj->GetModelAABB(), numOfRepeats);
 		}
+		else
+		{
+			continue;
+		}
+
+		Debugger::Print("Batch collision scalar ms : " + phyObj->name, timings.scalarTime);
+		Debugger::Print("Batch collision batch ms : " + phyObj->name, timings.batchTime);
+
+		mListOfBatchTimings.push_back({ phyObj->name, timings });
+	}
+}
+
+size_t BaseSoftBody::GetMemoryUsage()
+{
+	size_t bytes = mNodePool.GetAllocatedBytes() + mStickPool.GetAllocatedBytes();
+
+	for (Node* node : mListOfNodes)
+	{
+		bytes += node->mListOfConnectedSticks.capacity() * sizeof(Stick*);
 	}
 
-	return true;
+	bytes += mListOfNodes.capacity() * sizeof(Node*) + mNodeArrays.GetMemoryUsage();
+	bytes += (mListOfSticks.capacity() + mListOfDisconnectedSticks.capacity() +
+		mListOfSticksToRemove.capacity()) * sizeof(Stick*);
+	bytes += mListOfTethers.capacity() * sizeof(Tether);
+	bytes += mNodeSpheres.GetMemoryUsage() + mNodeContacts.GetMemoryUsage();
+
+	return bytes;
 }
 
 void BaseSoftBody::UpdateSoftBody(float deltaTime, CRITICAL_SECTION& criticalSection)
 {
 	mCriticalSection = &criticalSection;
 
-	UpdateNodePosition(deltaTime);
-	UpdatePositionByVerlet(deltaTime);
+	//Flush denormals to zero for the whole step instead of cleaning every vector
+	unsigned int previousCsr = _mm_getcsr();
+	_mm_setcsr(previousCsr | _MM_FLUSH_ZERO_ON | _MM_DENORMALS_ZERO_ON);
+
+	RemoveDisconnectedSticks();
+	UpdateGravityFlags();
+	IntegrateNodes(deltaTime);
 	ApplyCollision(deltaTime);
 	SatisfyConstraints(deltaTime);
 	UpdateModelData(deltaTime);
-}
 
+	_mm_setcsr(previousCsr);
+}
 
-void BaseSoftBody::UpdateNodePosition(float deltaTime)
+void BaseSoftBody::IntegrateNodes(float deltaTime)
 {
-	EnterCriticalSection(mCriticalSection);
+	// Gravity, velocity clamp and the verlet step in one pass over the node arrays,
+	// NODE_BATCH_WIDTH nodes at a time. Locked lanes keep their state.
 
-	for (Node* node : mListOfNodes)
-	{
-		if (node->mIsLocked) continue;
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 gravityX = _mm_set1_ps(mGravity.x * deltaTime);
+	const __m128 gravityY = _mm_set1_ps(mGravity.y * deltaTime);
+	const __m128 gravityZ = _mm_set1_ps(mGravity.z * deltaTime);
+	const glm::vec3 maxVelocity = clampVelocity ? mNodeMaxVelocity : glm::vec3(std::numeric_limits<float>::max());
+	const __m128 maxVelocityX = _mm_set1_ps(maxVelocity.x);
+	const __m128 maxVelocityY = _mm_set1_ps(maxVelocity.y);
+	const __m128 maxVelocityZ = _mm_set1_ps(maxVelocity.z);
+	const __m128 step = _mm_set1_ps(deltaTime);
+	const __m128 stepSq = _mm_set1_ps(deltaTime * deltaTime);
 
+	__m128 maxSqDisplacement = zero;
 
-		if (ShouldApplyGravity(node))
-		{
-			node->velocity += mGravity * deltaTime;
-		}
+	NodeArrays& nodes = mNodeArrays;
 
-		if (clampVelocity)
-		{
-			node->velocity.x = glm::clamp(node->velocity.x, -mNodeMaxVelocity.x, mNodeMaxVelocity.x);
-			node->velocity.y = glm::clamp(node->velocity.y, -mNodeMaxVelocity.y, mNodeMaxVelocity.y);
-			node->velocity.z = glm::clamp(node->velocity.z, -mNodeMaxVelocity.z, mNodeMaxVelocity.z);
-		}
+	EnterCriticalSection(mCriticalSection);
+
+	for (int first = 0; first < nodes.count; first += NODE_BATCH_WIDTH)
+	{
+		__m128 free = _mm_cmpeq_ps(_mm_loadu_ps(&nodes.isLocked[first]), zero);
+		__m128 colliding = _mm_cmpneq_ps(_mm_loadu_ps(&nodes.isColliding[first]), zero);
+		__m128 gravityScale = _mm_loadu_ps(&nodes.applyGravity[first]);
 
-		//node->mCurrentPosition += node->velocity * deltaTime;
+		__m128 velocityX = StepVelocity(&nodes.velocityX[first], gravityX, gravityScale, maxVelocityX, free);
+		__m128 velocityY = StepVelocity(&nodes.velocityY[first], gravityY, gravityScale, maxVelocityY, free);
+		__m128 velocityZ = StepVelocity(&nodes.velocityZ[first], gravityZ, gravityScale, maxVelocityZ, free);
 
+		__m128 sqDisplacement = StepPosition(&nodes.positionX[first], &nodes.oldPositionX[first], velocityX, step, stepSq, free, colliding);
+		sqDisplacement = _mm_add_ps(sqDisplacement, StepPosition(&nodes.positionY[first], &nodes.oldPositionY[first], velocityY, step, stepSq, free, colliding));
+		sqDisplacement = _mm_add_ps(sqDisplacement, StepPosition(&nodes.positionZ[first], &nodes.oldPositionZ[first], velocityZ, step, stepSq, free, colliding));
 
-		//UpdatePositionByVerlet(node, deltaTime);
+		maxSqDisplacement = _mm_max_ps(maxSqDisplacement, sqDisplacement);
 	}
 
 	LeaveCriticalSection(mCriticalSection);
 
+	mLastMaxNodeSpeed = deltaTime > 0 ? glm::sqrt(GetMaxLane(maxSqDisplacement)) / deltaTime : 0;
 }
 
-void BaseSoftBody::UpdatePositionByVerlet(float deltaTime)
+unsigned int BaseSoftBody::GetIterationCeiling()
 {
-	for (Node* node : mListOfNodes)
-	{
-		if (node->mIsLocked) continue;
+	if (!mUseAdaptiveIterations) return mNumOfIterations;
 
-		glm::vec3 posBeforUpdate = node->mCurrentPosition;
+	return mLastMaxNodeSpeed > mViolentMotionSpeed ? glm::max(mMaxNumOfIterations, mNumOfIterations) : mNumOfIterations;
+}
 
-		if (node->mIsColliding)
-		{
-			node->mCurrentPosition += (node->velocity * deltaTime);
-		}
-		else
-		{
-			node->mCurrentPosition += (posBeforUpdate - node->mOldPositionm) + (node->velocity * (deltaTime * deltaTime));
-		}
-		node->mOldPositionm = posBeforUpdate;
+float BaseSoftBody::GetMaxStickStrain()
+{
+	float maxStrain = 0;
+
+	for (Stick* stick : mListOfSticks)
+	{
+		if (stick->mRestLength <= 0) continue;
+
+		float length = glm::distance(stick->mNodeA->GetPosition(), stick->mNodeB->GetPosition());
 
-		CleanZeros(node->mCurrentPosition);
-		CleanZeros(node->mOldPositionm);
+		maxStrain = glm::max(maxStrain, glm::abs(length - stick->mRestLength) / stick->mRestLength);
 	}
 
+	return maxStrain;
+}
+
+bool BaseSoftBody::HasConverged(unsigned int iteration, float residual)
+{
+	mLastNumOfIterations = iteration + 1;
+	mLastResidual = residual;
+
+	if (!mUseAdaptiveIterations) return false;
+
+	return mLastNumOfIterations >= mMinNumOfIterations && residual < mResidualTolerance;
 }
 
 void BaseSoftBody::SatisfyConstraints(float deltaTime)
 {
 
-	for (unsigned int i = 0; i < mNumOfIterations; i++)
+	unsigned int numOfIterations = GetIterationCeiling();
+
+	for (unsigned int i = 0; i < numOfIterations; i++)
 	{
 		for (Stick* stick : mListOfSticks)
 		{
-			if (!stick->isConnected) continue;
-
 			Node* nodeA = stick->mNodeA;
 			Node* nodeB = stick->mNodeB;
 
-			glm::vec3 delta = nodeB->mCurrentPosition - nodeA->mCurrentPosition;
+			glm::vec3 positionA = nodeA->GetPosition();
+			glm::vec3 positionB = nodeB->GetPosition();
+
+			glm::vec3 delta = positionB - positionA;
 			float length = glm::length(delta);
 
 			float diff = (length - stick->mRestLength) / length;
 
-			if (!nodeA->mIsLocked && !nodeA->mIsColliding)
+			if (!nodeA->IsLocked() && !nodeA->IsColliding())
 			{
-				nodeA->mCurrentPosition += delta * 0.5f * diff * mTightness;
+				nodeA->SetPosition(positionA + delta * 0.5f * diff * mTightness);
 			}
 
-			if (!nodeB->mIsLocked && !nodeB->mIsColliding)
+			if (!nodeB->IsLocked() && !nodeB->IsColliding())
 			{
-				nodeB->mCurrentPosition -= delta * 0.5f * diff * mTightness;
+				nodeB->SetPosition(positionB - delta * 0.5f * diff * mTightness);
 			}
 
 			/*glm::vec3 stickCenter = (nodeA->mCurrentPosition + nodeB->mCurrentPosition) / 2.0f;
@@ -188,10 +648,14 @@ void BaseSoftBody::SatisfyConstraints(float deltaTime)
 			{
 				nodeB->mCurrentPosition = stickCenter - stickDir * stick->mRestLength * 0.5f;
 			}*/
-
-			CleanZeros(nodeA->mCurrentPosition);
-			CleanZeros(nodeB->mCurrentPosition);
 		}
+
+		SatisfyTethers();
+
+		// Residual after this iteration's corrections, only measured when it is used
+		if (!mUseAdaptiveIterations && i + 1 < numOfIterations) continue;
+
+		if (HasConverged(i, GetMaxStickStrain())) break;
 	}
 }
 
@@ -229,9 +693,14 @@ void BaseSoftBody::ApplyCollision(float deltaTime)
 
 	std::vector<glm::vec3> collisionPts, collisionNr;
 
-	for (Node* node : mListOfNodes)
+	mNodeSpheres.Resize((int)mListOfNodes.size());
+
+	for (int i = 0; i < (int)mListOfNodes.size(); i++)
 	{
-		node->mIsColliding = false;
+		Node* node = mListOfNodes[i];
+
+		node->SetColliding(false);
+		mNodeSpheres.Set(i, node->GetPosition(), node->mRadius);
 	}
 
 
@@ -250,11 +719,27 @@ void BaseSoftBody::ApplyCollision(float deltaTime)
 	{
 		int numOfCollisions = 0;
 
+		if (phyObj->shape == MESH_OF_TRIANGLES && phyObj->useBvh)
+		{
+			if (collisionMode == TRIGGER) continue;
+
+			ApplyMeshCollision(phyObj);
+			continue;
+		}
+
+		if (phyObj->shape == SPHERE || phyObj->shape == AABB)
+		{
+			if (collisionMode == TRIGGER) continue;
+
+			ApplyBatchCollision(phyObj);
+			continue;
+		}
+
 		for (Node* node : mListOfNodes)
 		{
 			bool nodeCollided = false;
 
-			Sphere nodeSphere(node->mCurrentPosition, node->mRadius);
+			Sphere nodeSphere(node->GetPosition(), node->mRadius);
 
 			if (collisionMode == TRIGGER) continue;
 
@@ -263,66 +748,169 @@ void BaseSoftBody::ApplyCollision(float deltaTime)
 
 			switch (phyObj->shape)
 			{
-			case SPHERE:
+			case PLANE:
 
-				if (CollisionSphereVSSphere(&nodeSphere, (Sphere*)phyObj->transformedPhysicsShape, collisionPts, collisionNr))
+				if (CollisionSphereVsPlane(nodeSphere, *(Plane*)phyObj->GetTransformedPhysicsShape(), collisionPts, collisionNr))
 				{
 					numOfCollisions++;
 					nodeCollided = true;
 				}
+
 				break;
 
-			case AABB:
+			case CAPSULE:
+
+				if (CollisionSphereVsCapsule(nodeSphere, *(Capsule*)phyObj->GetTransformedPhysicsShape(), collisionPts, collisionNr))
+				{
+					numOfCollisions++;
+					nodeCollided = true;
+				}
+
+				break;
+
+			case MESH_OF_TRIANGLES:
+			{
+				//Held for the test, the physics step publishes new triangles instead of changing these
+				std::shared_ptr<const std::vector<Triangle>> triangles = phyObj->GetSharedTriangleList();
+				std::shared_ptr<const std::vector<Sphere>> triangleSpheres = phyObj->GetSharedSphereList();
+
+				//The shape was recalculated between the two loads
+				if (triangleSpheres->size() != triangles->size()) break;
 
-				if (CollisionSpherevsAABB(&nodeSphere, phyObj->GetModelAABB(), true, collisionPts, collisionNr))
+				if (CollisionSphereVsMeshOfTriangles(&nodeSphere, phyObj->transform.GetTransformMatrix(),
+					*triangles, *triangleSpheres, collisionPts, collisionNr))
 				{
 					numOfCollisions++;
 					nodeCollided = true;
 				}
 
 				break;
+			}
 
+			default:
+				break;
 			}
 
 			if (!nodeCollided) continue;
 
-			EnterCriticalSection(mCriticalSection);
+			ResolveNodeCollision(node, collisionPts, collisionNr);
+		}
 
-			glm::vec3 normal = glm::vec3(0.0f);
-			glm::vec3 collisionPt = glm::vec3(0.0f);
+	}
+}
 
-			for (size_t i = 0; i < collisionNr.size(); i++)
-			{
-				if (glm::length(collisionNr[i]) == 0)
-				{
-					normal += (collisionNr[i]);
-				}
-				else
-				{
-					normal += glm::normalize(collisionNr[i]);
-				}
-			}
+void BaseSoftBody::ApplyMeshCollision(PhysicsObject* phyObj)
+{
+	std::vector<Sphere> nodeSpheres;
+	nodeSpheres.reserve(mListOfNodes.size());
 
-			for (size_t i = 0; i < collisionPts.size(); i++)
-			{
+	for (Node* node : mListOfNodes)
+	{
+		nodeSpheres.push_back(Sphere(node->GetPosition(), node->mRadius));
+	}
 
-				collisionPt += (collisionPts[i]);
-			}
+	std::vector<int> collisionNodeIndices;
+	std::vector<glm::vec3> collisionPts, collisionNr;
 
-			normal = normal / (float)collisionNr.size();
-			collisionPt = collisionPt / (float)collisionPts.size();
+	//The main thread refits copies of these and publishes them, ours stay valid until we return
+	std::shared_ptr<const HierarchicalAABB> bvh = phyObj->GetSharedBvh();
+	std::shared_ptr<const std::vector<Triangle>> triangles = phyObj->GetSharedTriangleList();
 
-			glm::vec3 reflected = glm::reflect(glm::normalize(node->velocity), normal);
-			node->velocity = reflected * glm ::length(node->velocity ) * 0.5f;
-			node->velocity *= mBounceFactor;
-			//node->velocity = glm::vec3(0);
+	if (bvh == nullptr) return;
 
-			//node->mCurrentPosition = collisionPt + ( reflected * node->mRadius);
-			node->mIsColliding = true;
-			//node->mOldPositionm = node->mCurrentPosition;
+	if (!CollisionSpheresVsMeshOfTriangles(nodeSpheres, bvh.get(),
+		phyObj->transform.GetTransformMatrix(), phyObj->GetInverseTransformMatrix(), *triangles,
+		collisionNodeIndices, collisionPts, collisionNr)) return;
+
+	std::vector<glm::vec3> nodeCollisionPts, nodeCollisionNr;
+
+	// Contacts come back grouped by node
+	for (size_t i = 0; i < collisionNodeIndices.size(); )
+	{
+		int nodeIndex = collisionNodeIndices[i];
+
+		nodeCollisionPts.clear();
+		nodeCollisionNr.clear();
+
+		for (; i < collisionNodeIndices.size() && collisionNodeIndices[i] == nodeIndex; i++)
+		{
+			nodeCollisionPts.push_back(collisionPts[i]);
+			nodeCollisionNr.push_back(collisionNr[i]);
+		}
+
+		ResolveNodeCollision(mListOfNodes[nodeIndex], nodeCollisionPts, nodeCollisionNr);
+	}
+}
+
+void BaseSoftBody::ApplyBatchCollision(PhysicsObject* phyObj)
+{
+	// All nodes against the collider four at a time, only the nodes that hit are resolved
+
+	int numOfHits = 0;
+
+	if (phyObj->shape == SPHERE)
+	{
+		numOfHits = CollisionSpheresVsSphere(mNodeSpheres, *(Sphere*)phyObj->transformedPhysicsShape, mNodeContacts);
+	}
+	else
+	{
+		numOfHits = CollisionSpheresVsAABB(mNodeSpheres, phyObj->GetModelAABB(), mNodeContacts);
+	}
+
+	if (numOfHits == 0) return;
+
+	std::vector<glm::vec3> collisionPts(1), collisionNr(1);
+
+	for (int i = 0; i < mNodeSpheres.count; i++)
+	{
+		if (!mNodeContacts.IsHit(i)) continue;
+
+		Node* node = mListOfNodes[i];
 
-			LeaveCriticalSection(mCriticalSection);
+		collisionNr[0] = mNodeContacts.GetNormal(i);
+		collisionPts[0] = node->GetPosition() - collisionNr[0] * (node->mRadius - mNodeContacts.depth[i]);
+
+		ResolveNodeCollision(node, collisionPts, collisionNr);
+	}
+}
+
+void BaseSoftBody::ResolveNodeCollision(Node* node, const std::vector<glm::vec3>& collisionPts,
+	const std::vector<glm::vec3>& collisionNr)
+{
+	EnterCriticalSection(mCriticalSection);
+
+	glm::vec3 normal = glm::vec3(0.0f);
+	glm::vec3 collisionPt = glm::vec3(0.0f);
+
+	for (size_t i = 0; i < collisionNr.size(); i++)
+	{
+		if (glm::length(collisionNr[i]) == 0)
+		{
+			normal += (collisionNr[i]);
 		}
+		else
+		{
+			normal += glm::normalize(collisionNr[i]);
+		}
+	}
+
+	for (size_t i = 0; i < collisionPts.size(); i++)
+	{
 
+		collisionPt += (collisionPts[i]);
 	}
+
+	normal = normal / (float)collisionNr.size();
+	collisionPt = collisionPt / (float)collisionPts.size();
+
+	glm::vec3 velocity = node->GetVelocity();
+	glm::vec3 reflected = glm::reflect(glm::normalize(velocity), normal);
+	node->SetVelocity(reflected * glm ::length(velocity) * 0.5f * mBounceFactor);
+	//node->velocity = glm::vec3(0);
+
+	//node->mCurrentPosition = collisionPt + ( reflected * node->mRadius);
+	node->SetColliding(true);
+	//node->mOldPositionm = node->mCurrentPosition;
+
+	LeaveCriticalSection(mCriticalSection);
 }
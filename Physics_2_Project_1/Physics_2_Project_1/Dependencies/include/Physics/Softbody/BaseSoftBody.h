@@ -1,6 +1,7 @@
 #pragma once
 #include <Graphics/Mesh/Model.h>
 #include "../PhysicsObject.h"
+#include "ObjectPool.h"
 
 #define NOMINMAX
 #include <Windows.h>
@@ -8,18 +9,14 @@
 class BaseSoftBody : public Model
 {
 public:
-	struct PointerToVertex
+	// Binds a render vertex to the node that moves it, the vertex rest position is node position plus offset
+	struct VertexBinding
 	{
-		PointerToVertex(Vertex& vertex, glm::mat4& transformMatrix)
-		{
-			mLocalVertex = vertex;
-			mLocalVertex.positions = transformMatrix * glm::vec4(mLocalVertex.positions, 1.0f);
-			mPointerToVertex = &vertex;
-		};
-
-		Vertex mLocalVertex;
-		Vertex* mPointerToVertex = nullptr;
+		VertexBinding(unsigned int vertexIndex, const glm::vec3& offset) :
+			mVertexIndex{ vertexIndex },
+			mOffsetFromCenter{ offset } {};
 
+		unsigned int mVertexIndex = 0;					//Index into the mesh vertices
 		glm::vec3 mOffsetFromCenter = glm::vec3(0);
 	};
 
@@ -37,74 +34,75 @@ public:
 
 	struct Stick;
 
-	struct Node
+	static const int NODE_BATCH_WIDTH = 4;
+
+	//Integration state of every node, lane i belongs to mListOfNodes[i]. Padded to a multiple of
+	//NODE_BATCH_WIDTH with locked lanes so the integration pass loads four nodes at once
+	struct NodeArrays
 	{
+		std::vector<float> positionX, positionY, positionZ;
+		std::vector<float> oldPositionX, oldPositionY, oldPositionZ;
+		std::vector<float> velocityX, velocityY, velocityZ;
+		std::vector<float> isLocked, applyGravity, isColliding;		//1 or 0
+		int count = 0;
+
+		unsigned int Add(const glm::vec3& position, bool locked);
+		void Clear();
+		size_t GetMemoryUsage() const;
+	};
 
-	private:
+	struct Node
+	{
+		Node(NodeArrays* arrays, unsigned int index, float radius) :
+			mArrays{ arrays },
+			mIndex{ index },
+			mRadius{ radius } {};
 
-		glm::vec3 CalculatePosition(std::vector<PointerToVertex>& vertex)
+		~Node()
 		{
-			glm::vec3 pos = glm::vec3(0);
-
-			int i = 0;
-
-			for (PointerToVertex& vert : vertex)
-			{
-				pos += vert.mPointerToVertex->positions;
-				i++;
-			}
-
-			pos /= (float)i;
-
-			return pos;
+			mListOfConnectedSticks.clear();
 		}
 
+		glm::vec3 GetPosition() const { return glm::vec3(mArrays->positionX[mIndex], mArrays->positionY[mIndex], mArrays->positionZ[mIndex]); }
+		glm::vec3 GetOldPosition() const { return glm::vec3(mArrays->oldPositionX[mIndex], mArrays->oldPositionY[mIndex], mArrays->oldPositionZ[mIndex]); }
+		glm::vec3 GetVelocity() const { return glm::vec3(mArrays->velocityX[mIndex], mArrays->velocityY[mIndex], mArrays->velocityZ[mIndex]); }
 
-		void InitializeVertexPointer(std::vector<PointerToVertex>& vertex, glm::vec3& center)
+		void SetPosition(const glm::vec3& position)
 		{
-			mPointerToVertices.reserve(vertex.size());
-
-			for (PointerToVertex& vert : vertex)
-			{
-				vert.mOffsetFromCenter = vert.mPointerToVertex->positions - center;
-				mPointerToVertices.push_back(vert);
-			}
+			mArrays->positionX[mIndex] = position.x;
+			mArrays->positionY[mIndex] = position.y;
+			mArrays->positionZ[mIndex] = position.z;
 		}
 
-	public:
-
-		Node(std::vector<PointerToVertex>& vertex, glm::mat4& transformMat, float radius,
-			bool isLocked = false)
+		void SetOldPosition(const glm::vec3& position)
 		{
-			mIsLocked = isLocked;
-			mRadius = radius;
-			mIsColliding = false;
-
-			mCurrentPosition = CalculatePosition(vertex);
-			InitializeVertexPointer(vertex, mCurrentPosition);
-
-			mCurrentPosition = transformMat * glm::vec4(mCurrentPosition, 1.0f);
-			mOldPositionm = mCurrentPosition;
+			mArrays->oldPositionX[mIndex] = position.x;
+			mArrays->oldPositionY[mIndex] = position.y;
+			mArrays->oldPositionZ[mIndex] = position.z;
 		}
 
-		~Node()
+		void SetVelocity(const glm::vec3& velocity)
 		{
-			mListOfConnectedSticks.clear();
-			mPointerToVertices.clear();
+			mArrays->velocityX[mIndex] = velocity.x;
+			mArrays->velocityY[mIndex] = velocity.y;
+			mArrays->velocityZ[mIndex] = velocity.z;
 		}
 
-		bool mIsLocked = false;
+		bool IsLocked() const { return mArrays->isLocked[mIndex] != 0; }
+		bool IsColliding() const { return mArrays->isColliding[mIndex] != 0; }
+		bool ShouldApplyGravity() const { return mArrays->applyGravity[mIndex] != 0; }
+
+		void SetLocked(bool locked) { mArrays->isLocked[mIndex] = locked ? 1.0f : 0.0f; }
+		void SetColliding(bool colliding) { mArrays->isColliding[mIndex] = colliding ? 1.0f : 0.0f; }
+		void SetApplyGravity(bool applyGravity) { mArrays->applyGravity[mIndex] = applyGravity ? 1.0f : 0.0f; }
+
+		NodeArrays* mArrays = nullptr;
+		unsigned int mIndex = 0;			//Lane in mArrays and index in mListOfNodes
+
 		bool mEnabled = true;
-		bool mIsColliding = false;
 		float mRadius = 0;
 
-		glm::vec3 mCurrentPosition = glm::vec3(0);
-		glm::vec3 mOldPositionm = glm::vec3(0);
-		glm::vec3 velocity = glm::vec3(0);
-
-		std::vector<PointerToVertex> mPointerToVertices;
 		std::vector<Stick*> mListOfConnectedSticks;
-		std::vector<unsigned int> mListOfIndexs;
 	};
 
 
@@ -115,7 +113,7 @@ public:
 			mNodeA = nodeA;
 			mNodeB = nodeB;
 
-			mRestLength = glm::distance(nodeA->mCurrentPosition, nodeB->mCurrentPosition);
+			mRestLength = glm::distance(nodeA->GetPosition(), nodeB->GetPosition());
 
 			nodeA->mListOfConnectedSticks.push_back(this);
 			nodeB->mListOfConnectedSticks.push_back(this);
@@ -130,26 +128,42 @@ public:
 		bool isConnected = true;
 		float mRestLength = 0;
 
+		unsigned int mActiveIndex = 0;		//Index in mListOfSticks while connected
+		int mTriangleIndex = -1;			//Render triangle this stick was built from, -1 if none
+
 		Node* mNodeA = nullptr;
 		Node* mNodeB = nullptr;
 	};
 
 	
 
+	// Long range attachment, keeps a free node within its geodesic rest distance of the nearest locked node
+	struct Tether
+	{
+		Tether(Node* node, Node* anchor, float maxLength) :
+			mNode{ node },
+			mAnchor{ anchor },
+			mMaxLength{ maxLength } {};
+
+		Node* mNode = nullptr;
+		Node* mAnchor = nullptr;
+		float mMaxLength = 0;
+	};
+
+	// Vertices of one mesh moved by one node, mListOfVertexBindings[mFirstBinding, mFirstBinding + mNumOfBindings)
 	struct MeshHolder
 	{
-		MeshHolder(std::vector<PointerToVertex> vertices, std::vector<PointerToIndex> indices) :
-			mListOfVertices{ vertices }, 
-			mListOfIndices{ indices } {};
+		MeshHolder(Mesh* mesh) : mMesh{ mesh } {};
 
-		std::vector<PointerToVertex> mListOfVertices;
-		std::vector<PointerToIndex> mListOfIndices;
+		Mesh* mMesh = nullptr;
+		unsigned int mFirstBinding = 0;
+		unsigned int mNumOfBindings = 0;
 	};
 
 	virtual void InitializeSoftBody() = 0;
 
 	virtual void UpdateSoftBody(float deltaTime, CRITICAL_SECTION& criticalSection);
-	virtual void UpdateNodePosition(float deltaTime);
+	virtual void IntegrateNodes(float deltaTime);
 	virtual void SatisfyConstraints(float deltaTime);
 	virtual void UpdateModelData(float deltaTime);
 
@@ -159,22 +173,48 @@ public:
 	virtual void UpdateModelVertices() = 0;
 	virtual void UpdateModelNormals() = 0;
 
-	virtual void UpdatePositionByVerlet(float deltaTime);
-
 	virtual void OnPropertyDraw();
 	virtual void Render();
 
 	virtual void AddCollidersToCheck(PhysicsObject* phyObj);
 	virtual void SetNodeRadius(int index, float radius);
+	void SetNodeApplyGravity(int index, bool applyGravity);
 
 	virtual void DisconnectStick(Stick* stick);
 	bool ShouldApplyGravity(Node* node);
 
+	//Adds the node to mListOfNodes, position is in world space
+	Node* AddNode(const glm::vec3& position, float radius, bool isLocked = false);
+	Stick* AddStick(Node* nodeA, Node* nodeB, int triangleIndex = -1);
+
+	//Call again whenever the set of locked nodes changes
+	void SetupTethers();
+
+	//Bytes held by the simulation data of this body, excluding the render mesh
+	virtual size_t GetMemoryUsage();
+
+	//Times the one pair and the batch tests of the nodes against every SPHERE and AABB collider
+	void RunBatchCollisionBenchmark(int numOfRepeats = 100);
+
 	bool showDebugModels = true;
 	bool clampVelocity = false;
+	bool mUseTethers = true;
 
 	glm::vec3 mGravity = glm::vec3(0);
-	unsigned int mNumOfIterations = 10;
+	unsigned int mNumOfIterations = 10;				//Iteration ceiling in normal motion
+
+	bool mUseAdaptiveIterations = false;			//Off keeps the fixed mNumOfIterations of older scenes
+	unsigned int mMinNumOfIterations = 1;
+	unsigned int mMaxNumOfIterations = 30;			//Iteration ceiling when a node moves faster than mViolentMotionSpeed
+	float mResidualTolerance = 0.001f;				//Max stick strain |length - rest| / rest to stop at
+	float mViolentMotionSpeed = 5.0f;
+
+	//Profiling, from the last step
+	unsigned int mLastNumOfIterations = 0;
+	float mLastResidual = 0;
+	float mLastMaxNodeSpeed = 0;
+
+	std::vector<std::pair<std::string, BatchCollisionTimings>> mListOfBatchTimings;	//Collider name and timings
 
 	float mNodeRadius = 0.1f;
 	float mTightness = 1.0f;
@@ -185,16 +225,47 @@ public:
 	std::vector<PhysicsObject*> mListOfCollidersToCheck;
 
 	std::vector<Node*> mListOfNodes;
-	std::vector<Stick*> mListOfSticks;
-	std::vector<Node*> mListOfNonGravityNodes;
+	std::vector<Stick*> mListOfSticks;				//Only connected sticks, kept contiguous
+	std::vector<Node*> mListOfNonGravityNodes;		//Copied into the node flags when the list changes
+	std::vector<Stick*> mListOfDisconnectedSticks;
+	std::vector<Tether> mListOfTethers;
 
 	CollisionMode collisionMode = CollisionMode::SOLID;
 
-	CRITICAL_SECTION* mCriticalSection;
+	CRITICAL_SECTION* mCriticalSection = nullptr;
 
 
 protected:
 	void CleanZeros(glm::vec3& value);
+	void UpdateGravityFlags();
+
+	void ReleaseTopology();
+	void RemoveDisconnectedSticks();
+	void RemoveUnreachableTethers();
+	void SatisfyTethers();
+
+	unsigned int GetIterationCeiling();
+	bool HasConverged(unsigned int iteration, float residual);
+	float GetMaxStickStrain();
+
+	void ApplyMeshCollision(PhysicsObject* phyObj);
+	void ApplyBatchCollision(PhysicsObject* phyObj);
+	void ResolveNodeCollision(Node* node, const std::vector<glm::vec3>& collisionPts,
+		const std::vector<glm::vec3>& collisionNr);
+	virtual void OnStickRemoved(Stick* /*stick*/) {}
+
+	std::vector<Stick*> mListOfSticksToRemove;
+
+	//Own every Node and Stick of the body, released together on re-initialize and destruction
+	ObjectPool<Node> mNodePool;
+	ObjectPool<Stick> mStickPool;
+
+	NodeArrays mNodeArrays;
+	std::vector<Node*> mListOfAppliedNonGravityNodes;	//mListOfNonGravityNodes as of the last UpdateGravityFlags
+
+	//Node spheres of the current step for the batch collision kernels
+	SphereBatch mNodeSpheres;
+	SphereBatchContacts mNodeContacts;
 	
 
 	const glm::vec4 nodeColor = glm::vec4(0.0f, 1.0f, 0.0f, 1.0f);
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <new>
+#include <utility>
+#include <vector>
+
+// Block allocator owning every object it creates. Objects are never freed one by one,
+// Release() destroys all of them and frees the blocks in one go.
+template <typename T>
+class ObjectPool
+{
+public:
+
+	ObjectPool(size_t blockSize = 256) : mBlockSize{ blockSize } {};
+	~ObjectPool() { Release(); }
+
+	ObjectPool(const ObjectPool&) = delete;
+	ObjectPool& operator=(const ObjectPool&) = delete;
+
+	// Makes sure the next count objects are created next to each other in one block
+	void Reserve(size_t count)
+	{
+		if (!mListOfBlocks.empty())
+		{
+			Block& block = mListOfBlocks.back();
+
+			if (block.mCapacity - block.mCount >= count) return;
+		}
+
+		AddBlock(count > mBlockSize ? count : mBlockSize);
+	}
+
+	template <typename... Args>
+	T* Create(Args&&... args)
+	{
+		if (mListOfBlocks.empty() || mListOfBlocks.back().mCount == mListOfBlocks.back().mCapacity)
+		{
+			AddBlock(mBlockSize);
+		}
+
+		Block& block = mListOfBlocks.back();
+
+		T* object = new (block.mData + block.mCount) T(std::forward<Args>(args)...);
+		block.mCount++;
+		mCount++;
+
+		return object;
+	}
+
+	void Release()
+	{
+		for (Block& block : mListOfBlocks)
+		{
+			for (size_t i = 0; i < block.mCount; i++)
+			{
+				block.mData[i].~T();
+			}
+
+			::operator delete(block.mData);
+		}
+
+		mListOfBlocks.clear();
+		mCount = 0;
+	}
+
+	size_t GetCount() const { return mCount; }
+
+	size_t GetAllocatedBytes() const
+	{
+		size_t bytes = 0;
+
+		for (const Block& block : mListOfBlocks)
+		{
+			bytes += block.mCapacity * sizeof(T);
+		}
+
+		return bytes;
+	}
+
+private:
+
+	struct Block
+	{
+		T* mData = nullptr;
+		size_t mCapacity = 0;
+		size_t mCount = 0;
+	};
+
+	void AddBlock(size_t capacity)
+	{
+		Block block;
+		block.mData = static_cast<T*>(::operator new(capacity * sizeof(T)));
+		block.mCapacity = capacity;
+
+		mListOfBlocks.push_back(block);
+	}
+
+	size_t mBlockSize = 256;
+	size_t mCount = 0;
+
+	std::vector<Block> mListOfBlocks;
+};
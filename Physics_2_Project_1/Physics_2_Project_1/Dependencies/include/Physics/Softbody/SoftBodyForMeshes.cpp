@@ -5,6 +5,8 @@
 #include "../PhysicsEngine.h"
 #include "SoftBodyForMeshes.h"
 
+#include <unordered_set>
+
 #define NOMINMAX
 #include <Windows.h>
 
@@ -27,32 +29,27 @@ namespace Verlet
 
 	void SoftBodyForMeshes::InitializeSoftBody()
 	{
-		glm::mat4 transformMatrix = transform.GetTransformMatrix();
+		ReleaseTopology();
+		mListOfMeshes.clear();
+		mListOfLockedNodes.clear();
+		mListOfChainSticks.clear();
+		mListOfVertexBindings.clear();
 
-		for (MeshAndMaterial* mesh : meshes)
-		{
-			std::vector<PointerToVertex> newListOfVertices;
-			std::vector<PointerToIndex> newListOfIndices;
+		size_t numOfVertices = 0;
 
-			newListOfVertices.reserve((size_t)mesh->mesh->vertices.size());
-			newListOfIndices.reserve((size_t)mesh->mesh->indices.size());
+		mListOfMeshes.reserve(meshes.size());
 
-			for (Vertex& vertexInMesh : mesh->mesh->vertices)
-			{
-				newListOfVertices.push_back({ vertexInMesh, transformMatrix });
-			}
-
-			for (unsigned int& indexInMesh : mesh->mesh->indices)
-			{
-				newListOfIndices.push_back({ indexInMesh });
-
-			}
-
-			mListOfMeshes.push_back({ newListOfVertices, newListOfIndices });
+		for (MeshAndMaterial* mesh : meshes)
+		{
+			numOfVertices += mesh->mesh->vertices.size();
+			mListOfMeshes.push_back({ mesh->mesh.get() });
 		}
 
+		mListOfVertexBindings.reserve(numOfVertices);
+
 		SetupNodes();
 		SetupSticks();
+		SetupTethers();
 	}
 
 	void SoftBodyForMeshes::UpdateSoftBody(float deltaTime, CRITICAL_SECTION& criticalSection)
@@ -63,26 +60,191 @@ namespace Verlet
 	void SoftBodyForMeshes::SetupNodes()
 	{
 		mListOfNodes.reserve(mListOfMeshes.size());
+		mNodePool.Reserve(mListOfMeshes.size());
 		glm::mat4 transformMat = transform.GetTransformMatrix();
 
+		std::unordered_set<unsigned int> indexesToLock(mIndexesToLock.begin(), mIndexesToLock.end());
+
 		unsigned int i = 0;
 		for (MeshHolder& mesh : mListOfMeshes)
 		{
+			std::vector<Vertex>& vertices = mesh.mMesh->vertices;
+
+			glm::vec3 center = glm::vec3(0);
+
+			for (Vertex& vertex : vertices)
+			{
+				center += vertex.positions;
+			}
+
+			center /= (float)vertices.size();
 
-			Node* node = new Node(mesh.mListOfVertices,
-				transformMat, mNodeRadius, IsNodeLocked(i));
+			mesh.mFirstBinding = mListOfVertexBindings.size();
+			mesh.mNumOfBindings = vertices.size();
 
-			mListOfNodes.push_back(node);
+			for (unsigned int vertIndex = 0; vertIndex < vertices.size(); vertIndex++)
+			{
+				mListOfVertexBindings.push_back({ vertIndex, vertices[vertIndex].positions - center });
+			}
+
+			AddNode(transformMat * glm::vec4(center, 1.0f), mNodeRadius, indexesToLock.count(i) != 0);
 			i++;
 		}
 	}
 
 	void SoftBodyForMeshes::SetupSticks()
 	{
-		for (int i = 0; i < mListOfNodes.size() - 1; i++)
+		mListOfChainSticks.clear();
+		mListOfChainSticks.reserve(mListOfNodes.size());
+		mListOfSticks.reserve(mListOfNodes.size());
+		mStickPool.Reserve(mListOfNodes.size());
+
+		for (int i = 0; i < (int)mListOfNodes.size() - 1; i++)
 		{
 			AddStickBetweenNodeIndex(i, i + 1);
+			mListOfChainSticks.push_back(mListOfSticks.back());
+		}
+
+		mIsChain = !mListOfChainSticks.empty();
+	}
+
+	void SoftBodyForMeshes::SatisfyConstraints(float deltaTime)
+	{
+		if (!mUseChainSolver || !mIsChain)
+		{
+			BaseSoftBody::SatisfyConstraints(deltaTime);
+			return;
+		}
+
+		for (unsigned int i = 0; i < mNumOfChainIterations; i++)
+		{
+			float residual = SolveChainConstraints();
+			SatisfyTethers();
+
+			if (HasConverged(i, residual)) break;
+		}
+	}
+
+	float SoftBodyForMeshes::SolveChainConstraints()
+	{
+		// Stick i is C_i = |x(i+1) - x(i)| - rest. Linearizing all of them together gives
+		// (J W J^T) lambda = -C, which is tridiagonal for a chain and is solved with the
+		// Thomas algorithm in O(n). Locked and colliding nodes get zero inverse mass.
+
+		const float epsilon = 1.192092896e-07f;
+
+		size_t numOfSticks = mListOfChainSticks.size();
+		size_t numOfNodes = numOfSticks + 1;
+
+		float maxStrain = 0;
+
+		mChainDirections.resize(numOfSticks);
+		mChainInverseMass.resize(numOfNodes);
+		mChainDiagonal.resize(numOfSticks);
+		mChainLower.resize(numOfSticks);
+		mChainUpper.resize(numOfSticks);
+		mChainRhs.resize(numOfSticks);
+
+		for (size_t i = 0; i < numOfNodes; i++)
+		{
+			Node* node = mListOfNodes[i];
+			mChainInverseMass[i] = (node->IsLocked() || node->IsColliding()) ? 0.0f : 1.0f;
+		}
+
+		for (size_t i = 0; i < numOfSticks; i++)
+		{
+			Stick* stick = mListOfChainSticks[i];
+
+			glm::vec3 delta = mListOfNodes[i + 1]->GetPosition() - mListOfNodes[i]->GetPosition();
+			float length = glm::length(delta);
+
+			if (!stick->isConnected || length < epsilon)
+			{
+				mChainDirections[i] = glm::vec3(0);
+				mChainRhs[i] = 0;
+				continue;
+			}
+
+			mChainDirections[i] = delta / length;
+			mChainRhs[i] = -(length - stick->mRestLength) * mTightness;
+
+			if (stick->mRestLength > 0)
+			{
+				maxStrain = glm::max(maxStrain, glm::abs(length - stick->mRestLength) / stick->mRestLength);
+			}
+		}
+
+		for (size_t i = 0; i < numOfSticks; i++)
+		{
+			bool isActive = mChainDirections[i] != glm::vec3(0);
+
+			mChainDiagonal[i] = isActive ? mChainInverseMass[i] + mChainInverseMass[i + 1] : 0.0f;
+
+			mChainLower[i] = (i > 0 && isActive) ?
+				-mChainInverseMass[i] * glm::dot(mChainDirections[i - 1], mChainDirections[i]) : 0.0f;
+
+			mChainUpper[i] = (i + 1 < numOfSticks && isActive) ?
+				-mChainInverseMass[i + 1] * glm::dot(mChainDirections[i], mChainDirections[i + 1]) : 0.0f;
+
+			if (mChainDiagonal[i] < epsilon)
+			{
+				// Torn stick or both ends pinned, lambda stays 0
+				mChainDiagonal[i] = 1.0f;
+				mChainLower[i] = 0.0f;
+				mChainUpper[i] = 0.0f;
+				mChainRhs[i] = 0.0f;
+			}
+		}
+
+		// Forward sweep, mChainUpper and mChainRhs become c' and d'
+		for (size_t i = 0; i < numOfSticks; i++)
+		{
+			float pivot = mChainDiagonal[i];
+
+			if (i > 0)
+			{
+				pivot -= mChainLower[i] * mChainUpper[i - 1];
+				mChainRhs[i] -= mChainLower[i] * mChainRhs[i - 1];
+			}
+
+			if (glm::abs(pivot) < epsilon)
+			{
+				mChainUpper[i] = 0.0f;
+				mChainRhs[i] = 0.0f;
+				continue;
+			}
+
+			mChainUpper[i] /= pivot;
+			mChainRhs[i] /= pivot;
+		}
+
+		// Back substitution, mChainRhs becomes lambda
+		for (size_t i = numOfSticks - 1; i > 0; i--)
+		{
+			mChainRhs[i - 1] -= mChainUpper[i - 1] * mChainRhs[i];
 		}
+
+		for (size_t i = 0; i < numOfNodes; i++)
+		{
+			if (mChainInverseMass[i] == 0.0f) continue;
+
+			glm::vec3 correction = glm::vec3(0);
+
+			if (i > 0)
+			{
+				correction += mChainDirections[i - 1] * mChainRhs[i - 1];
+			}
+			if (i < numOfSticks)
+			{
+				correction -= mChainDirections[i] * mChainRhs[i];
+			}
+
+			Node* node = mListOfNodes[i];
+
+			node->SetPosition(node->GetPosition() + correction * mChainInverseMass[i]);
+		}
+
+		return maxStrain;
 	}
 
 	void SoftBodyForMeshes::InitializeLockNodes(std::vector<unsigned int> indexToLock)
@@ -94,18 +256,10 @@ namespace Verlet
 	{
 		if (mListOfNodes.size() == 0) return;
 
-		mListOfNodes[index]->mIsLocked = true;
+		mListOfNodes[index]->SetLocked(true);
 		mListOfLockedNodes.push_back(mListOfNodes[index]);
-	}
-
-	bool SoftBodyForMeshes::IsNodeLocked(unsigned int& currentIndex)
-	{
-		for (unsigned int& index : mIndexesToLock)
-		{
-			if (index == currentIndex) return true;
-		}
 
-		return false;
+		SetupTethers();
 	}
 
 	void SoftBodyForMeshes::AddStickBetweenNodeIndex(unsigned int nodeAIndex, unsigned int nodeBIndex)
@@ -113,7 +267,10 @@ namespace Verlet
 		Node* nodeA = mListOfNodes[nodeAIndex];
 		Node* nodeB = mListOfNodes[nodeBIndex];
 
-		mListOfSticks.push_back(new Stick(nodeA, nodeB));
+		AddStick(nodeA, nodeB);
+
+		// Any stick beyond the (i, i + 1) chain needs the general solver
+		mIsChain = false;
 	}
 
 
@@ -121,16 +278,20 @@ namespace Verlet
 	{
 		EnterCriticalSection(mCriticalSection);
 
-		glm::vec3 pos;
+		glm::mat4 inverseTransform = glm::inverse(transform.GetTransformMatrix());
 
-		for (Node* node : mListOfNodes)
+		//Mesh i is moved by node i
+		for (size_t i = 0; i < mListOfNodes.size(); i++)
 		{
+			MeshHolder& mesh = mListOfMeshes[i];
+			std::vector<Vertex>& vertices = mesh.mMesh->vertices;
 
-			for (PointerToVertex& pointerToVertex : node->mPointerToVertices)
+			glm::vec3 pos = inverseTransform * glm::vec4(mListOfNodes[i]->GetPosition(), 1.0f);
+
+			for (unsigned int j = 0; j < mesh.mNumOfBindings; j++)
 			{
-				pos = glm::inverse(transform.GetTransformMatrix()) * glm::vec4(node->mCurrentPosition, 1.0f);
-				pos += pointerToVertex.mOffsetFromCenter;
-				pointerToVertex.mPointerToVertex->positions = pos;
+				VertexBinding& binding = mListOfVertexBindings[mesh.mFirstBinding + j];
+				vertices[binding.mVertexIndex].positions = pos + binding.mOffsetFromCenter;
 			}
 		}
 
@@ -143,9 +304,9 @@ namespace Verlet
 
 		for (MeshHolder& mesh : mListOfMeshes)
 		{
-			for (PointerToVertex& vertex : mesh.mListOfVertices)
+			for (Vertex& vertex : mesh.mMesh->vertices)
 			{
-				vertex.mPointerToVertex->normals = glm::vec3(0);
+				vertex.normals = glm::vec3(0);
 			}
 		}
 
@@ -183,10 +344,9 @@ namespace Verlet
 
 		for (MeshHolder& mesh : mListOfMeshes)
 		{
-			for (PointerToVertex& vertex : mesh.mListOfVertices)
+			for (Vertex& vertex : mesh.mMesh->vertices)
 			{
-				vertex.mPointerToVertex->normals = glm::normalize(vertex.mPointerToVertex->normals);
-
+				vertex.normals = glm::normalize(vertex.normals);
 			}
 		}
 
@@ -197,7 +357,7 @@ namespace Verlet
 	{
 		int index = MathUtils::GetRandomIntNumber(0, mListOfNodes.size() - 1);
 
-		mListOfNodes[index]->velocity = velocity;
+		mListOfNodes[index]->SetVelocity(velocity);
 	}
 
 	void SoftBodyForMeshes::Render()
@@ -211,5 +371,18 @@ namespace Verlet
 
 	}
 
+	size_t SoftBodyForMeshes::GetMemoryUsage()
+	{
+		size_t bytes = BaseSoftBody::GetMemoryUsage();
+
+		bytes += mListOfMeshes.capacity() * sizeof(MeshHolder);
+		bytes += mListOfVertexBindings.capacity() * sizeof(VertexBinding);
+		bytes += (mListOfLockedNodes.capacity() * sizeof(Node*)) + (mListOfChainSticks.capacity() * sizeof(Stick*));
+		bytes += mChainDirections.capacity() * sizeof(glm::vec3);
+		bytes += (mChainInverseMass.capacity() + mChainDiagonal.capacity() + mChainLower.capacity() +
+			mChainUpper.capacity() + mChainRhs.capacity()) * sizeof(float);
+
+		return bytes;
+	}
 
 }
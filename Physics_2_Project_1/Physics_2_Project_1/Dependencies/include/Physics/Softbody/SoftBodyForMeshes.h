@@ -16,6 +16,8 @@ namespace Verlet
 		virtual void OnPropertyDraw();
 
 
+		virtual void SatisfyConstraints(float deltaTime);
+
 		virtual void UpdateModelVertices();
 		virtual void UpdateModelNormals();
 
@@ -27,15 +29,31 @@ namespace Verlet
 		void LockNodeAtIndex(int index);
 		void InitializeLockNodes(std::vector<unsigned int> indexToLock);
 
+		virtual size_t GetMemoryUsage();
+
+		bool mUseChainSolver = true;				//Solve the (i, i + 1) chain directly instead of relaxing it
+		unsigned int mNumOfChainIterations = 2;		//Max linearized solves per step, fewer once below mResidualTolerance
+
 	private:
 		void SetupNodes();
 		void SetupSticks();
 
-		bool IsNodeLocked(unsigned int& currentIndex);
+		float SolveChainConstraints();
 
-		std::vector<MeshHolder> mListOfMeshes;
+		std::vector<MeshHolder> mListOfMeshes;				//mListOfMeshes[i] is moved by mListOfNodes[i]
+		std::vector<VertexBinding> mListOfVertexBindings;
 
 		std::vector<Node*> mListOfLockedNodes;
+
+		bool mIsChain = false;
+		std::vector<Stick*> mListOfChainSticks;		//mListOfChainSticks[i] connects node i and i + 1
+
+		std::vector<glm::vec3> mChainDirections;
+		std::vector<float> mChainInverseMass;
+		std::vector<float> mChainDiagonal;
+		std::vector<float> mChainLower;
+		std::vector<float> mChainUpper;
+		std::vector<float> mChainRhs;
 		std::vector<unsigned int > mIndexesToLock;
 
 	};
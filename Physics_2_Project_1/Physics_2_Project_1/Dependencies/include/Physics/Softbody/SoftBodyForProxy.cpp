@@ -0,0 +1,406 @@
+#include <Graphics/Renderer.h>
+#include <Graphics/Panels/ImguiDrawUtils.h>
+#include <Graphics/MathUtils.h>
+#include "../PhysicsEngine.h"
+#include "SoftBodyForProxy.h"
+#include "SpatialHashGrid.h"
+
+#include <unordered_map>
+#include <set>
+
+#define NOMINMAX
+#include <Windows.h>
+
+using namespace MathUtilities;
+
+namespace Verlet
+{
+	SoftBodyForProxy::SoftBodyForProxy()
+	{
+		name = "SoftBodyProxy";
+		InitializeEntity(this);
+		PhysicsEngine::GetInstance().AddSoftBodyObject(this);
+	}
+
+	SoftBodyForProxy::~SoftBodyForProxy()
+	{
+		PhysicsEngine::GetInstance().RemoveSoftBodyObject(this);
+	}
+
+	void SoftBodyForProxy::SetProxyLattice(const std::vector<glm::vec3>& nodePositions,
+		const std::vector<std::pair<unsigned int, unsigned int>>& sticks)
+	{
+		mListOfProxyPositions = nodePositions;
+		mListOfProxySticks = sticks;
+		mUseAuthoredLattice = true;
+	}
+
+	void SoftBodyForProxy::InitializeSoftBody()
+	{
+		ReleaseTopology();
+		mListOfSkinnedVertices.clear();
+
+		if (!mUseAuthoredLattice)
+		{
+			GenerateLatticeFromMesh();
+		}
+
+		SetupNodes();
+		SetupSticks();
+		SetupTethers();
+		SetupSkinWeights();
+	}
+
+	void SoftBodyForProxy::UpdateSoftBody(float deltaTime, CRITICAL_SECTION& criticalSection)
+	{
+		BaseSoftBody::UpdateSoftBody(deltaTime, criticalSection);
+	}
+
+	void SoftBodyForProxy::GenerateLatticeFromMesh()
+	{
+		// One node per occupied cell at the centroid of the vertices inside it,
+		// connected wherever a render triangle edge crosses between two cells.
+
+		mListOfProxyPositions.clear();
+		mListOfProxySticks.clear();
+
+		std::unordered_map<long long, unsigned int> cellToNode;
+		std::vector<unsigned int> verticesPerNode;
+
+		std::vector<std::vector<unsigned int>> vertexToNode;
+		vertexToNode.reserve(meshes.size());
+
+		for (MeshAndMaterial* mesh : meshes)
+		{
+			std::vector<unsigned int> meshVertexToNode;
+			meshVertexToNode.reserve(mesh->mesh->vertices.size());
+
+			for (Vertex& vertex : mesh->mesh->vertices)
+			{
+				long long key = SpatialHashGrid::GetCellKey(SpatialHashGrid::GetCell(vertex.positions, mProxyCellSize));
+
+				std::unordered_map<long long, unsigned int>::iterator it = cellToNode.find(key);
+
+				unsigned int nodeIndex = 0;
+
+				if (it == cellToNode.end())
+				{
+					nodeIndex = mListOfProxyPositions.size();
+					cellToNode[key] = nodeIndex;
+
+					mListOfProxyPositions.push_back(glm::vec3(0));
+					verticesPerNode.push_back(0);
+				}
+				else
+				{
+					nodeIndex = it->second;
+				}
+
+				mListOfProxyPositions[nodeIndex] += vertex.positions;
+				verticesPerNode[nodeIndex]++;
+
+				meshVertexToNode.push_back(nodeIndex);
+			}
+
+			vertexToNode.push_back(std::move(meshVertexToNode));
+		}
+
+		for (size_t i = 0; i < mListOfProxyPositions.size(); i++)
+		{
+			mListOfProxyPositions[i] /= (float)verticesPerNode[i];
+		}
+
+		std::set<std::pair<unsigned int, unsigned int>> edges;
+
+		for (size_t meshIndex = 0; meshIndex < meshes.size(); meshIndex++)
+		{
+			std::vector<unsigned int>& indices = meshes[meshIndex]->mesh->indices;
+			std::vector<unsigned int>& meshVertexToNode = vertexToNode[meshIndex];
+
+			for (size_t i = 0; i + 2 < indices.size(); i += 3)
+			{
+				for (int edge = 0; edge < 3; edge++)
+				{
+					unsigned int nodeA = meshVertexToNode[indices[i + edge]];
+					unsigned int nodeB = meshVertexToNode[indices[i + (edge + 1) % 3]];
+
+					if (nodeA == nodeB) continue;
+
+					edges.insert({ glm::min(nodeA, nodeB), glm::max(nodeA, nodeB) });
+				}
+			}
+		}
+
+		mListOfProxySticks.assign(edges.begin(), edges.end());
+	}
+
+	void SoftBodyForProxy::SetupNodes()
+	{
+		mListOfNodes.reserve(mListOfProxyPositions.size());
+		mNodePool.Reserve(mListOfProxyPositions.size());
+		mListOfNodeLocalPositions = mListOfProxyPositions;
+
+		glm::mat4 transformMat = transform.GetTransformMatrix();
+
+		for (glm::vec3& position : mListOfProxyPositions)
+		{
+			Node* node = AddNode(transformMat * glm::vec4(position, 1.0f), mNodeRadius);
+
+			node->SetLocked(IsNodeLocked(node));
+		}
+	}
+
+	void SoftBodyForProxy::SetupSticks()
+	{
+		mListOfSticks.reserve(mListOfProxySticks.size());
+		mStickPool.Reserve(mListOfProxySticks.size());
+
+		for (std::pair<unsigned int, unsigned int>& stick : mListOfProxySticks)
+		{
+			AddStick(mListOfNodes[stick.first], mListOfNodes[stick.second]);
+		}
+	}
+
+	void SoftBodyForProxy::SetupSkinWeights()
+	{
+		// Inverse distance weights to the nearest nodes, searched in the surrounding cells.
+		// Whatever the blended rest position misses is kept as a per vertex offset.
+
+		const float minDistance = 0.0001f;
+
+		float cellSize = mProxyCellSize;
+
+		if (mUseAuthoredLattice)
+		{
+			// Authored lattices have no cell size, size cells by the average stick length instead
+			float totalLength = 0;
+
+			for (std::pair<unsigned int, unsigned int>& stick : mListOfProxySticks)
+			{
+				totalLength += glm::distance(mListOfProxyPositions[stick.first], mListOfProxyPositions[stick.second]);
+			}
+
+			if (!mListOfProxySticks.empty())
+			{
+				cellSize = totalLength / (float)mListOfProxySticks.size();
+			}
+		}
+
+		//GetCell divides by the cell size
+		if (cellSize < minDistance) cellSize = 1.0f;
+
+		std::unordered_map<long long, std::vector<unsigned int>> grid;
+
+		for (unsigned int i = 0; i < mListOfProxyPositions.size(); i++)
+		{
+			grid[SpatialHashGrid::GetCellKey(SpatialHashGrid::GetCell(mListOfProxyPositions[i], cellSize))].push_back(i);
+		}
+
+		unsigned int numOfInfluences = glm::clamp(mNumOfInfluences, 1u, MAX_PROXY_INFLUENCES);
+
+		for (MeshAndMaterial* mesh : meshes)
+		{
+			for (Vertex& vertex : mesh->mesh->vertices)
+			{
+				ProxySkinnedVertex skinnedVertex;
+				skinnedVertex.mVertex = &vertex;
+
+				float distances[MAX_PROXY_INFLUENCES];
+
+				glm::ivec3 cell = SpatialHashGrid::GetCell(vertex.positions, cellSize);
+
+				size_t numOfVisited = 0;
+
+				// Grows one ring of cells at a time. Nodes beyond ring r are at least r cells away, so the
+				// search stops once the K-th closest node is nearer than that or every node was seen.
+				for (int searchRadius = 0; numOfVisited < mListOfProxyPositions.size(); searchRadius++)
+				{
+					if (skinnedVertex.mNumOfInfluences == numOfInfluences &&
+						distances[numOfInfluences - 1] <= (searchRadius - 1) * cellSize) break;
+
+					for (int x = -searchRadius; x <= searchRadius; x++)
+					for (int y = -searchRadius; y <= searchRadius; y++)
+					for (int z = -searchRadius; z <= searchRadius; z++)
+					{
+						//Only the shell, the inner cells were searched by the smaller rings
+						if (glm::max(glm::abs(x), glm::max(glm::abs(y), glm::abs(z))) != searchRadius) continue;
+
+						std::unordered_map<long long, std::vector<unsigned int>>::iterator it =
+							grid.find(SpatialHashGrid::GetCellKey(cell + glm::ivec3(x, y, z)));
+
+						if (it == grid.end()) continue;
+
+						numOfVisited += it->second.size();
+
+						for (unsigned int nodeIndex : it->second)
+						{
+							float distance = glm::distance(vertex.positions, mListOfProxyPositions[nodeIndex]);
+
+							// Insertion into the sorted list of closest nodes
+							unsigned int slot = skinnedVertex.mNumOfInfluences;
+
+							if (slot == numOfInfluences)
+							{
+								if (distance >= distances[slot - 1]) continue;
+								slot--;
+							}
+							else
+							{
+								skinnedVertex.mNumOfInfluences++;
+							}
+
+							while (slot > 0 && distances[slot - 1] > distance)
+							{
+								distances[slot] = distances[slot - 1];
+								skinnedVertex.mNodeIndices[slot] = skinnedVertex.mNodeIndices[slot - 1];
+								slot--;
+							}
+
+							distances[slot] = distance;
+							skinnedVertex.mNodeIndices[slot] = nodeIndex;
+						}
+					}
+				}
+
+				float totalWeight = 0;
+
+				for (unsigned int i = 0; i < skinnedVertex.mNumOfInfluences; i++)
+				{
+					skinnedVertex.mWeights[i] = 1.0f / glm::max(distances[i], minDistance);
+					totalWeight += skinnedVertex.mWeights[i];
+				}
+
+				glm::vec3 blendedPosition = glm::vec3(0);
+
+				for (unsigned int i = 0; i < skinnedVertex.mNumOfInfluences; i++)
+				{
+					skinnedVertex.mWeights[i] /= totalWeight;
+					blendedPosition += mListOfProxyPositions[skinnedVertex.mNodeIndices[i]] * skinnedVertex.mWeights[i];
+				}
+
+				skinnedVertex.mOffset = vertex.positions - blendedPosition;
+
+				mListOfSkinnedVertices.push_back(skinnedVertex);
+			}
+		}
+	}
+
+	void SoftBodyForProxy::UpdateModelVertices()
+	{
+		EnterCriticalSection(mCriticalSection);
+
+		glm::mat4 inverseMatrix = glm::inverse(transform.GetTransformMatrix());
+
+		for (size_t i = 0; i < mListOfNodes.size(); i++)
+		{
+			mListOfNodeLocalPositions[i] = inverseMatrix * glm::vec4(mListOfNodes[i]->GetPosition(), 1.0f);
+		}
+
+		for (ProxySkinnedVertex& skinnedVertex : mListOfSkinnedVertices)
+		{
+			glm::vec3 pos = skinnedVertex.mOffset;
+
+			for (unsigned int i = 0; i < skinnedVertex.mNumOfInfluences; i++)
+			{
+				pos += mListOfNodeLocalPositions[skinnedVertex.mNodeIndices[i]] * skinnedVertex.mWeights[i];
+			}
+
+			skinnedVertex.mVertex->positions = pos;
+		}
+
+		LeaveCriticalSection(mCriticalSection);
+	}
+
+	void SoftBodyForProxy::UpdateModelNormals()
+	{
+		EnterCriticalSection(mCriticalSection);
+
+		for (ProxySkinnedVertex& skinnedVertex : mListOfSkinnedVertices)
+		{
+			skinnedVertex.mVertex->normals = glm::vec3(0);
+		}
+
+		for (MeshAndMaterial* meshAndMat : meshes)
+		{
+			std::shared_ptr<Mesh>& mesh = meshAndMat->mesh;
+
+			for (size_t i = 0; i + 2 < mesh->indices.size(); i += 3)
+			{
+				Vertex& vertA = mesh->vertices[mesh->indices[i]];
+				Vertex& vertB = mesh->vertices[mesh->indices[i + 1]];
+				Vertex& vertC = mesh->vertices[mesh->indices[i + 2]];
+
+				glm::vec3 normal = glm::cross(vertB.positions - vertA.positions, vertC.positions - vertA.positions);
+
+				vertA.normals += normal;
+				vertB.normals += normal;
+				vertC.normals += normal;
+			}
+		}
+
+		for (ProxySkinnedVertex& skinnedVertex : mListOfSkinnedVertices)
+		{
+			glm::vec3& normal = skinnedVertex.mVertex->normals;
+
+			if (glm::dot(normal, normal) > 0.0f)
+			{
+				normal = glm::normalize(normal);
+			}
+		}
+
+		LeaveCriticalSection(mCriticalSection);
+	}
+
+	bool SoftBodyForProxy::IsNodeLocked(Node* node)
+	{
+		for (LockNode& lockNode : mListOfLockNodes)
+		{
+			if (glm::length(node->GetPosition() - lockNode.center) <= lockNode.radius) return true;
+		}
+
+		return false;
+	}
+
+	void SoftBodyForProxy::AddLockNode(glm::vec3 posOffset, float radius)
+	{
+		mListOfLockNodes.push_back({ transform.position + posOffset , radius });
+	}
+
+	void SoftBodyForProxy::AddForceToRandomNode(glm::vec3 velocity)
+	{
+		if (mListOfNodes.empty()) return;
+
+		int index = MathUtils::GetRandomIntNumber(0, mListOfNodes.size() - 1);
+
+		mListOfNodes[index]->SetVelocity(velocity);
+	}
+
+	void SoftBodyForProxy::Render()
+	{
+		if (!showDebugModels) return;
+
+		BaseSoftBody::Render();
+
+		for (LockNode& node : mListOfLockNodes)
+		{
+			Renderer::GetInstance().DrawSphere(node.center, node.radius, lockNodeColor);
+		}
+	}
+
+	void SoftBodyForProxy::OnPropertyDraw()
+	{
+		BaseSoftBody::OnPropertyDraw();
+	}
+
+	size_t SoftBodyForProxy::GetMemoryUsage()
+	{
+		size_t bytes = BaseSoftBody::GetMemoryUsage();
+
+		bytes += (mListOfProxyPositions.capacity() + mListOfNodeLocalPositions.capacity()) * sizeof(glm::vec3);
+		bytes += mListOfProxySticks.capacity() * sizeof(std::pair<unsigned int, unsigned int>);
+		bytes += mListOfSkinnedVertices.capacity() * sizeof(ProxySkinnedVertex);
+
+		return bytes;
+	}
+
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include "BaseSoftBody.h"
+
+namespace Verlet
+{
+	// Simulates a coarse lattice of nodes and skins the full resolution render mesh onto it,
+	// so the simulation cost does not grow with the visual detail of the mesh.
+	class SoftBodyForProxy : public BaseSoftBody
+	{
+	public:
+
+		static const unsigned int MAX_PROXY_INFLUENCES = 4;
+
+		struct ProxySkinnedVertex
+		{
+			Vertex* mVertex = nullptr;
+
+			unsigned int mNumOfInfluences = 0;
+			unsigned int mNodeIndices[MAX_PROXY_INFLUENCES] = { 0 };
+			float mWeights[MAX_PROXY_INFLUENCES] = { 0 };
+
+			glm::vec3 mOffset = glm::vec3(0);		//Rest position minus the blended rest position of the nodes
+		};
+
+		struct LockNode
+		{
+			LockNode(glm::vec3 center, float radius)
+			{
+				this->center = center;
+				this->radius = radius;
+			}
+
+			glm::vec3 center = glm::vec3(0);
+			float radius = 1.0f;
+		};
+
+		SoftBodyForProxy();
+		~SoftBodyForProxy();
+
+		virtual void InitializeSoftBody();
+
+		virtual void UpdateSoftBody(float deltaTime, CRITICAL_SECTION& criticalSection);
+		virtual void Render();
+		virtual void OnPropertyDraw();
+
+		virtual void UpdateModelVertices();
+		virtual void UpdateModelNormals();
+
+		//Before Initialized. Positions are in model space, replaces the auto generated lattice
+		void SetProxyLattice(const std::vector<glm::vec3>& nodePositions,
+			const std::vector<std::pair<unsigned int, unsigned int>>& sticks);
+
+		void AddLockNode(glm::vec3 posOffset, float radius);
+		void AddForceToRandomNode(glm::vec3 velocity);
+
+		virtual size_t GetMemoryUsage();
+
+		float mProxyCellSize = 1.0f;					//Model space size of a lattice cell when auto generating
+		unsigned int mNumOfInfluences = MAX_PROXY_INFLUENCES;
+
+	private:
+		void GenerateLatticeFromMesh();
+		void SetupNodes();
+		void SetupSticks();
+		void SetupSkinWeights();
+
+		bool IsNodeLocked(Node* node);
+
+		const glm::vec4 lockNodeColor = glm::vec4(0.0f, 0.0f, 1.0f, 1.0f);
+
+		bool mUseAuthoredLattice = false;
+
+		std::vector<glm::vec3> mListOfProxyPositions;
+		std::vector<std::pair<unsigned int, unsigned int>> mListOfProxySticks;
+
+		std::vector<glm::vec3> mListOfNodeLocalPositions;
+		std::vector<ProxySkinnedVertex> mListOfSkinnedVertices;
+		std::vector<LockNode> mListOfLockNodes;
+	};
+
+}
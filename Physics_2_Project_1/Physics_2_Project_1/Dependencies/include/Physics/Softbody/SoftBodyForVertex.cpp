@@ -38,12 +38,11 @@ namespace Verlet
 	{
 		mListOfVertices.clear();
 		mListOfIndices.clear();
-		mListOfNodes.clear();
-		mListOfSticks.clear();
+		mListOfNodeTriangles.clear();
+		ReleaseTopology();
 		mListOfCollidersToCheck.clear();
 		mListOfLockedNodes.clear();
 
-		glm::mat4 transformMatrix = transform.GetTransformMatrix();
 		/*glm::mat4 transformMatrix = glm::translate(glm::mat4(1.0f), glm::vec3(0))
 			* glm::mat4(transform.quaternionRotation)
 			* glm::scale(glm::mat4(1.0f), transform.scale);*/
@@ -51,13 +50,25 @@ namespace Verlet
 		int i = 0;
 		int prevSize = 0;
 
+		size_t numOfVertices = 0;
+		size_t numOfIndices = 0;
+
+		for (MeshAndMaterial* mesh : meshes)
+		{
+			numOfVertices += mesh->mesh->vertices.size();
+			numOfIndices += mesh->mesh->indices.size();
+		}
+
+		mListOfVertices.reserve(numOfVertices);
+		mListOfIndices.reserve(numOfIndices);
+
 		for (MeshAndMaterial* mesh : meshes)
 		{
 			prevSize = mListOfVertices.size();
 
-			for (Vertex& vertexInMesh : mesh->mesh->vertices)
+			for (unsigned int j = 0; j < mesh->mesh->vertices.size(); j++)
 			{
-				mListOfVertices.push_back({ vertexInMesh, transformMatrix });
+				mListOfVertices.push_back({ mesh->mesh.get(), j });
 			}
 			for (unsigned int& indexInMesh : mesh->mesh->indices)
 			{
@@ -69,6 +80,7 @@ namespace Verlet
 
 		SetupNodes();
 		SetupSticks();
+		SetupTethers();
 
 	}
 
@@ -80,29 +92,65 @@ namespace Verlet
 	void SoftBodyForVertex::SetupNodes()
 	{
 		mListOfNodes.reserve(mListOfVertices.size());
+		mNodePool.Reserve(mListOfVertices.size());
 		glm::mat4 transformMat = transform.GetTransformMatrix();
 
-		for (PointerToVertex& pos : mListOfVertices)
+		for (NodeVertex& vertex : mListOfVertices)
 		{
-			std::vector<PointerToVertex> posVector;
-			posVector.push_back(pos);
+			AddNode(transformMat * glm::vec4(vertex.Get().positions, 1.0f), mNodeRadius);
+		}
 
-			Node* node = new Node(posVector, transformMat, mNodeRadius);
+		BuildNodeGrid();
 
+		std::vector<unsigned int> nodesInRange;
 
-			if (IsNodeLocked(node))
+		for (LockNode& lockNode : mListOfLockNodes)
+		{
+			nodesInRange.clear();
+			mNodeGrid.QueryRadius(lockNode.center, lockNode.radius, nodesInRange);
+
+			for (unsigned int nodeIndex : nodesInRange)
 			{
-				node->mIsLocked = true;
+				Node* node = mListOfNodes[nodeIndex];
+
+				if (node->IsLocked()) continue;
 
+				node->SetLocked(true);
 				mListOfLockedNodes.push_back(node);
 			}
+		}
+	}
+
+	void SoftBodyForVertex::BuildNodeGrid()
+	{
+		// Cells sized to the largest query made during initialization
+
+		float cellSize = mLockAffectDisatance;
 
-			mListOfNodes.push_back(node);
+		for (LockNode& lockNode : mListOfLockNodes)
+		{
+			cellSize = glm::max(cellSize, lockNode.radius);
 		}
+
+		if (cellSize <= 0) cellSize = 1.0f;
+
+		std::vector<glm::vec3> positions;
+		positions.reserve(mListOfNodes.size());
+
+		for (Node* node : mListOfNodes)
+		{
+			positions.push_back(node->GetPosition());
+		}
+
+		mNodeGrid.Build(positions, cellSize);
 	}
 
 	void SoftBodyForVertex::SetupSticks()
 	{
+		mListOfSticks.reserve(mListOfIndices.size());
+		mStickPool.Reserve(mListOfIndices.size());
+
+		mListOfNodeTriangles.resize(mListOfNodes.size());
 
 		for (unsigned int i = 0; i < mListOfIndices.size(); i += 3)
 		{
@@ -113,54 +161,50 @@ namespace Verlet
 			Node* node2 = mListOfNodes[mListOfIndices[(index2)].mLocalIndex];
 			Node* node3 = mListOfNodes[mListOfIndices[(index3)].mLocalIndex];
 
-			node1->mListOfIndexs.push_back(mListOfIndices[i].mLocalIndex);
-			node1->mListOfIndexs.push_back(mListOfIndices[index2].mLocalIndex);
-			node1->mListOfIndexs.push_back(mListOfIndices[index3].mLocalIndex);
+			int triangleIndex = i / 3;
 
-			node2->mListOfIndexs.push_back(mListOfIndices[i].mLocalIndex);
-			node2->mListOfIndexs.push_back(mListOfIndices[index2].mLocalIndex);
-			node2->mListOfIndexs.push_back(mListOfIndices[index3].mLocalIndex);
-
-			node3->mListOfIndexs.push_back(mListOfIndices[i].mLocalIndex);
-			node3->mListOfIndexs.push_back(mListOfIndices[index2].mLocalIndex);
-			node3->mListOfIndexs.push_back(mListOfIndices[index3].mLocalIndex);
-			
+			for (unsigned int j = i; j < i + 3; j++)
+			{
+				mListOfNodeTriangles[mListOfIndices[j].mLocalIndex].push_back(triangleIndex);
+			}
 
-			mListOfSticks.push_back(new Stick(node1, node2));
-			mListOfSticks.push_back(new Stick(node2, node3));
-			mListOfSticks.push_back(new Stick(node3, node1));
+			AddStick(node1, node2, triangleIndex);
+			AddStick(node2, node3, triangleIndex);
+			AddStick(node3, node1, triangleIndex);
 		}
 
 
-		for (Node* node : mListOfNodes)
+		if (mLockAffectDisatance <= 0) return;
+
+		std::vector<unsigned int> nodesInRange;
+
+		for (Node* lockedNode : mListOfLockedNodes)
 		{
-			for (Node* otherNode : mListOfLockedNodes)
-			{
-				if (node == otherNode) continue;
+			nodesInRange.clear();
+			mNodeGrid.QueryRadius(lockedNode->GetPosition(), mLockAffectDisatance, nodesInRange);
 
-				float magnitude = glm::dot(otherNode->mCurrentPosition, node->mCurrentPosition);
+			for (unsigned int nodeIndex : nodesInRange)
+			{
+				Node* node = mListOfNodes[nodeIndex];
 
+				if (node == lockedNode) continue;
 
-				if (magnitude * magnitude < mLockAffectDisatance * mLockAffectDisatance)
-				{
-					mListOfSticks.push_back(new Stick(node, otherNode));
-				}
+				AddStick(node, lockedNode);
 			}
 		}
 
-
-
 	}
 
 	void SoftBodyForVertex::UpdateModelVertices()
 	{
 		EnterCriticalSection(mCriticalSection);
 
-		for (Node* node : mListOfNodes)
+		glm::mat4 inverseTransform = glm::inverse(transform.GetTransformMatrix());
+
+		//Node i was created from vertex i
+		for (size_t i = 0; i < mListOfNodes.size(); i++)
 		{
-			node->mPointerToVertices[0].mPointerToVertex->positions =
-				glm::inverse(transform.GetTransformMatrix()) * glm::vec4(node->mCurrentPosition, 1.0f);
-			//node->mPointerToVertices[0].mPointerToVertex->enabled = node->mEnabled ? 1.0f : 0.0f;
+			mListOfVertices[i].Get().positions = inverseTransform * glm::vec4(mListOfNodes[i]->GetPosition(), 1.0f);
 		}
 
 		LeaveCriticalSection(mCriticalSection);
@@ -171,9 +215,9 @@ namespace Verlet
 	{
 		EnterCriticalSection(mCriticalSection);
 
-		for (PointerToVertex& vertex : mListOfVertices)
+		for (NodeVertex& vertex : mListOfVertices)
 		{
-			vertex.mPointerToVertex->normals = glm::vec3(0);
+			vertex.Get().normals = glm::vec3(0);
 		}
 
 		//LeaveCriticalSection(mCriticalSection);
@@ -212,29 +256,14 @@ namespace Verlet
 
 		//EnterCriticalSection(mCriticalSection);
 
-		for (PointerToVertex& vertex : mListOfVertices)
+		for (NodeVertex& vertex : mListOfVertices)
 		{
-			vertex.mPointerToVertex->normals = glm::normalize(vertex.mPointerToVertex->normals);
+			vertex.Get().normals = glm::normalize(vertex.Get().normals);
 		}
 		LeaveCriticalSection(mCriticalSection);
 
 	}
 
-	bool SoftBodyForVertex::IsNodeLocked(Node* node)
-	{
-		for (LockNode& lockNode : mListOfLockNodes)
-		{
-			float length = glm::length(node->mCurrentPosition - lockNode.center);
-
-			if (length > lockNode.radius) continue;
-
-			return true;
-
-		}
-
-		return false;
-	}
-
 
 	void SoftBodyForVertex::Render()
 	{
@@ -263,18 +292,20 @@ namespace Verlet
 	{
 		int index = MathUtils::GetRandomIntNumber(0, mListOfNodes.size() - 1);
 
-		mListOfNodes[index]->velocity = velocity;
+		mListOfNodes[index]->SetVelocity(velocity);
 	}
 
 	void SoftBodyForVertex::DisconnectRandomStick()
 	{
-		Stick* stick = mListOfSticks[MathUtils::GetRandomIntNumber(0, mListOfSticks.size())];
+		if (mListOfSticks.empty()) return;
+
+		Stick* stick = mListOfSticks[MathUtils::GetRandomIntNumber(0, mListOfSticks.size() - 1)];
 		DisconnectStick(stick);
 	}
 
 	void SoftBodyForVertex::DisconnectRandomNode()
 	{
-		Node* node = mListOfNodes[MathUtils::GetRandomIntNumber(0, mListOfNodes.size())];
+		Node* node = mListOfNodes[MathUtils::GetRandomIntNumber(0, mListOfNodes.size() - 1)];
 		
 		for (Stick* stick : node->mListOfConnectedSticks)
 		{
@@ -282,4 +313,224 @@ namespace Verlet
 		}
 	}
 
+	void SoftBodyForVertex::OnStickRemoved(Stick* stick)
+	{
+		// Neighbouring triangles have their own stick along the shared edge, tear those too
+		// so the cloth actually separates instead of hanging on the twin.
+		for (Stick* otherStick : stick->mNodeA->mListOfConnectedSticks)
+		{
+			if (otherStick->mNodeA == stick->mNodeB || otherStick->mNodeB == stick->mNodeB)
+			{
+				DisconnectStick(otherStick);
+			}
+		}
+
+		if (stick->mTriangleIndex < 0) return;
+
+		SplitNode(GetCornerNode(stick->mTriangleIndex, stick->mNodeA));
+		SplitNode(GetCornerNode(stick->mTriangleIndex, stick->mNodeB));
+	}
+
+	unsigned int SoftBodyForVertex::GetCornerNode(int triangleIndex, Node* node)
+	{
+		unsigned int index = triangleIndex * 3;
+
+		for (unsigned int i = index; i < index + 3; i++)
+		{
+			if (mListOfNodes[mListOfIndices[i].mLocalIndex] == node) return mListOfIndices[i].mLocalIndex;
+		}
+
+		return mListOfIndices[index].mLocalIndex;
+	}
+
+	bool SoftBodyForVertex::AreTrianglesJoined(unsigned int nodeIndex, unsigned int triangleA, unsigned int triangleB)
+	{
+		// Joined when both triangles have an edge from the node to the same other node
+		// and at least one triangle stick still holds that edge
+
+		Node* node = mListOfNodes[nodeIndex];
+
+		for (unsigned int i = triangleA * 3; i < triangleA * 3 + 3; i++)
+		{
+			unsigned int otherIndex = mListOfIndices[i].mLocalIndex;
+
+			if (otherIndex == nodeIndex) continue;
+
+			bool isShared = false;
+
+			for (unsigned int j = triangleB * 3; j < triangleB * 3 + 3; j++)
+			{
+				if (mListOfIndices[j].mLocalIndex == otherIndex) isShared = true;
+			}
+
+			if (!isShared) continue;
+
+			Node* otherNode = mListOfNodes[otherIndex];
+
+			for (Stick* stick : node->mListOfConnectedSticks)
+			{
+				if (!stick->isConnected || stick->mTriangleIndex < 0) continue;
+
+				if (stick->mNodeA == otherNode || stick->mNodeB == otherNode) return true;
+			}
+		}
+
+		return false;
+	}
+
+	void SoftBodyForVertex::SplitNode(unsigned int nodeIndex)
+	{
+		// The triangles around the node fall into fans joined by intact edges. The first fan
+		// keeps the node, every other fan gets its own copy of the node and of the render
+		// vertex, so the mesh opens where the simulation did.
+
+		std::vector<unsigned int> triangles = mListOfNodeTriangles[nodeIndex];
+
+		if (triangles.size() < 2) return;
+
+		std::vector<int> fans(triangles.size(), -1);
+		std::vector<size_t> stack;
+		int numOfFans = 0;
+
+		for (size_t i = 0; i < triangles.size(); i++)
+		{
+			if (fans[i] != -1) continue;
+
+			fans[i] = numOfFans;
+			stack.push_back(i);
+
+			while (!stack.empty())
+			{
+				size_t current = stack.back();
+				stack.pop_back();
+
+				for (size_t j = 0; j < triangles.size(); j++)
+				{
+					if (fans[j] != -1 || !AreTrianglesJoined(nodeIndex, triangles[current], triangles[j])) continue;
+
+					fans[j] = numOfFans;
+					stack.push_back(j);
+				}
+			}
+
+			numOfFans++;
+		}
+
+		if (numOfFans < 2) return;
+
+		Node* node = mListOfNodes[nodeIndex];
+
+		mListOfNodeTriangles[nodeIndex].clear();
+
+		for (size_t i = 0; i < triangles.size(); i++)
+		{
+			if (fans[i] == 0) mListOfNodeTriangles[nodeIndex].push_back(triangles[i]);
+		}
+
+		for (int fan = 1; fan < numOfFans; fan++)
+		{
+			unsigned int newIndex = DuplicateNode(nodeIndex);
+			Node* newNode = mListOfNodes[newIndex];
+			unsigned int newVertexIndex = mListOfVertices[newIndex].mVertexIndex;
+
+			for (size_t i = 0; i < triangles.size(); i++)
+			{
+				if (fans[i] != fan) continue;
+
+				mListOfNodeTriangles[newIndex].push_back(triangles[i]);
+
+				for (unsigned int j = triangles[i] * 3; j < triangles[i] * 3 + 3; j++)
+				{
+					if (mListOfIndices[j].mLocalIndex != nodeIndex) continue;
+
+					mListOfIndices[j].mLocalIndex = newIndex;
+					*mListOfIndices[j].mPointerToIndex = newVertexIndex;
+				}
+			}
+
+			// Move the sticks of the fan's triangles over to the copy
+			std::vector<Stick*>& sticks = node->mListOfConnectedSticks;
+
+			for (size_t i = 0; i < sticks.size(); )
+			{
+				Stick* stick = sticks[i];
+
+				bool inFan = false;
+
+				for (size_t j = 0; j < triangles.size(); j++)
+				{
+					if (fans[j] == fan && (int)triangles[j] == stick->mTriangleIndex) inFan = true;
+				}
+
+				if (!inFan)
+				{
+					i++;
+					continue;
+				}
+
+				if (stick->mNodeA == node) stick->mNodeA = newNode;
+				if (stick->mNodeB == node) stick->mNodeB = newNode;
+
+				newNode->mListOfConnectedSticks.push_back(stick);
+				sticks[i] = sticks.back();
+				sticks.pop_back();
+			}
+		}
+	}
+
+	unsigned int SoftBodyForVertex::DuplicateNode(unsigned int nodeIndex)
+	{
+		Node* node = mListOfNodes[nodeIndex];
+
+		Node* newNode = AddNode(node->GetPosition(), node->mRadius, node->IsLocked());
+		newNode->SetOldPosition(node->GetOldPosition());
+		newNode->SetVelocity(node->GetVelocity());
+		newNode->SetColliding(node->IsColliding());
+		newNode->SetApplyGravity(node->ShouldApplyGravity());
+
+		NodeVertex nodeVertex = mListOfVertices[nodeIndex];
+		Vertex vertex = nodeVertex.Get();
+
+		nodeVertex.mMesh->vertices.push_back(vertex);
+		nodeVertex.mVertexIndex = nodeVertex.mMesh->vertices.size() - 1;
+
+		unsigned int newIndex = newNode->mIndex;
+
+		mListOfVertices.push_back(nodeVertex);
+		mListOfNodeTriangles.push_back({});
+
+		if (node->IsLocked())
+		{
+			mListOfLockedNodes.push_back(newNode);
+		}
+
+		for (size_t i = 0, count = mListOfTethers.size(); i < count; i++)
+		{
+			if (mListOfTethers[i].mNode != node) continue;
+
+			mListOfTethers.push_back({ newNode, mListOfTethers[i].mAnchor, mListOfTethers[i].mMaxLength });
+			break;
+		}
+
+		return newIndex;
+	}
+
+	size_t SoftBodyForVertex::GetMemoryUsage()
+	{
+		size_t bytes = BaseSoftBody::GetMemoryUsage();
+
+		bytes += mListOfVertices.capacity() * sizeof(NodeVertex);
+		bytes += mListOfIndices.capacity() * sizeof(PointerToIndex);
+
+		for (std::vector<unsigned int>& triangles : mListOfNodeTriangles)
+		{
+			bytes += triangles.capacity() * sizeof(unsigned int);
+		}
+
+		bytes += mListOfLockedNodes.capacity() * sizeof(Node*);
+		bytes += mNodeGrid.GetMemoryUsage();
+
+		return bytes;
+	}
+
 }
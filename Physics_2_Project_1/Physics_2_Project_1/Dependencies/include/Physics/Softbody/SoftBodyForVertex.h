@@ -1,5 +1,6 @@
 #pragma once
 #include "BaseSoftBody.h"
+#include "SpatialHashGrid.h"
 
 namespace Verlet
 {
@@ -19,6 +20,19 @@ namespace Verlet
 			float radius = 1.0f;
 		};
 
+		// Render vertex moved by a node, kept by index since tearing appends to the mesh vertices
+		struct NodeVertex
+		{
+			NodeVertex(Mesh* mesh, unsigned int vertexIndex) :
+				mMesh{ mesh },
+				mVertexIndex{ vertexIndex } {};
+
+			Vertex& Get() const { return mMesh->vertices[mVertexIndex]; }
+
+			Mesh* mMesh = nullptr;
+			unsigned int mVertexIndex = 0;
+		};
+
 
 		SoftBodyForVertex();
 		~SoftBodyForVertex();
@@ -40,22 +54,34 @@ namespace Verlet
 
 		void AddLockNode(glm::vec3 posOffset, float radius);
 
-		bool IsNodeLocked(Node* node);
+		virtual size_t GetMemoryUsage();
 
 		float mLockAffectDisatance = 0.0f;
 
 
+	protected:
+		virtual void OnStickRemoved(Stick* stick);
+
 	private:
 		void SetupNodes();
 		void SetupSticks();
+		void BuildNodeGrid();
+
+		void SplitNode(unsigned int nodeIndex);
+		unsigned int DuplicateNode(unsigned int nodeIndex);
+		unsigned int GetCornerNode(int triangleIndex, Node* node);
+		bool AreTrianglesJoined(unsigned int nodeIndex, unsigned int triangleA, unsigned int triangleB);
 
 		
 
 		const glm::vec4 lockNodeColor = glm::vec4(0.0f, 0.0f, 1.0f, 1.0f);
 
-		std::vector<PointerToVertex> mListOfVertices;
-		std::vector<PointerToIndex> mListOfIndices;
+		std::vector<NodeVertex> mListOfVertices;			//mListOfVertices[i] is moved by mListOfNodes[i]
+		std::vector<PointerToIndex> mListOfIndices;			//Triangle corners, mLocalIndex is the node of the corner
+		std::vector<std::vector<unsigned int>> mListOfNodeTriangles;	//Triangles with a corner on node i
 		std::vector<LockNode> mListOfLockNodes;				//Position Offset from center that calculates which nodes to lock based on radius
+
+		SpatialHashGrid mNodeGrid;							//Node positions at initialization
 		
 
 protected:
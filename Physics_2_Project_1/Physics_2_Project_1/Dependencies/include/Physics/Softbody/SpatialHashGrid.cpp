@@ -0,0 +1,88 @@
+#include "SpatialHashGrid.h"
+
+#include <algorithm>
+
+long long SpatialHashGrid::GetCellKey(const glm::ivec3& cell)
+{
+	const long long mask = (1 << 21) - 1;
+
+	return ((long long)(cell.x & mask)) | ((long long)(cell.y & mask) << 21) | ((long long)(cell.z & mask) << 42);
+}
+
+glm::ivec3 SpatialHashGrid::GetCell(const glm::vec3& position, float cellSize)
+{
+	return glm::ivec3(glm::floor(position / cellSize));
+}
+
+void SpatialHashGrid::Build(const std::vector<glm::vec3>& positions, float cellSize)
+{
+	mCellSize = cellSize;
+	mListOfPositions = positions;
+
+	mListOfCells.clear();
+	mListOfCells.reserve(positions.size());
+
+	std::vector<std::pair<long long, unsigned int>> keyAndIndex;
+	keyAndIndex.reserve(positions.size());
+
+	for (unsigned int i = 0; i < positions.size(); i++)
+	{
+		keyAndIndex.push_back({ GetCellKey(GetCell(positions[i], cellSize)), i });
+	}
+
+	std::sort(keyAndIndex.begin(), keyAndIndex.end());
+
+	mListOfSortedIndices.resize(keyAndIndex.size());
+
+	for (unsigned int i = 0; i < keyAndIndex.size(); i++)
+	{
+		mListOfSortedIndices[i] = keyAndIndex[i].second;
+
+		CellRange& range = mListOfCells[keyAndIndex[i].first];
+
+		if (range.mCount == 0)
+		{
+			range.mStart = i;
+		}
+
+		range.mCount++;
+	}
+}
+
+void SpatialHashGrid::QueryRadius(const glm::vec3& center, float radius, std::vector<unsigned int>& outIndices) const
+{
+	glm::ivec3 minCell = GetCell(center - glm::vec3(radius), mCellSize);
+	glm::ivec3 maxCell = GetCell(center + glm::vec3(radius), mCellSize);
+
+	float sqRadius = radius * radius;
+
+	for (int x = minCell.x; x <= maxCell.x; x++)
+	for (int y = minCell.y; y <= maxCell.y; y++)
+	for (int z = minCell.z; z <= maxCell.z; z++)
+	{
+		std::unordered_map<long long, CellRange>::const_iterator it = mListOfCells.find(GetCellKey(glm::ivec3(x, y, z)));
+
+		if (it == mListOfCells.end()) continue;
+
+		for (unsigned int i = it->second.mStart; i < it->second.mStart + it->second.mCount; i++)
+		{
+			unsigned int index = mListOfSortedIndices[i];
+
+			glm::vec3 diff = mListOfPositions[index] - center;
+
+			if (glm::dot(diff, diff) <= sqRadius)
+			{
+				outIndices.push_back(index);
+			}
+		}
+	}
+}
+
+size_t SpatialHashGrid::GetMemoryUsage() const
+{
+	//Map entries are counted as key, value and the bucket link
+	return mListOfPositions.capacity() * sizeof(glm::vec3) +
+		mListOfSortedIndices.capacity() * sizeof(unsigned int) +
+		mListOfCells.size() * (sizeof(long long) + sizeof(CellRange) + sizeof(void*)) +
+		mListOfCells.bucket_count() * sizeof(void*);
+}
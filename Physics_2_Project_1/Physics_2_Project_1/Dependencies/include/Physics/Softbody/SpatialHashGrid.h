@@ -0,0 +1,34 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <unordered_map>
+#include <vector>
+
+// Static uniform grid over a set of points, built once and queried by radius.
+// Points are sorted by cell so each cell is one contiguous range of indices.
+class SpatialHashGrid
+{
+public:
+
+	static long long GetCellKey(const glm::ivec3& cell);
+	static glm::ivec3 GetCell(const glm::vec3& position, float cellSize);
+
+	void Build(const std::vector<glm::vec3>& positions, float cellSize);
+	void QueryRadius(const glm::vec3& center, float radius, std::vector<unsigned int>& outIndices) const;
+
+	size_t GetMemoryUsage() const;
+
+private:
+
+	struct CellRange
+	{
+		unsigned int mStart = 0;
+		unsigned int mCount = 0;
+	};
+
+	float mCellSize = 1.0f;
+
+	std::vector<glm::vec3> mListOfPositions;
+	std::vector<unsigned int> mListOfSortedIndices;
+	std::unordered_map<long long, CellRange> mListOfCells;
+};